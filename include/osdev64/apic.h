@@ -15,6 +15,14 @@
 #include "osdev64/axiom.h"
 
 
+// IDT index of the interrupt that asks a processor to run a function
+// for another processor (see k_smp_call)
+#define APIC_IPI_CALL 0x42
+
+// IDT index of the interrupt that wakes an idle processor
+#define APIC_IPI_WAKE 0x43
+
+
 /**
  * Initializes the APIC interface.
  * This must be called before any other functions in this interface.
@@ -42,6 +50,13 @@ int k_apic_available();
  */
 void k_lapic_enable();
 
+/**
+ * Enables the local APIC of an application processor.
+ * Unlike k_lapic_enable, this doesn't install any ISRs, since the IDT
+ * is shared by all processors.
+ */
+void k_lapic_enable_cpu();
+
 /**
  * Gets the ID of the current APIC.
  *
@@ -67,6 +82,99 @@ uint32_t k_lapic_get_version();
  */
 uint32_t k_lapic_get_maxlvt();
 
+/**
+ * Measures how fast the current local APIC's timer counts by comparing
+ * it with the PIT, and then starts it as a periodic timer that ticks
+ * TIMER_HZ times per second. Each tick advances the timer wheel and
+ * counts against the current task's time slice.
+ * This must be called after the local APIC is enabled.
+ */
+void k_lapic_timer_init();
+
+/**
+ * Starts the current local APIC's timer as a periodic timer using the
+ * rate measured by k_lapic_timer_init. This is how the application
+ * processors start their timers, since only the BSP's is calibrated.
+ * Only the BSP's timer advances the timer wheel, but every processor's
+ * timer counts against its own current task's time slice.
+ */
+void k_lapic_timer_start();
+
+/**
+ * Halts the processor until an interrupt arrives or the specified number
+ * of PIT ticks have passed, whichever comes first.
+ * If the local APIC timer has been calibrated, the periodic tick is
+ * replaced by a one-shot countdown while the processor is halted, and the
+ * ticks that were skipped are then given to the timer wheel. This keeps
+ * an idle processor from waking up on every tick.
+ * This must be called with interrupts disabled, and interrupts are still
+ * disabled when it returns. Only the BSP may call this, since it's the
+ * only processor whose timer advances the timer wheel.
+ *
+ * Params:
+ *   uint64_t - the maximum number of ticks to halt for
+ */
+void k_lapic_idle(uint64_t ticks);
+
+/**
+ * Stops the current local APIC's timer and halts the processor until an
+ * interrupt arrives, and then starts the periodic tick again.
+ * This is how the application processors idle, since their ticks only
+ * count against the time slices of their tasks.
+ * This must be called with interrupts disabled, and interrupts are still
+ * disabled when it returns.
+ */
+void k_lapic_halt();
+
+/**
+ * Sends an INIT IPI to a processor, which resets it and makes it wait
+ * for a startup IPI.
+ *
+ * Params:
+ *   uint32_t - the local APIC ID of the processor
+ */
+void k_lapic_send_init(uint32_t id);
+
+/**
+ * Sends a startup IPI to a processor that is waiting for one.
+ * The processor starts executing in real mode at the beginning of the
+ * specified page.
+ *
+ * Params:
+ *   uint32_t - the local APIC ID of the processor
+ *   uint8_t - the number of a page below 1 MiB
+ */
+void k_lapic_send_startup(uint32_t id, uint8_t page);
+
+/**
+ * Sends a fixed IPI to a processor, which raises the interrupt
+ * with the specified vector on that processor.
+ *
+ * Params:
+ *   uint32_t - the local APIC ID of the processor
+ *   uint8_t - the vector of the interrupt
+ */
+void k_lapic_send_ipi(uint32_t id, uint8_t vector);
+
+/**
+ * Sends a fixed IPI to every processor except the one that calls this.
+ * Every processor that can receive it must have loaded the IDT, so this
+ * can't be used while APs are still starting.
+ *
+ * Params:
+ *   uint8_t - the vector of the interrupt
+ */
+void k_lapic_send_ipi_others(uint8_t vector);
+
+/**
+ * Sends a fixed IPI to the processor that calls this.
+ * The interrupt is raised once interrupts are enabled.
+ *
+ * Params:
+ *   uint8_t - the vector of the interrupt
+ */
+void k_lapic_send_ipi_self(uint8_t vector);
+
 
 //============================================================
 // I/O APIC
@@ -0,0 +1,90 @@
+#ifndef JEP_CLOCK_H
+#define JEP_CLOCK_H
+
+
+// Clock Interface
+//
+// Functions for measuring time with more precision than the timer tick.
+//
+// A clock source is a counter that increases at a fixed rate. At boot,
+// the best clock source is chosen and its rate is measured, if it isn't
+// already known. After that, the number of nanoseconds since the clock started is
+// calculated by converting the counter with a multiply and a shift,
+// so reading the time doesn't need any division.
+//
+// The time stamp counter (TSC) is used if the processor reports that it
+// is invariant, which means that it counts at the same rate regardless of
+// power states. Otherwise, the HPET's main counter is used if there is an
+// HPET. Each source has to pass a quick test, which checks that it never
+// goes backwards and, for the HPET, that it counts at the rate it reports.
+// If none of them pass, then the timer tick is used, which only has a
+// resolution of one tick. When the HPET passes, it's also used to measure
+// the rate of the TSC, since it's much more precise than the PIT.
+
+
+#include "osdev64/axiom.h"
+
+
+/**
+ * Chooses a clock source and measures its rate.
+ * This must be called after the PIT and HPET are initialized, and before
+ * any other functions in this interface except k_time_cycles.
+ */
+void k_clock_init();
+
+
+/**
+ * Gets the name of the clock source.
+ *
+ * Returns:
+ *   const char* - the name of the clock source
+ */
+const char* k_clock_name();
+
+
+/**
+ * Gets the number of nanoseconds since the clock started.
+ * The result never goes backwards.
+ *
+ * Returns:
+ *   uint64_t - the current time in nanoseconds
+ */
+uint64_t k_time_ns();
+
+
+/**
+ * Gets the current value of the processor's time stamp counter.
+ * This is the cheapest way to take a timestamp, but the rate at which
+ * it counts is only known if the TSC is the clock source.
+ *
+ * Returns:
+ *   uint64_t - the number of TSC cycles since the processor was reset
+ */
+uint64_t k_time_cycles();
+
+
+/**
+ * Waits for at least the specified number of microseconds.
+ * This is a form of busy waiting, so it should only be used for short
+ * delays, such as the ones that devices need between commands.
+ * It works with interrupts disabled.
+ *
+ * Params:
+ *   uint64_t - the number of microseconds to wait
+ */
+void k_delay_us(uint64_t);
+
+
+/**
+ * Stops the current task for at least the specified number of nanoseconds.
+ * The current task sleeps for as many whole timer ticks as it can,
+ * and then busy waits for whatever time is left.
+ * This must only be called by a task, not an interrupt handler.
+ *
+ * Params:
+ *   uint64_t - the number of nanoseconds to wait
+ */
+void k_sleep_ns(uint64_t);
+
+
+#endif
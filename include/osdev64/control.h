@@ -84,6 +84,7 @@
 #include "osdev64/bitmask.h"
 
 
+#define CR4_PGE BM_7
 #define CR4_PCIDE BM_17
 #define CR4_PKE BM_22
 
@@ -106,6 +107,16 @@ k_regn k_get_cr0();
 void k_set_cr0(k_regn);
 
 
+/**
+ * Reads the value of control register CR2.
+ * After a page fault, CR2 contains the address that caused the fault.
+ *
+ * Returns:
+ *   k_regn - the contents of CR2
+ */
+k_regn k_get_cr2();
+
+
 /**
  * Reads the value of control register CR3.
  *
@@ -124,6 +135,23 @@ k_regn k_get_cr3();
 void k_set_cr3(k_regn);
 
 
+/**
+ * Invalidates the TLB entries for the page that contains
+ * a virtual address.
+ *
+ * Params:
+ *   k_regn - a virtual address
+ */
+void k_invlpg(k_regn);
+
+
+/**
+ * Writes back all modified cache lines to memory and invalidates
+ * the caches.
+ */
+void k_wbinvd();
+
+
 /**
  * Reads the value of control register CR4.
  *
@@ -8,11 +8,10 @@
 #define RAM_POOL_MAX 32
 
 
-// maximum number of RAM ledger entries
-#define RAM_LEDGER_MAX 5000
-
-// maximum number of virtual address map ledger entries
-#define MAP_LEDGER_MAX 1000
+// highest order of a block in the physical page allocator
+// A block of order n contains 2^n pages, so the largest block
+// that can be allocated at once is 2^20 pages (4 GiB).
+#define RAM_ORDER_MAX 20
 
 
 // the number of 64-bit entries in the GDT
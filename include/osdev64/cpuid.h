@@ -30,6 +30,18 @@ k_regn k_cpuid_rax(k_regn);
  */
 k_regn k_cpuid_rdx(k_regn);
 
+/**
+ * Executes the CPUID instruction.
+ * This function returns the value that CPUID placed in RCX.
+ *
+ * Params:
+ *   k_regn - the input for CPUID
+ *
+ * Returns:
+ *   k_regn - the result of CPUID
+ */
+k_regn k_cpuid_rcx(k_regn);
+
 /**
  * Executes the CPUID instruction to get the vendor identification string.
  * The string is placed in a buffer that is passed to this function.
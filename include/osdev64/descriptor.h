@@ -3,6 +3,8 @@
 
 #include "osdev64/axiom.h"
 
+struct k_cpu;
+
 // A descriptor is a collection of bits that locate and describe something
 // in memory. What each descriptor desribes could be anything from a piece
 // of data, or a region of memory.
@@ -195,9 +197,22 @@ typedef uint64_t sg_seg_type;
  * 2. code descriptor (offset 0x08)
  * 3. data descriptor (offset 0x10)
  * 4. TSS descriptor  (offset 0x18)
+ * The tables belong to the BSP, and they're kept in its k_cpu structure.
  */
 void k_gdt_init();
 
+/**
+ * Populates a GDT and TSS for a processor and loads them.
+ * The GDT has the same layout as the one created by k_gdt_init, but the
+ * TSS and its IST stacks belong to the processor that calls this.
+ * Loading the GDT clears the GS base, so it's pointed back at the
+ * processor's k_cpu structure afterward.
+ *
+ * Params:
+ *   struct k_cpu* - the processor that is calling this
+ */
+void k_gdt_init_cpu(struct k_cpu*);
+
 /**
  * Populates an IDT and loads it into the IDTR register.
  * The IDT initialized by this function should contain descriptors for
@@ -205,4 +220,11 @@ void k_gdt_init();
  */
 void k_idt_init();
 
+/**
+ * Loads the IDT into the IDTR register of the processor that calls it.
+ * All processors share the same IDT, so application processors only
+ * need to load it after the BSP has populated it with k_idt_init.
+ */
+void k_idt_load();
+
 #endif
\ No newline at end of file
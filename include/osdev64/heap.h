@@ -8,6 +8,29 @@
 // The heap interface can be used to allocate and free individual bytes ot
 // collections of bytes, as opposed to the physical memory manager, which
 // allocates and free memory in pages of 4096 bytes.
+//
+// Small allocations of up to 1024 bytes are taken from slabs.
+// A slab is a single page divided into objects of one size class,
+// where the size classes are the powers of two from 16 to 1024 bytes.
+// Each class keeps a list of its slabs that have free objects,
+// and each slab keeps a list of its free objects, so allocating
+// and freeing small objects never has to search for anything.
+//
+// Larger allocations are taken from heap arenas, which are runs of
+// pages obtained from the physical memory manager. Each block in an
+// arena has a header at its start, and free blocks also have a footer
+// at their end, so a freed block can be merged with the free blocks
+// on either side of it without searching. Free blocks are kept in
+// separate lists by size so that allocation never looks at allocated
+// blocks. When no free block is big enough, a new arena is created,
+// and arenas that become completely free are given back.
+//
+// Slab pages are tagged in the physical memory manager, so a free
+// finds out which allocator an address belongs to from the page that
+// contains it, without looking through the arenas.
+//
+// The heap is shared by all processors, so it's protected by a spinlock
+// that is held with interrupts disabled.
 
 
 #include "osdev64/axiom.h"
@@ -34,7 +57,7 @@ void* k_heap_alloc(size_t);
 
 /**
  * Frees a previously allocate region of memory for future use.
- *
+ * If the argument is NULL, then nothing happens.
  *
  * Params:
  *   void* - the base address of a region of allocated mmeory
@@ -0,0 +1,58 @@
+#ifndef JEP_HPET_H
+#define JEP_HPET_H
+
+
+// HPET Interface
+//
+// Functions for using the high precision event timer (HPET).
+// The HPET has a main counter that counts up at a fixed rate of at least
+// 10 MHz, and a few comparators that can each raise an interrupt when the
+// main counter reaches some value.
+//
+// The main counter is used as a clock source. One-shot events come from
+// the local APIC timer instead, which every processor has its own copy of
+// and which doesn't need an I/O APIC input, so the comparators are left
+// disabled.
+
+
+#include "osdev64/axiom.h"
+
+
+/**
+ * Finds the HPET in the ACPI tables, maps its registers into virtual
+ * address space, and starts the main counter.
+ * This must be called after the ACPI interface and paging are initialized.
+ * If there is no usable HPET, then the rest of this interface does
+ * nothing.
+ */
+void k_hpet_init();
+
+
+/**
+ * Checks to see if the HPET is available.
+ *
+ * Returns:
+ *   int - 1 if the HPET's main counter is running, otherwise 0
+ */
+int k_hpet_available();
+
+
+/**
+ * Reads the HPET's main counter.
+ *
+ * Returns:
+ *   uint64_t - the value of the main counter
+ */
+uint64_t k_hpet_read();
+
+
+/**
+ * Gets the rate at which the HPET's main counter counts.
+ *
+ * Returns:
+ *   uint64_t - the number of counts per second
+ */
+uint64_t k_hpet_hz();
+
+
+#endif
@@ -50,6 +50,13 @@ void k_disable_interrupts();
  */
 void k_enable_interrupts();
 
+
+/**
+ * Enables interrupts and halts the processor until an interrupt arrives.
+ * Interrupts are disabled when this function returns.
+ */
+void k_halt();
+
 /**
  * Executes the XCHG instruction to swap some value with a location
  * in memory.
@@ -126,6 +133,15 @@ void k_lock_spin(k_regn*);
 void k_lock_sleep(k_regn*);
 
 
+/**
+ * Executes the RDTSC instruction to read the time stamp counter.
+ *
+ * Returns:
+ *   uint64_t - the value of the time stamp counter
+ */
+uint64_t k_rdtsc();
+
+
 /**
  * Executes the XADD instruction to add the first argument to the value
  * pointed to by the second argument.
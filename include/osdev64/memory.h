@@ -12,8 +12,23 @@
 // RAM pool. Each region of memory is expected to be aligned on a 4KiB
 // boundary.
 //
-// Once the RAM pool is created, a structure called the RAM ledger is
-// created to keep record of allocations of regions of memory.
+// Once the RAM pool is created, each region in the pool is managed by a
+// binary buddy allocator. A region is divided into blocks of 2^n pages,
+// where n is called the order of the block. Each region keeps a list of
+// free blocks for every order from 0 to RAM_ORDER_MAX, so allocating and
+// freeing pages only ever touches O(log n) blocks.
+//
+// Every page in the pool is described by a page frame descriptor. The
+// descriptors are stored outside of the pages they describe, so free
+// memory is never written to by the allocator.
+//
+// An allocation can be shared by several owners, such as address spaces
+// that map the same pages copy-on-write. Each owner holds a reference,
+// and the pages are only returned to the free lists when the last
+// reference is freed.
+//
+// The free lists are shared by all processors, so they're protected by
+// a spinlock that is held with interrupts disabled.
 
 #include "osdev64/axiom.h"
 #include <stddef.h>
@@ -29,7 +44,7 @@
  *   1. obtain the memory map from the firmware
  *   2. create the RAM pool
  *   3. exit UEFI boot services
- *   3. create the RAM ledger
+ *   4. create the page frame descriptors and buddy free lists
  */
 void k_memory_init();
 
@@ -39,9 +54,11 @@ void k_memory_init();
  * A physical page is 4096 bytes (4 KiB). The argument to this function
  * specifies a number of pages to be reserved for use by the system.
  *
- * This function searches the RAM pool for a region that has not been
- * reserved in the RAM ledger. If it finds an available region, it creates
- * a new entry in the RAM ledger to mark that region as reserved.
+ * The request is rounded up to the nearest power of two pages, and the
+ * smallest free block of at least that size is taken from the first
+ * region in the RAM pool that has one. Larger blocks are split in half
+ * until the block is the right size. Any pages at the end of the block
+ * that were not requested are immediately returned to the free lists.
  *
  * Upon successfully allocating the requested number of pages, a pointer
  * to the base of the region of memory is returned. If the memory could not
@@ -56,17 +73,46 @@ void k_memory_init();
 void* k_memory_alloc_pages(size_t);
 
 
+/**
+ * Reserves a contiguous series of pages that end at or below some
+ * physical address. This is for memory that has to be reachable before
+ * the processor can use 64-bit addresses, such as the code that starts
+ * other processors, which has to be below 1 MiB.
+ * Only regions of the RAM pool that lie entirely below the limit are
+ * used. Otherwise, this works the same as k_memory_alloc_pages, and the
+ * pages are freed by k_memory_free_pages.
+ *
+ * Params:
+ *   size_t - the number of pages requested
+ *   k_regn - the highest address that the pages may end at
+ *
+ * Returns:
+ *   void* - a pointer to the region of memory or NULL on failure
+ */
+void* k_memory_alloc_below(size_t, k_regn);
+
+
 /**
  * Frees a contiguous series of pages.
- * This function looks for an entry in the RAM ledger that starts at the
- * specified address and marks it as available.
+ * The argument must be an address that was previously returned by
+ * k_memory_alloc_pages. The pages are returned to the free lists, and
+ * each freed block is merged with its buddy for as long as the buddy
+ * is also free.
  *
- * If no entry is found in the RAM ledger with a starting address that
- * matches the argument, then this function does nothing.
+ * If the address is not the start of an allocation, then this function
+ * does nothing. If the allocation has been shared, then this only drops
+ * one reference, and the pages stay allocated until the last reference
+ * is freed.
  *
- * An entry in the RAM ledger that is marked as available will not
- * necessarily be cleared of its contents immediately, but it may be
- * overwritten with new values during a later allocation.
+ * Freed pages are not cleared, so their contents may remain until they
+ * are overwritten after a later allocation.
+ *
+ * Each processor keeps a small cache of single pages that it has freed,
+ * and single page allocations are taken from it first. Pages in a cache
+ * aren't counted as free by the functions that print the RAM pool, and
+ * they can't merge with their buddies into larger blocks. Each processor
+ * holds at most SMP_PAGE_CACHE of them, and a processor gives its cached
+ * pages back to the free lists when it can't find a large enough block.
  *
  * Params:
  *   void* - a pointer to a series of pages
@@ -74,6 +120,67 @@ void* k_memory_alloc_pages(size_t);
 void k_memory_free_pages(void*);
 
 
+/**
+ * Adds a reference to a series of pages.
+ * The argument must be an address that was previously returned by
+ * k_memory_alloc_pages. Every reference must eventually be dropped by
+ * calling k_memory_free_pages.
+ * Upon success, this function returns 1.
+ * If the address is not the start of an allocation, or the allocation
+ * already has the maximum number of references (65536), then 0 is
+ * returned.
+ *
+ * Params:
+ *   void* - a pointer to a series of pages
+ *
+ * Returns:
+ *   int - 1 on success or 0 on failure
+ */
+int k_memory_share_pages(void*);
+
+
+/**
+ * Gets the number of references to a series of pages.
+ * A series of pages that has not been shared has one reference.
+ * If the address is not the start of an allocation, then 0 is returned.
+ *
+ * Params:
+ *   void* - a pointer to a series of pages
+ *
+ * Returns:
+ *   uint32_t - the number of references
+ */
+uint32_t k_memory_page_refs(void*);
+
+
+/**
+ * Sets or clears the tag of a series of pages.
+ * The tag is a single bit that belongs to whoever allocated the pages,
+ * which can use it to tell its own allocations apart. It's cleared when
+ * the pages are allocated, and the owner must clear it before freeing
+ * them.
+ *
+ * Params:
+ *   void* - a pointer to a series of pages
+ *   int - 1 to set the tag or 0 to clear it
+ */
+void k_memory_tag_pages(void*, int);
+
+
+/**
+ * Checks if an address is the start of a tagged series of pages.
+ * Only the owner of the pages changes the tag, so this doesn't take
+ * the memory lock.
+ *
+ * Params:
+ *   void* - an address
+ *
+ * Returns:
+ *   int - 1 if the address starts a tagged allocation or 0 otherwise
+ */
+int k_memory_tagged(void*);
+
+
 /**
  * This function writes the contents of the RAM pool to some output stream.
  * It is intended to be used for debugging. The actual output destination
@@ -83,11 +190,11 @@ void k_memory_print_pool();
 
 
 /**
- * This function writes the contents of the RAM ledger to some output stream.
- * It is intended to be used for debugging. The actual output destination
- * is undefined.
+ * This function writes the number of free blocks of each order to some
+ * output stream. It is intended to be used for debugging. The actual
+ * output destination is undefined.
  */
-void k_memory_print_ledger();
+void k_memory_print_orders();
 
 
 #endif
\ No newline at end of file
@@ -19,6 +19,12 @@
 // Local APIC address
 #define IA32_APIC_BASE (uint64_t)0x0B
 
+// extended features (long mode, NX)
+#define IA32_EFER (uint64_t)0xC0000080
+
+// base address of the GS segment
+#define IA32_GS_BASE (uint64_t)0xC0000101
+
 // fixed range MTRRs
 #define IA32_MTRR_FIX64K_00000 (uint64_t)0x250
 #define IA32_MTRR_FIX16K_80000 (uint64_t)0x258
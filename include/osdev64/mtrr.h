@@ -3,7 +3,7 @@
 
 /**
  * Memory Type Range Registers (MTRR) Interface.
- * Functions and data types for reading the MTRRs.
+ * Functions and data types for reading the MTRRs and programming the PAT.
  *
  */
 
@@ -18,4 +18,32 @@
  */
 void k_mtrr_print_all();
 
+/**
+ * Determines whether a range of physical addresses has the same
+ * memory type throughout according to the MTRRs.
+ * A range that can't be proven uniform is reported as not uniform.
+ * This is used to decide whether a range can be mapped with
+ * a single large page.
+ *
+ * Params:
+ *   uint64_t - the base address of a range of physical addresses
+ *   uint64_t - the size of the range in bytes
+ *
+ * Returns:
+ *   int - 1 if the range has a single memory type, otherwise 0
+ */
+int k_mtrr_is_uniform(uint64_t base, uint64_t size);
+
+/**
+ * Programs the Page Attribute Table (PAT) so that PA1 is write-combining.
+ * The other entries keep their default values, so PA0 is write-back and
+ * PA3 is uncacheable.
+ * Upon success, this function returns 1. If the processor doesn't
+ * support the PAT, then 0 is returned.
+ *
+ * Returns:
+ *   int - 1 if the PAT was programmed, otherwise 0
+ */
+int k_pat_init();
+
 #endif
\ No newline at end of file
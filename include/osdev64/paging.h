@@ -2,6 +2,7 @@
 #define JEP_PAGING_H
 
 #include "osdev64/axiom.h"
+#include "osdev64/vmem.h"
 
 
 /**
@@ -44,8 +45,14 @@
  * Paging structures that point to other paging structures do not have a
  * PAT bit.
  *
+ * Process Context Identifier (PCID):
+ *
+ * When CR4.PCIDE is set, bits [11:0] of CR3 identify the address space
+ * that TLB entries belong to, so entries from several address spaces can
+ * be kept in the TLB at once. Setting bit 63 when writing CR3 keeps the
+ * TLB entries of the new PCID instead of flushing them.
+ *
  * Stuff I haven't bothered to research:
- *   Process Context Identifier (PCIDE)
  *   Protection Key             (PKE)
  *
  */
@@ -146,16 +153,62 @@ typedef k_regn pde;
 typedef k_regn pte;
 
 
+// memory types
+// Each memory type is the index of an entry in the PAT.
+// PA1 is programmed as write-combining by k_pat_init. The other entries
+// keep their default values. If the processor has no PAT, then
+// write-combining mappings are made uncacheable instead.
+#define PAGING_WB 0 // write-back (PA0)
+#define PAGING_WC 1 // write-combining (PA1)
+#define PAGING_UC 3 // uncacheable (PA3)
+
+
+// reservation flags
+// A reserved range has no pages until they're touched. The first access
+// to a page raises a page fault, and the page fault handler maps a page
+// of physical memory there.
+#define PAGING_ZERO 0x1  // pages are filled with zeros when first touched
+#define PAGING_GUARD 0x2 // the first page is never mapped
+#define PAGING_RO 0x4    // pages are read-only and always contain zeros
+#define PAGING_PRIVATE 0x8 // the range is in the current private half
+
+
+/**
+ * An address space.
+ * The lower half of every address space (PML4 entries 0 to 255) is shared
+ * with the kernel, and contains the identity mapping of RAM and the
+ * dynamic mapping region. The upper half (PML4 entries 256 to 511) is
+ * private to the address space. Ranges reserved with PAGING_PRIVATE are
+ * placed in the first 512 GiB of it, which is mapped by PML4 entry 256.
+ * Mappings in the private half aren't global, so they're only ever
+ * in the TLB under the address space's PCID.
+ */
+typedef struct k_addr_space {
+  pml4e* pml4;    // the PML4
+  uint16_t pcid;  // process context identifier
+  uint64_t fresh; // bit n is set if processor n hasn't loaded it yet
+  uint64_t refs;  // number of users, such as tasks, that share it
+  k_vmem vmem;    // ranges reserved in the private half
+}k_addr_space;
+
+
 /**
  * Initializes paging interface.
  * This must be called before any other functions in this interface.
+ *
+ * All of RAM is identity mapped using 1 GiB pages when the processor
+ * supports them and 2 MiB pages otherwise. Regions that the MTRRs
+ * divide into more than one memory type are mapped with smaller pages.
  */
 void k_paging_init();
 
 /**
  * Maps a range of physical addresses to a range of virtual addresses.
- * The two arguments specify the lowest and highest addresses in the
- * physical address range to be mapped.
+ * The first two arguments specify the lowest and highest addresses in the
+ * physical address range to be mapped. The third argument is the memory
+ * type of the mapping, which should be one of PAGING_WB, PAGING_WC,
+ * or PAGING_UC.
+ * Ranges of 2 MiB or more are mapped with 2 MiB pages wherever possible.
  * Upon success, this function returns the base address of a virtual
  * address range.
  * On failure, 0 is returned.
@@ -163,16 +216,20 @@ void k_paging_init();
  * Params:
  *   k_regn - the lowest address in the range of physical addresses
  *   k_regn - the highest address in the range of physical addresses
+ *   int - the memory type
  *
  * Returns:
  *   k_regn - the base address of the range of virtual addresses
  *
  */
-k_regn k_paging_map_range(k_regn start, k_regn end);
+k_regn k_paging_map_range(k_regn start, k_regn end, int type);
 
 
 /**
  * Releases a virtual address mapping starting at the specified address.
+ * The page table entries of the mapping are cleared and their TLB entries
+ * are invalidated. Page tables and page directories that no longer
+ * contain any entries are freed.
  *
  * Params:
  *   k_regn - the base address of a range of virtual addresses
@@ -180,11 +237,170 @@ k_regn k_paging_map_range(k_regn start, k_regn end);
 void k_paging_unmap_range(k_regn start);
 
 /**
- * This function writes the contents of the dynamic virtual address ledger
+ * Reserves a range of virtual addresses without mapping any physical
+ * memory to them. Each page in the range is mapped the first time it's
+ * accessed, so only the pages that are actually used take up memory.
+ * The size is rounded up to a multiple of 4096.
+ * The flags can be any combination of the following:
+ *   PAGING_ZERO  - new pages are filled with zeros
+ *   PAGING_GUARD - the first page is a guard page, which is never mapped,
+ *                  so running off the bottom of a stack is caught
+ *   PAGING_RO    - every page is mapped read-only to a single shared page
+ *                  of zeros, and writing to the range is an error
+ *   PAGING_PRIVATE - the range is in the private half of the current
+ *                  address space, so it can only be seen while that
+ *                  address space is loaded
+ * Without PAGING_ZERO, new pages contain whatever was left in them.
+ * Upon success, this function returns the first address in the range.
+ * On failure, 0 is returned. PAGING_PRIVATE always fails when the kernel
+ * address space is loaded, since it has no private half.
+ *
+ * Params:
+ *   k_regn - the number of bytes to reserve
+ *   int - reservation flags
+ *
+ * Returns:
+ *   k_regn - the first address in the range or 0
+ */
+k_regn k_paging_reserve(k_regn size, int flags);
+
+
+/**
+ * Maps part of a range reserved by k_paging_reserve right away, the same
+ * way the page fault handler would map it on first touch.
+ * Resolving a page fault takes the paging lock and may allocate memory,
+ * so memory that's touched while holding the paging, memory, or heap lock
+ * has to be committed first.
+ * Pages that are already mapped are left alone. If some page can't be
+ * mapped, then 0 is returned, and the pages that were mapped stay mapped
+ * until the range is released.
+ *
+ * Params:
+ *   k_regn - the first address to commit
+ *   k_regn - the number of bytes to commit
+ *
+ * Returns:
+ *   int - 1 on success or 0 on failure
+ */
+int k_paging_commit(k_regn start, k_regn size);
+
+
+/**
+ * Releases a range of virtual addresses reserved by k_paging_reserve.
+ * The physical memory of any pages that were mapped is freed.
+ *
+ * Params:
+ *   k_regn - the first address of a reserved range
+ */
+void k_paging_release(k_regn start);
+
+
+/**
+ * Creates a copy of a range of virtual addresses reserved by
+ * k_paging_reserve. The new range has the same size and flags as the
+ * original. Pages that have been mapped in the original are shared
+ * between the two ranges and mapped read-only. The first write to a
+ * shared page by either range gives that range its own copy of the page.
+ * Pages that haven't been touched yet are left unmapped in both ranges,
+ * so the time it takes is proportional to the number of mapped pages
+ * rather than the size of the range.
+ * Upon success, this function returns the first usable address in the
+ * new range.
+ * On failure, 0 is returned.
+ *
+ * Params:
+ *   k_regn - the first address of a reserved range
+ *
+ * Returns:
+ *   k_regn - the first address in the new range or 0
+ */
+k_regn k_paging_clone(k_regn start);
+
+
+/**
+ * Attempts to resolve a page fault.
+ * If the faulting address is in a reserved range and the access is
+ * allowed by the range's flags, then a page is mapped at that address
+ * and 1 is returned. Writes to copy-on-write pages are resolved by
+ * copying the page. Otherwise, nothing is mapped and 0 is returned.
+ * This is called by the page fault handler.
+ *
+ * Params:
+ *   k_regn - the address that caused the fault (CR2)
+ *   k_regn - the error code pushed by the processor
+ *
+ * Returns:
+ *   int - 1 if the fault was resolved or 0 if it was not
+ */
+int k_paging_fault(k_regn addr, k_regn err);
+
+
+/**
+ * Creates a new address space.
+ * The new address space shares the kernel half of the kernel's PML4.
+ * Its private half starts out empty, and the caller is its only user.
+ * If the processor supports PCIDs, then the address space gets its own
+ * PCID so that switching to it doesn't flush the TLB.
+ * Upon success, this function returns a pointer to a new address space.
+ * On failure, NULL is returned.
+ *
+ * Returns:
+ *   k_addr_space* - a new address space
+ */
+k_addr_space* k_paging_create_space();
+
+
+/**
+ * Adds a user to an address space, which must then be destroyed once
+ * more before it's actually freed.
+ *
+ * Params:
+ *   k_addr_space* - an address space
+ *
+ * Returns:
+ *   k_addr_space* - the same address space
+ */
+k_addr_space* k_paging_share_space(k_addr_space*);
+
+
+/**
+ * Drops a user of an address space. When the last user is dropped, the
+ * address space is freed, along with the paging structures, ranges, and
+ * pages of its private half.
+ * The kernel address space and address spaces that are currently
+ * loaded on any processor can't be freed. A task's address space is
+ * loaded for as long as the task is running, so the caller must wait
+ * until it has been switched away from and try again.
+ * Upon success, this function returns 1.
+ * If the last user is dropped while the address space is loaded, then
+ * nothing happens and 0 is returned.
+ *
+ * Params:
+ *   k_addr_space* - an address space
+ *
+ * Returns:
+ *   int - 1 if the address space was destroyed or 0 if it's loaded
+ */
+int k_paging_destroy_space(k_addr_space*);
+
+
+/**
+ * Loads an address space into the current processor's CR3.
+ * If the argument is NULL, then the kernel address space is loaded.
+ * If the address space is already loaded, then CR3 is not changed.
+ *
+ * Params:
+ *   k_addr_space* - an address space
+ */
+void k_paging_switch_space(k_addr_space*);
+
+
+/**
+ * This function writes the state of the dynamic virtual address space
  * to some output stream. It is intended to be used for debugging.
  * The actual output destination is undefined.
  */
-void k_paging_print_ledger();
+void k_paging_print_map();
 
 
 #endif
\ No newline at end of file
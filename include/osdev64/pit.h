@@ -5,9 +5,10 @@
 //
 // This interface contains functions and datatypes for controlling the
 // programmable interval timer (PIT). The PIT is a counter that is capable
-// of generating a timer IRQ at regular intervals which can be used to
-// preempt tasks, temporarily delay execution, and keep track of elapsed
-// time intervals.
+// of generating a timer IRQ at regular intervals.
+// It ticks TIMER_HZ times per second. When the APICs are available, its
+// IRQ is masked, and it's only used to calibrate the local APIC timer and
+// to delay execution. Otherwise, its IRQ drives the timer wheel.
 
 #include "osdev64/axiom.h"
 
@@ -19,10 +20,13 @@ void k_pit_init();
 
 
 /**
- * Waits for at least the specified number of PIT ticks.
+ * Waits for the specified number of PIT ticks.
  * This is a form of busy waiting, since the task that calls this function
- * enters a loop until the global tick count has reached the specified
- * threshold.
+ * enters a loop that reads the PIT's counter until it has started over
+ * the specified number of times. It doesn't need the PIT's IRQ, so it
+ * works with interrupts disabled.
+ * The first tick may end at any moment, so the actual wait is between
+ * n - 1 and n ticks.
  *
  * Params:
  *   uint64_t - the number of ticks to wait
@@ -0,0 +1,201 @@
+#ifndef JEP_SMP_H
+#define JEP_SMP_H
+
+
+// SMP Interface
+//
+// Functions and data types for starting and keeping track of the
+// processors in the system.
+//
+// The processor that runs the firmware and the kernel's entry point is
+// called the bootstrap processor (BSP). The others, called application
+// processors (APs), are waiting for an INIT IPI followed by a startup IPI
+// (SIPI) from the BSP. A startup IPI makes an AP start executing in real
+// mode at the beginning of a page below 1 MiB, so a small trampoline is
+// copied there. The trampoline takes the AP from real mode to long mode
+// using the same paging structures as the BSP, and then calls the AP's
+// entry point in C, which loads the AP's own GDT and TSS, the shared IDT,
+// enables its local APIC and timer, and then lets it join the scheduler.
+//
+// Every processor that is listed as enabled in the MADT is started.
+// Each one is described by a k_cpu structure, and the BSP is always the
+// first one.
+//
+// Each processor's data, such as its current task, run queue, TSS and
+// IST stacks, tick count, and page cache, is kept in its own k_cpu
+// structure, which is aligned to a cache line. The IA32_GS_BASE MSR of
+// each processor holds the address of its k_cpu, so a field can be read
+// with a single GS-relative instruction. Everything runs in ring 0, so
+// GS is never loaded with a user value, and SWAPGS isn't needed.
+//
+// Processors interrupt each other with IPIs. A processor can ask others
+// to run a function, such as one that invalidates TLB entries, and wait
+// until they've all run it.
+
+
+#include "osdev64/axiom.h"
+#include "osdev64/paging.h"
+
+
+// maximum number of processors
+#define SMP_CPU_MAX 64
+
+// size of a cache line in bytes
+// Per-processor data is aligned to it, so two processors never write
+// to the same cache line when they update their own data.
+#define SMP_CACHE_LINE 64
+
+// number of free pages each processor keeps for itself
+#define SMP_PAGE_CACHE 16
+
+
+// Per-processor state.
+// The GS base of each processor points to its k_cpu structure, so the
+// first field must be a pointer to the structure itself. The fields that
+// are used on every interrupt and task switch come first.
+typedef struct k_cpu {
+  _Alignas(SMP_CACHE_LINE)
+  struct k_cpu* self;      // address of this structure
+  uint32_t index;          // position in the list of processors (BSP is 0)
+  uint32_t apic_id;        // local APIC ID
+  struct k_task* current;  // running task (NULL until a task is scheduled)
+  struct k_task* idle;     // task that runs when no other task is ready
+  struct k_task* prev;     // task that was switched away from
+  struct run_queue* queue; // run queue of tasks waiting for this processor
+  uint64_t slice_left;     // ticks left in the current task's time slice
+  uint64_t ticks;          // number of timer interrupts handled
+  k_addr_space* space;     // address space in CR3 (NULL for the kernel's)
+  volatile int online;     // 1 once the processor has started
+  uint32_t page_count;     // number of pages in the page cache
+  void* pages[SMP_PAGE_CACHE]; // free pages (see memory.c)
+  void* gdt;               // GDT
+  uint32_t* tss;           // TSS
+  k_byte* ist1;            // IST1 stack
+  k_byte* ist2;            // IST2 stack (used for page faults)
+}k_cpu;
+
+
+// Accesses a field of the current processor's k_cpu structure with a
+// single instruction relative to the GS base. This can be used anywhere
+// after k_gdt_init, since the GS base of the BSP is set when its GDT is
+// loaded, and each AP sets its GS base before anything else.
+// Interrupts should be disabled if the caller may be moved to another
+// processor between two uses.
+#define SMP_CPU_FIELD(f) (((__seg_gs k_cpu*)0)->f)
+
+// the current processor's k_cpu structure
+#define SMP_THIS_CPU() SMP_CPU_FIELD(self)
+
+
+/**
+ * Makes a processor's k_cpu structure reachable through its GS base.
+ * Loading a GDT clears the GS base, so this is called again after that.
+ *
+ * Params:
+ *   k_cpu* - the current processor
+ */
+void k_smp_load_cpu(k_cpu*);
+
+
+/**
+ * Reserves memory below 1 MiB for the trampoline that starts the APs.
+ * Memory below 1 MiB is scarce and is used up quickly by other
+ * allocations, so this should be called right after the memory
+ * manager is initialized.
+ */
+void k_smp_reserve();
+
+
+/**
+ * Starts every enabled AP listed in the MADT, one at a time.
+ * Each AP joins the scheduler as soon as it has started.
+ * This must be called after the local APIC timer, the clock, and task
+ * management have been initialized. If the APICs aren't available, or
+ * the trampoline memory couldn't be reserved, then only the BSP is used.
+ */
+void k_smp_init();
+
+
+/**
+ * Gets the number of processors that are running.
+ *
+ * Returns:
+ *   uint32_t - the number of processors that have started
+ */
+uint32_t k_smp_count();
+
+
+/**
+ * Gets a processor by its position in the list of processors.
+ *
+ * Params:
+ *   uint32_t - the index of a processor
+ *
+ * Returns:
+ *   k_cpu* - the processor or NULL if there is no such processor
+ */
+k_cpu* k_smp_get(uint32_t);
+
+
+/**
+ * Gets the processor that is executing the caller.
+ * Unlike SMP_THIS_CPU, this can be called before k_gdt_init, in which
+ * case it returns the BSP.
+ *
+ * Returns:
+ *   k_cpu* - the current processor
+ */
+k_cpu* k_smp_cpu();
+
+
+/**
+ * Runs a function on other processors and waits until each of them
+ * has run it.
+ * Bit n of the mask selects the processor whose index is n. The caller
+ * and processors that haven't started are skipped. The function runs in
+ * an interrupt handler, so it must not block or take locks that may be
+ * held by the interrupted code.
+ * This may be called with interrupts disabled, but not while holding a
+ * lock that another processor may spin on with interrupts disabled,
+ * unless that processor calls k_smp_poll while it spins.
+ *
+ * Params:
+ *   uint64_t - a mask of processor indices
+ *   void (func)(void*) - the function to run
+ *   void* - the argument for the function
+ */
+void k_smp_call(uint64_t, void (func)(void*), void*);
+
+
+/**
+ * Runs a function on every other processor and waits until each of them
+ * has run it. This is the same as calling k_smp_call with every bit of
+ * the mask set, except that a single broadcast IPI is sent when possible.
+ *
+ * Params:
+ *   void (func)(void*) - the function to run
+ *   void* - the argument for the function
+ */
+void k_smp_call_others(void (func)(void*), void*);
+
+
+/**
+ * Runs the function that another processor asked this processor to run,
+ * if there is one.
+ * Code that spins with interrupts disabled on something that may be held
+ * by a processor in k_smp_call should call this while it spins.
+ */
+void k_smp_poll();
+
+
+/**
+ * Wakes a processor that may be halted in its idle task, so that it
+ * checks its run queue. Nothing happens if the processor is the caller.
+ *
+ * Params:
+ *   uint32_t - the index of a processor
+ */
+void k_smp_wake(uint32_t);
+
+
+#endif
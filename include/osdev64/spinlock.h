@@ -0,0 +1,203 @@
+#ifndef JEP_SPINLOCK_H
+#define JEP_SPINLOCK_H
+
+
+// Spinlock Interface
+//
+// Locks for short critical sections in the kernel, where the waiter
+// busy waits instead of sleeping.
+//
+// A ticket lock hands out tickets in the order that processors arrive,
+// and the lock is passed to the holder of the next ticket when it's
+// released, so waiters are served first come, first served. Every waiter
+// watches the same word, so it's best for locks that are rarely contended,
+// such as the run queue of a processor.
+//
+// An MCS lock is a queue of waiters, where each waiter spins on a node
+// that it provides, usually on its own stack. Only the node of the next
+// waiter is written when the lock is released, so waiters don't compete
+// for the same cache line. It's meant for locks that are often contended,
+// such as the ones that protect the allocators.
+//
+// Each lock can optionally keep statistics. They're only updated by
+// the holder of the lock, so they don't need atomic operations, and the
+// time stamp counter is only read when the lock wasn't free.
+//
+// The _irqsave variants disable interrupts before acquiring the lock and
+// return the previous RFLAGS, which the matching _irqrestore variant
+// restores after releasing it. They're for locks that are also taken by
+// interrupt handlers.
+
+
+#include "osdev64/axiom.h"
+
+
+// statistics for a lock
+typedef struct k_spin_stats {
+  uint64_t acquired;  // number of acquisitions
+  uint64_t contended; // number of acquisitions where the lock wasn't free
+  uint64_t cycles;    // total TSC cycles spent waiting
+  uint64_t max;       // most TSC cycles spent waiting at once
+}k_spin_stats;
+
+
+// a ticket lock
+typedef struct k_ticket_lock {
+  volatile uint32_t next;  // next ticket to hand out
+  volatile uint32_t owner; // ticket that holds the lock
+  k_spin_stats* stats;     // statistics or NULL
+}k_ticket_lock;
+
+
+// a waiter in the queue of an MCS lock
+typedef struct k_mcs_node {
+  struct k_mcs_node* volatile next; // next waiter
+  volatile int waiting;             // 1 until the lock is passed to it
+}k_mcs_node;
+
+
+// an MCS lock
+typedef struct k_mcs_lock {
+  k_mcs_node* volatile tail; // last waiter or holder (NULL when free)
+  k_spin_stats* stats;       // statistics or NULL
+}k_mcs_lock;
+
+
+// initial values of a free lock
+// The argument is a pointer to the statistics or NULL.
+#define K_TICKET_LOCK_INIT(stats) { 0, 0, (stats) }
+#define K_MCS_LOCK_INIT(stats) { NULL, (stats) }
+
+
+/**
+ * Initializes a ticket lock.
+ *
+ * Params:
+ *   k_ticket_lock* - a ticket lock
+ *   k_spin_stats* - statistics for the lock or NULL
+ */
+void k_ticket_init(k_ticket_lock*, k_spin_stats*);
+
+
+/**
+ * Acquires a ticket lock.
+ * This should be called with interrupts disabled if the lock is ever
+ * taken by an interrupt handler.
+ *
+ * Params:
+ *   k_ticket_lock* - a ticket lock
+ */
+void k_ticket_acquire(k_ticket_lock*);
+
+
+/**
+ * Acquires a ticket lock if it's free.
+ *
+ * Params:
+ *   k_ticket_lock* - a ticket lock
+ *
+ * Returns:
+ *   int - 1 if the lock was acquired or 0 if it wasn't
+ */
+int k_ticket_try(k_ticket_lock*);
+
+
+/**
+ * Releases a ticket lock, which passes it to the next waiter.
+ *
+ * Params:
+ *   k_ticket_lock* - a ticket lock held by the caller
+ */
+void k_ticket_release(k_ticket_lock*);
+
+
+/**
+ * Disables interrupts and acquires a ticket lock.
+ *
+ * Params:
+ *   k_ticket_lock* - a ticket lock
+ *
+ * Returns:
+ *   k_regn - the RFLAGS from before interrupts were disabled
+ */
+k_regn k_ticket_acquire_irqsave(k_ticket_lock*);
+
+
+/**
+ * Releases a ticket lock and restores the interrupt flag.
+ *
+ * Params:
+ *   k_ticket_lock* - a ticket lock held by the caller
+ *   k_regn - the RFLAGS returned by k_ticket_acquire_irqsave
+ */
+void k_ticket_release_irqrestore(k_ticket_lock*, k_regn);
+
+
+/**
+ * Initializes an MCS lock.
+ *
+ * Params:
+ *   k_mcs_lock* - an MCS lock
+ *   k_spin_stats* - statistics for the lock or NULL
+ */
+void k_mcs_init(k_mcs_lock*, k_spin_stats*);
+
+
+/**
+ * Acquires an MCS lock.
+ * The node must stay valid until the lock is released with it.
+ * This should be called with interrupts disabled if the lock is ever
+ * taken by an interrupt handler.
+ *
+ * Params:
+ *   k_mcs_lock* - an MCS lock
+ *   k_mcs_node* - a node that belongs to the caller
+ */
+void k_mcs_acquire(k_mcs_lock*, k_mcs_node*);
+
+
+/**
+ * Releases an MCS lock, which passes it to the next waiter.
+ *
+ * Params:
+ *   k_mcs_lock* - an MCS lock held by the caller
+ *   k_mcs_node* - the node that the lock was acquired with
+ */
+void k_mcs_release(k_mcs_lock*, k_mcs_node*);
+
+
+/**
+ * Disables interrupts and acquires an MCS lock.
+ *
+ * Params:
+ *   k_mcs_lock* - an MCS lock
+ *   k_mcs_node* - a node that belongs to the caller
+ *
+ * Returns:
+ *   k_regn - the RFLAGS from before interrupts were disabled
+ */
+k_regn k_mcs_acquire_irqsave(k_mcs_lock*, k_mcs_node*);
+
+
+/**
+ * Releases an MCS lock and restores the interrupt flag.
+ *
+ * Params:
+ *   k_mcs_lock* - an MCS lock held by the caller
+ *   k_mcs_node* - the node that the lock was acquired with
+ *   k_regn - the RFLAGS returned by k_mcs_acquire_irqsave
+ */
+void k_mcs_release_irqrestore(k_mcs_lock*, k_mcs_node*, k_regn);
+
+
+/**
+ * Prints the statistics of a lock.
+ *
+ * Params:
+ *   const char* - the name of the lock
+ *   k_spin_stats* - the statistics of the lock
+ */
+void k_spin_print(const char*, k_spin_stats*);
+
+
+#endif
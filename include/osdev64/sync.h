@@ -9,6 +9,8 @@
 // through semaphores.
 
 #include "osdev64/axiom.h"
+#include "osdev64/spinlock.h"
+#include "osdev64/task.h"
 
 
 // Waiting types
@@ -22,6 +24,39 @@
 #define SYNC_SLEEP 0
 #define SYNC_SPIN 1
 
+// Yielding
+// When a lock is released or a semaphore is signaled, the first task that
+// was sleeping on it is moved to the run queue. If the releasing task
+// yields, then the woken task runs immediately instead of waiting for
+// the next timer tick.
+#define SYNC_NO_YIELD 0
+#define SYNC_YIELD 1
+
+// synchronization types used by the SLEEP_SYNC syscall
+#define SYNC_TYPE_LOCK 1
+#define SYNC_TYPE_SEMAPHORE 2
+#define SYNC_TYPE_READ 3
+#define SYNC_TYPE_WRITE 4
+
+
+// Alignment of synchronization values
+// Intel recommends placing semaphores on 128-byte boundaries, since
+// the processor may fetch cache lines in pairs. Each value is aligned
+// and padded to that size so that unrelated locks never share a line.
+#define SYNC_ALIGN 128
+
+
+// A synchronization value and the tasks that are sleeping on it.
+// The value is the first member, so a pointer to the structure is also
+// a pointer to the value, which is what the assembly procedures and the
+// SLEEP_SYNC syscall operate on.
+typedef struct k_sync_value {
+  _Alignas(SYNC_ALIGN)
+  k_regn value;              // the lock bit or the semaphore count
+  k_wait_queue waiters;      // tasks sleeping until the value changes
+  struct k_sync_value* next; // next free value in the pool
+}k_sync_value;
+
 
 /**
  * A lock is a binary value that a task sets to gain access to a resource.
@@ -35,8 +70,12 @@
  * Once the task has completed its work in the critical section, it
  * must release the lock by calling k_mutex_release, at which point
  * other tasks may acquire the lock.
+ *
+ * A lock can be created with k_mutex_create, or it can be embedded in
+ * another structure or declared statically and initialized with
+ * K_LOCK_INIT or k_mutex_init.
  */
-typedef k_regn k_lock;
+typedef k_sync_value k_lock;
 
 /**
  * A sempahore is a value that is decremented and incremented to control
@@ -49,8 +88,84 @@ typedef k_regn k_lock;
  * calling k_semaphore_wait. Once it has successfully decremented the value,
  * it can proceed. A task can notify other tasks waiting on a semaphore by
  * calling k_semaphore_signal. This function increments the semaphore.
+ *
+ * A semaphore can be created with k_semaphore_create, or it can be
+ * embedded in another structure or declared statically and initialized
+ * with K_SEMAPHORE_INIT or k_semaphore_init.
  */
-typedef k_regn k_semaphore;
+typedef k_sync_value k_semaphore;
+
+
+/**
+ * A reader-writer lock allows any number of readers to hold it at the
+ * same time, or a single writer. It's meant for data that is read much
+ * more often than it's changed.
+ *
+ * Writers are preferred: once a writer is waiting, no more readers can
+ * acquire the lock, so a steady stream of readers can't keep a writer
+ * waiting forever. When the last writer releases the lock, every
+ * sleeping reader is woken.
+ *
+ * The state holds the number of readers in bits 0 through 31, the
+ * writer flag in bit 32, and the number of waiting writers in the
+ * remaining bits.
+ */
+typedef struct k_rwlock {
+  _Alignas(SYNC_ALIGN)
+  k_regn state;         // readers, writer flag, and waiting writers
+  k_wait_queue readers; // readers sleeping until there are no writers
+  k_wait_queue writers; // writers sleeping until the lock is free
+}k_rwlock;
+
+/**
+ * A sequence lock protects a small amount of data that is read very
+ * often, such as the current time. Readers never block writers or each
+ * other. Instead, a reader copies the data and then checks whether a
+ * writer changed it in the meantime, in which case it tries again.
+ *
+ * A reader calls k_seqlock_read_begin, copies the data, and repeats
+ * both steps for as long as k_seqlock_read_retry returns 1. The data
+ * must not be dereferenced as pointers until the copy is known to be
+ * consistent.
+ *
+ * Writers are serialized by a spinlock and write with interrupts
+ * disabled, so an interrupt handler can read the data without spinning
+ * forever on a writer that it interrupted.
+ */
+typedef struct k_seqlock {
+  volatile uint64_t sequence; // odd while a writer is changing the data
+  k_ticket_lock lock;         // lock for writers
+}k_seqlock;
+
+
+/**
+ * A futex is a word in memory that tasks agree on the meaning of, and
+ * that the kernel only gets involved with when a task has to wait.
+ * A task that finds the word in a state where it must wait calls
+ * k_syscall_futex_wait with the value it saw, and the kernel puts it to
+ * sleep only if the word still has that value. A task that changes the
+ * word calls k_syscall_futex_wake if it knows that tasks might be
+ * waiting. Tasks are kept in a table of wait queues that is indexed by
+ * a hash of the address, so there's nothing to create or destroy.
+ *
+ * Addresses in the private half of an address space are only matched
+ * with tasks in the same address space.
+ *
+ * k_futex_lock and k_futex_unlock build a lock on a futex word that
+ * starts at 0. Acquiring and releasing it without contention takes one
+ * atomic instruction each and never enters the kernel.
+ */
+typedef k_regn k_futex;
+
+
+// initial values of a free lock and of a semaphore with a count of n
+#define K_LOCK_INIT { 0, K_WAIT_QUEUE_INIT, NULL }
+#define K_SEMAPHORE_INIT(n) { (k_regn)(n), K_WAIT_QUEUE_INIT, NULL }
+
+// initial values of a free reader-writer lock and sequence lock
+#define K_RWLOCK_INIT { 0, K_WAIT_QUEUE_INIT, K_WAIT_QUEUE_INIT }
+#define K_SEQLOCK_INIT { 0, K_TICKET_LOCK_INIT(NULL) }
+
 
 /**
  * Initializes the synchronization interface.
@@ -70,12 +185,23 @@ k_lock* k_mutex_create();
 
 /**
  * Frees the memory allocated for a mutex lock.
+ * This is only for locks that were created with k_mutex_create.
  *
  * Params:
  *   k_lock* - a pointer to the lock to destroy
  */
 void k_mutex_destroy(k_lock*);
 
+
+/**
+ * Initializes a lock that is embedded in another structure.
+ * The lock is initially free.
+ *
+ * Params:
+ *   k_lock* - a pointer to the lock to initialize
+ */
+void k_mutex_init(k_lock*);
+
 /**
  * Attempts to acquire a lock to ensure mutual exclusion.
  * The task that calls this function will wait until the lock becomes
@@ -93,11 +219,15 @@ void k_mutex_acquire(k_lock*, int);
 
 /**
  * Releases a lock.
+ * If any tasks are sleeping while waiting for the lock, then the first
+ * one is woken. The second argument is the yield flag. If it's 1, then
+ * the current task yields to the woken task.
  *
  * Params:
  *   k_lock* - a pointer to the lock to release
+ *   int - yield flag (1 to yield to a woken task, 0 to keep running)
  */
-void k_mutex_release(k_lock*);
+void k_mutex_release(k_lock*, int);
 
 
 /**
@@ -114,6 +244,7 @@ k_semaphore* k_semaphore_create(int64_t n);
 
 /**
  * Frees the memory allocated for a semaphore.
+ * This is only for semaphores that were created with k_semaphore_create.
  *
  * Returns:
  *   k_semaphore* - a pointer to the sempahore to destroy
@@ -121,6 +252,16 @@ k_semaphore* k_semaphore_create(int64_t n);
 void k_semaphore_destroy(k_semaphore*);
 
 
+/**
+ * Initializes a semaphore that is embedded in another structure.
+ *
+ * Params:
+ *   k_semaphore* - a pointer to the semaphore to initialize
+ *   int64_t - the starting value of the semaphore
+ */
+void k_semaphore_init(k_semaphore*, int64_t);
+
+
 /**
  * Attempts to decrement a semaphore. The first argument is a pointer to the
  * semaphore, and the second argument is the busy flag.
@@ -137,10 +278,202 @@ void k_semaphore_wait(k_semaphore*, int);
 /**
  * Increments the value of a sempahore by 1 to allow an additional task
  * to access a resource.
+ * If any tasks are sleeping while waiting on the semaphore, then the first
+ * one is woken. The second argument is the yield flag. If it's 1, then
+ * the current task yields to the woken task.
  *
  * Params:
  *   k_semaphore* - a pointer to the semaphore to be incremented
+ *   int - yield flag (1 to yield to a woken task, 0 to keep running)
+ */
+void k_semaphore_signal(k_semaphore*, int);
+
+
+/**
+ * Initializes a reader-writer lock that is embedded in another structure.
+ * The lock is initially free.
+ *
+ * Params:
+ *   k_rwlock* - a pointer to the reader-writer lock to initialize
+ */
+void k_rwlock_init(k_rwlock*);
+
+
+/**
+ * Acquires a reader-writer lock for reading.
+ * The task waits while a writer holds the lock or is waiting for it.
+ * If the busy flag is 1, then this function will loop until the lock
+ * can be acquired. If the busy flag is 0, then the current task will be
+ * put to sleep until then.
+ *
+ * Params:
+ *   k_rwlock* - a pointer to the reader-writer lock to acquire
+ *   int - busy flag (1 for busy wait, 0 for sleeping wait)
+ */
+void k_rwlock_read_acquire(k_rwlock*, int);
+
+
+/**
+ * Releases a reader-writer lock that was acquired for reading.
+ * If this was the last reader and a writer is sleeping while waiting
+ * for the lock, then the first one is woken.
+ *
+ * Params:
+ *   k_rwlock* - a pointer to the reader-writer lock to release
+ */
+void k_rwlock_read_release(k_rwlock*);
+
+
+/**
+ * Acquires a reader-writer lock for writing.
+ * The task waits until there are no readers and no other writer.
+ * If the busy flag is 1, then this function will loop until the lock
+ * can be acquired. If the busy flag is 0, then the current task will be
+ * put to sleep until then.
+ *
+ * Params:
+ *   k_rwlock* - a pointer to the reader-writer lock to acquire
+ *   int - busy flag (1 for busy wait, 0 for sleeping wait)
+ */
+void k_rwlock_write_acquire(k_rwlock*, int);
+
+
+/**
+ * Releases a reader-writer lock that was acquired for writing.
+ * If another writer is waiting, then the first sleeping writer is woken.
+ * Otherwise, every sleeping reader is woken.
+ *
+ * Params:
+ *   k_rwlock* - a pointer to the reader-writer lock to release
+ */
+void k_rwlock_write_release(k_rwlock*);
+
+
+/**
+ * Initializes a sequence lock that is embedded in another structure.
+ *
+ * Params:
+ *   k_seqlock* - a pointer to the sequence lock to initialize
+ */
+void k_seqlock_init(k_seqlock*);
+
+
+/**
+ * Begins reading the data protected by a sequence lock.
+ * If a writer is changing the data, then this waits until it's done.
+ *
+ * Params:
+ *   k_seqlock* - a pointer to the sequence lock
+ *
+ * Returns:
+ *   uint64_t - the sequence number to pass to k_seqlock_read_retry
+ */
+uint64_t k_seqlock_read_begin(k_seqlock*);
+
+
+/**
+ * Checks whether the data protected by a sequence lock was changed while
+ * it was being read.
+ *
+ * Params:
+ *   k_seqlock* - a pointer to the sequence lock
+ *   uint64_t - the sequence number from k_seqlock_read_begin
+ *
+ * Returns:
+ *   int - 1 if the data must be read again or 0 if the copy is consistent
+ */
+int k_seqlock_read_retry(k_seqlock*, uint64_t);
+
+
+/**
+ * Disables interrupts and begins changing the data protected by
+ * a sequence lock.
+ *
+ * Params:
+ *   k_seqlock* - a pointer to the sequence lock
+ *
+ * Returns:
+ *   k_regn - the RFLAGS from before interrupts were disabled
+ */
+k_regn k_seqlock_write_begin(k_seqlock*);
+
+
+/**
+ * Finishes changing the data protected by a sequence lock and restores
+ * the interrupt flag.
+ *
+ * Params:
+ *   k_seqlock* - a pointer to the sequence lock
+ *   k_regn - the RFLAGS returned by k_seqlock_write_begin
+ */
+void k_seqlock_write_end(k_seqlock*, k_regn);
+
+
+/**
+ * Acquires a lock built on a futex word, which is 0 when the lock is
+ * free. If the lock is held, then the current task sleeps until it's
+ * released.
+ *
+ * Params:
+ *   k_futex* - a pointer to the futex word
+ */
+void k_futex_lock(k_futex*);
+
+
+/**
+ * Releases a lock built on a futex word.
+ * If any tasks are sleeping while waiting for the lock, then one of
+ * them is woken.
+ *
+ * Params:
+ *   k_futex* - a pointer to the futex word
+ */
+void k_futex_unlock(k_futex*);
+
+
+/**
+ * Puts the current task to sleep on a futex word if it still contains
+ * the expected value. This is called by the FUTEX_WAIT syscall.
+ *
+ * Params:
+ *   k_regn* - a pointer to the current task's register stack
+ *   k_futex* - a pointer to the futex word
+ *   k_regn - the value that the word must contain for the task to sleep
+ *
+ * Returns:
+ *   k_regn* - the register stack of the next task
+ */
+k_regn* k_futex_wait(k_regn*, k_futex*, k_regn);
+
+
+/**
+ * Wakes tasks that are sleeping on a futex word.
+ * This is called by the FUTEX_WAKE syscall.
+ *
+ * Params:
+ *   k_futex* - a pointer to the futex word
+ *   k_regn - the most tasks to wake
+ *
+ * Returns:
+ *   int - the number of tasks that were woken
+ */
+int k_futex_wake(k_futex*, k_regn);
+
+
+/**
+ * Puts the current task in the wait queue of a synchronization value.
+ * This is called by the SLEEP_SYNC syscall. If the value has already
+ * become available, then the task isn't put to sleep.
+ *
+ * Params:
+ *   k_regn* - a pointer to the current task's register stack
+ *   k_regn - the synchronization type (one of the SYNC_TYPE_ values)
+ *   k_regn* - a pointer to the value of a lock or semaphore or to the
+ *             state of a reader-writer lock
+ *
+ * Returns:
+ *   k_regn* - the register stack of the next task
  */
-void k_semaphore_signal(k_semaphore*);
+k_regn* k_sync_sleep(k_regn*, k_regn, k_regn*);
 
 #endif
\ No newline at end of file
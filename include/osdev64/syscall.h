@@ -11,6 +11,9 @@
 #define SYSCALL_SLEEP_TICK 4
 #define SYSCALL_WRITE 5
 #define SYSCALL_READ 6
+#define SYSCALL_YIELD 7
+#define SYSCALL_FUTEX_WAIT 8
+#define SYSCALL_FUTEX_WAKE 9
 
 
 // used for debugging
@@ -67,6 +70,51 @@ void k_syscall_stop();
 void k_syscall_sleep(uint64_t);
 
 
+/**
+ * Puts the current task to sleep until a synchronization value might be
+ * available. The task may wake up before it is, so the caller must check
+ * the value again.
+ *
+ * Params:
+ *   k_regn - the synchronization type (one of the SYNC_TYPE_ values)
+ *   k_regn* - a pointer to the synchronization value
+ */
+void k_syscall_sleep_sync(k_regn, k_regn*);
+
+
+/**
+ * Puts the current task to sleep on a futex word if it still contains
+ * the expected value. The task may wake up for other reasons, so the
+ * caller must check the word again.
+ *
+ * Params:
+ *   k_regn* - the address of the futex word
+ *   k_regn - the value that the word must contain for the task to sleep
+ */
+void k_syscall_futex_wait(k_regn*, k_regn);
+
+
+/**
+ * Wakes tasks that are sleeping on a futex word.
+ *
+ * Params:
+ *   k_regn* - the address of the futex word
+ *   k_regn - the most tasks to wake
+ *
+ * Returns:
+ *   k_regn - the number of tasks that were woken
+ */
+k_regn k_syscall_futex_wake(k_regn*, k_regn);
+
+
+/**
+ * Gives up the rest of the current task's time slice.
+ * The current task goes to the end of its run queue, so any task that
+ * was put at the front of the same run queue runs next.
+ */
+void k_syscall_yield();
+
+
 /**
  * Writes the contents of a buffer to a file.
  *
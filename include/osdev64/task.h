@@ -2,6 +2,9 @@
 #define JEP_TASK_H
 
 #include "osdev64/axiom.h"
+#include "osdev64/paging.h"
+#include "osdev64/spinlock.h"
+#include "osdev64/timer.h"
 
 
 // task states
@@ -12,17 +15,60 @@
 #define TASK_REMOVED 4
 
 
+// task priorities
+// Lower numbers are higher priorities. A task only runs when there are
+// no ready tasks with a higher priority, and tasks with the same priority
+// take turns.
+#define TASK_PRIORITY_COUNT 32
+#define TASK_PRIORITY_HIGH 0
+#define TASK_PRIORITY_NORMAL 16
+#define TASK_PRIORITY_LOW 31
+
+
+// default number of ticks a task runs before it's preempted
+#define TASK_TIME_SLICE 5
+
+
+// flags for waking tasks in a wait queue
+#define TASK_WAKE_ONE 0   // wake the first task in the queue
+#define TASK_WAKE_ALL 1   // wake every task in the queue
+#define TASK_WAKE_FIRST 2 // put woken tasks at the front of their run queues
+
+
+// affinity mask that allows a task to run on any processor
+#define TASK_AFFINITY_ALL (~(uint64_t)0)
+
+
+// a FIFO queue of tasks that are waiting for something
+typedef struct k_wait_queue {
+  k_ticket_lock lock;  // lock for the queue
+  struct k_task* head; // first task to wake
+  struct k_task* tail; // last task to wake
+}k_wait_queue;
+
+// initial value of an empty wait queue
+#define K_WAIT_QUEUE_INIT { K_TICKET_LOCK_INIT(NULL), NULL, NULL }
+
+
 // task structure
 typedef struct k_task {
-  void* mem_base;      // base address of all task memory
+  void* mem_base;      // base address of the task state memory
+  k_regn stack;        // base address of the stack
   k_regn* regs;        // register stack
   uint64_t id;         // task ID
   int status;          // status
-  struct k_task* next; // next task in the list
-  k_regn* sync_val;    // synchronization value
-  k_regn sync_type;    // synchronization type
-  k_regn ticks;        // timer tick count
-  k_regn limit;        // timer tick limit (for sleeping)
+  int priority;        // priority (0 is the highest)
+  struct k_task* next; // next task in a run queue, wait queue, or sleep list
+  k_timer timer;       // timer for waking up from a sleep
+  k_addr_space* space; // address space (NULL for the kernel's)
+  volatile int switching; // 1 while a processor is switching away from it
+  uint64_t affinity;   // bit n is set if the task may run on processor n
+  int cpu;             // index of the processor it last ran on (or -1)
+  uint64_t last_ran;   // tick at which it was last switched away from
+  int queue;           // index of the run queue it's waiting in (or -1)
+  int level;           // priority of the queue it's waiting in
+  const void* wait_key;    // key it's waiting on in a shared wait queue
+  const void* wait_space;  // address space that qualifies the key
 }k_task;
 
 
@@ -32,12 +78,65 @@ typedef struct k_task {
  */
 void k_task_init();
 
+/**
+ * Lets an application processor join the scheduler.
+ * It gets its own idle task, which represents the current thread of
+ * execution, and then it runs tasks from its own run queue like the BSP.
+ * This never returns.
+ */
+void k_task_start_cpu();
+
 /**
  * Determines which task is currently executing.
+ * Each processor has its own run queue. The current task goes back to
+ * the run queue of the processor it ran on, and the next task is the
+ * first one in the highest priority queue of this processor's run queue
+ * that isn't empty. When that's empty, or every few ticks, a task is taken
+ * from the busiest processor's run queue, preferring one whose data is
+ * least likely to be in that processor's cache. If no task is ready to
+ * run, then the current processor's idle task runs.
  */
 k_regn* k_task_switch(k_regn*);
 
 
+/**
+ * Finishes a task switch once the ISR has moved to the register stack
+ * of the next task. Until then, the ISR is still using the stack of the
+ * previous task, so the previous task can't run on another processor,
+ * and a stopped task can't be marked as REMOVED.
+ * Every ISR that may switch tasks calls this right after it loads the
+ * register stack returned by the scheduler.
+ */
+void k_task_switch_done();
+
+
+/**
+ * Counts one timer tick against the current task's time slice.
+ * If the time slice has run out, or if the idle task is running and
+ * another task has become ready, then k_task_switch is called.
+ * This is called by the timer interrupt handler.
+ *
+ * Params:
+ *   k_regn* - a pointer to the current task's register stack
+ *
+ * Returns:
+ *   k_regn* - a pointer to the register stack of the task to run
+ */
+k_regn* k_task_tick(k_regn*);
+
+
+/**
+ * Sets the number of timer ticks a task runs before it's preempted.
+ * There are TIMER_HZ ticks per second, so with the default rate,
+ * this is the time slice in milliseconds. If the number of ticks is 0,
+ * then nothing happens.
+ *
+ * Params:
+ *   uint64_t - the number of ticks in a time slice
+ */
+void k_task_set_time_slice(uint64_t);
+
+
 /**
  * Creates a new task.
  *
@@ -50,18 +149,64 @@ k_regn* k_task_switch(k_regn*);
 k_task* k_task_create(void (action)());
 
 
+/**
+ * Gives a new task its own address space.
+ * The address space shares the kernel half of memory, so the task can
+ * still use everything the kernel can. Ranges reserved by the task with
+ * PAGING_PRIVATE are only visible to it and to tasks that share its
+ * address space. The address space is destroyed along with the last
+ * task that uses it.
+ * This must be called before the task is scheduled.
+ * Upon success, this function returns 1.
+ * On failure, 0 is returned.
+ *
+ * Params:
+ *   k_task* - pointer to a task with a status of NEW
+ *
+ * Returns:
+ *   int - 1 on success or 0 on failure
+ */
+int k_task_isolate(k_task*);
+
+
+/**
+ * Gives a new task the address space of another task, so the two tasks
+ * see the same private half of memory.
+ * This must be called before the task is scheduled.
+ * Upon success, this function returns 1.
+ * On failure, 0 is returned.
+ *
+ * Params:
+ *   k_task* - pointer to a task with a status of NEW
+ *   k_task* - pointer to a task that has its own address space
+ *
+ * Returns:
+ *   int - 1 on success or 0 on failure
+ */
+int k_task_share_space(k_task*, k_task*);
+
+
 /**
  * Frees the memory allocated for a task.
+ * If the task is the last one using its own address space and a
+ * processor still has it loaded, then the task is still running, so
+ * nothing is freed and 0 is returned. The caller must try again once the task's status
+ * is REMOVED.
  *
  * Params:
  *   k_task* - pointer to a task
+ *
+ * Returns:
+ *   int - 1 if the task was freed or 0 if it's still running
  */
-void k_task_destroy(k_task*);
+int k_task_destroy(k_task*);
 
 
 /**
  * Schedules a task for execution.
- * The task should have a status of NEW.
+ * The task should have a status of NEW. It's put at the end of the queue
+ * for its priority in the run queue of the least busy processor that
+ * it's allowed to run on.
  * Once a task has been scheduled, its memory is owned by the scheduler
  * until it is removed from the task list.
  *
@@ -70,6 +215,35 @@ void k_task_destroy(k_task*);
  */
 void k_task_schedule(k_task*);
 
+
+/**
+ * Changes the priority of a task.
+ * New tasks have a priority of TASK_PRIORITY_NORMAL. If the priority is
+ * not in the range 0 to TASK_PRIORITY_COUNT - 1, then nothing happens.
+ *
+ * Params:
+ *   k_task* - pointer to a task
+ *   int - the new priority
+ */
+void k_task_set_priority(k_task*, int);
+
+
+/**
+ * Restricts the processors that a task may run on.
+ * Bit n of the mask is set if the task may run on the processor whose
+ * index is n. New tasks have a mask of TASK_AFFINITY_ALL. Bits for
+ * processors that aren't running are ignored. A task that is running on
+ * a processor that's no longer allowed moves at its next task switch.
+ *
+ * Params:
+ *   k_task* - pointer to a task
+ *   uint64_t - a mask of processor indices
+ *
+ * Returns:
+ *   int - 1 on success or 0 if the mask has no running processors
+ */
+int k_task_set_affinity(k_task*, uint64_t);
+
 /**
  * Changes the current task's status to STOPPED and then calls k_task_switch
  * to switch to a task with a status of RUNNING.
@@ -83,17 +257,73 @@ k_regn* k_task_stop(k_regn*);
  * Changes the current task's status to SLEEPING and then calls k_task_switch
  * to switch to a task with a status of RUNNING.
  * The first argument is a pointer to the current task's register stack,
- * the second argument is a pointer toa  synchronization value, and the
- * third argument indicates the type of synchronization value.
- * If the type is 1, then the synchronization value is a lock. If the type
- * is 2, then the synchronization value is a semaphore.
+ * and the second argument is the number of timer ticks to sleep.
  *
  * Params:
  *   k_regn* - a pointer to the current task's register stack
- *   k_regn* - a pointer to a synchronization primitive
- *   int - the type of synchronization primitive (1 for lock, 2 for semaphore)
+ *   k_regn - the number of ticks to sleep
+ */
+k_regn* k_task_sleep(k_regn*, k_regn);
+
+
+/**
+ * Changes the current task's status to SLEEPING, puts it at the end of a
+ * wait queue, and then calls k_task_switch to switch to a task with a
+ * status of RUNNING. The task stays asleep until it's woken by
+ * k_task_wake.
+ * Once the task is in the queue, the ready function is called with the
+ * data pointer. If it returns nonzero, then whatever the task is waiting
+ * for has already happened, possibly on another processor, so the task
+ * is taken back out of the queue and keeps running.
+ * This must be called with interrupts disabled, such as from a syscall.
+ *
+ * Params:
+ *   k_regn* - a pointer to the current task's register stack
+ *   k_wait_queue* - a wait queue
+ *   int (ready)(void*) - function that checks the condition or NULL
+ *   void* - data for the ready function
+ */
+k_regn* k_task_wait(
+  k_regn*,
+  k_wait_queue*,
+  int (ready)(void*),
+  void*
+);
+
+
+/**
+ * Wakes tasks in a wait queue by moving them to the run queues.
+ * The flags are TASK_WAKE_ONE or TASK_WAKE_ALL, optionally combined
+ * with TASK_WAKE_FIRST so that a woken task runs before other tasks
+ * of the same priority. This is what a task should use before yielding
+ * to hand off a resource.
+ *
+ * Params:
+ *   k_wait_queue* - a wait queue
+ *   int - wake flags
+ *
+ * Returns:
+ *   int - the number of tasks that were woken
+ */
+int k_task_wake(k_wait_queue*, int);
+
+
+/**
+ * Wakes tasks in a wait queue that is shared by more than one key, such
+ * as a bucket of a hash table. Only tasks whose wait_key and wait_space
+ * match are woken, and the others stay in the queue in the same order.
+ * The waiting task sets its key before it calls k_task_wait.
+ *
+ * Params:
+ *   k_wait_queue* - a wait queue
+ *   const void* - the key
+ *   const void* - the address space that qualifies the key
+ *   int - the most tasks to wake
+ *
+ * Returns:
+ *   int - the number of tasks that were woken
  */
-k_regn* k_task_sleep(k_regn*, k_regn*, k_regn, k_regn);
+int k_task_wake_key(k_wait_queue*, const void*, const void*, int);
 
 
 /**
@@ -11,6 +11,13 @@ void demo_sem_task_a_action();
 void demo_sem_task_b_action();
 void demo_sem_task_c_action();
 
+// futex lock demo tasks
+void demo_futex_task_action();
+void demo_private_futex_task_action();
+
+// address space demo task
+void demo_space_task_action();
+
 void demo_keyboard_task_action();
 
 /**
@@ -26,6 +33,28 @@ void mutex_demo_1();
 void semaphore_demo_1();
 
 
+/**
+ * Demonstrates three tasks that take turns with a futex lock,
+ * each sleeping in the kernel while another holds it.
+ */
+void futex_demo_1();
+
+
+/**
+ * Demonstrates three tasks that share an address space and take turns
+ * with a futex lock in the private half of it.
+ * This must run in a task with its own address space.
+ */
+void futex_demo_2();
+
+
+/**
+ * Demonstrates two tasks with their own address spaces, which reserve
+ * private memory at the same address.
+ */
+void space_demo_1();
+
+
 /**
  * Demonstrates a task that handles keybaord input.
  */
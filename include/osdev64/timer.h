@@ -0,0 +1,133 @@
+#ifndef JEP_TIMER_H
+#define JEP_TIMER_H
+
+
+// Timer Interface
+//
+// Functions and data types for running callbacks after some number of
+// timer ticks have passed.
+//
+// Timers are kept in a hierarchical timing wheel. The wheel has several
+// levels, each of which is an array of slots, and each slot is a list of
+// timers. A timer that expires within the next 64 ticks is put in the
+// slot of the first level for the tick it expires on. Timers that expire
+// further in the future are put in the higher levels, where each slot
+// covers 64 times as many ticks as a slot in the level below it. Every
+// 64 ticks, the timers in the next slot of a higher level are moved down
+// to the levels below it.
+//
+// Starting or canceling a timer takes constant time, and each tick only
+// touches the timers that expire on that tick, along with the occasional
+// batch of timers that are moved to a lower level.
+//
+// Timer callbacks are called by the timer interrupt handler, so they run
+// with interrupts disabled and must not sleep.
+
+
+#include "osdev64/axiom.h"
+
+
+// number of timer ticks in one second
+#define TIMER_HZ 1000
+
+
+// returned by k_timer_idle when there are no active timers
+#define TIMER_NONE ((uint64_t)0xFFFFFFFFFFFFFFFF)
+
+
+// A timer.
+// The memory for a timer is owned by whoever starts it, and it must
+// not be freed while the timer is active.
+typedef struct k_timer {
+  uint64_t expires;        // tick on which the timer expires
+  uint64_t period;         // ticks between expirations (0 for once)
+  void (*callback)(void*); // function to call when the timer expires
+  void* data;              // argument for the callback
+  struct k_timer* next;    // next timer in the slot
+  struct k_timer* prev;    // previous timer in the slot
+  struct k_timer** slot;   // slot that holds the timer (NULL if inactive)
+}k_timer;
+
+
+/**
+ * Initializes the timer interface.
+ * This must be called before any other functions in this interface.
+ */
+void k_timer_init();
+
+
+/**
+ * Prepares a timer to be started.
+ * This must be called once before a timer is started for the first time.
+ *
+ * Params:
+ *   k_timer* - a timer
+ *   void (callback)(void*) - the function to call when the timer expires
+ *   void* - the argument to pass to the callback
+ */
+void k_timer_setup(k_timer*, void (callback)(void*), void* data);
+
+
+/**
+ * Starts a timer.
+ * The callback is called once the specified number of ticks have passed.
+ * If the period is not 0, then the timer is restarted each time it
+ * expires, and the callback is called every period ticks until the timer
+ * is canceled. If the timer is already active, then it's restarted.
+ * A delay of 0 is treated as 1.
+ *
+ * Params:
+ *   k_timer* - a timer
+ *   uint64_t - the number of ticks until the timer expires
+ *   uint64_t - the number of ticks between expirations (0 for once)
+ */
+void k_timer_start(k_timer*, uint64_t ticks, uint64_t period);
+
+
+/**
+ * Cancels a timer so that its callback is not called.
+ * If the timer is not active, then nothing happens.
+ *
+ * Params:
+ *   k_timer* - a timer
+ *
+ * Returns:
+ *   int - 1 if the timer was active or 0 if it was not
+ */
+int k_timer_cancel(k_timer*);
+
+
+/**
+ * Gets the number of ticks the timer wheel has counted.
+ *
+ * Returns:
+ *   uint64_t - the current tick
+ */
+uint64_t k_timer_now();
+
+
+/**
+ * Gets the number of ticks until the wheel next has work to do.
+ * This is either the tick on which the next timer expires, or the tick
+ * on which a slot of a higher level is moved down, whichever comes first.
+ * Until then, calling k_timer_tick does nothing but count, so the caller
+ * can stop the periodic tick and catch up later.
+ * This is called by the BSP before it stops its tick. Until its next
+ * call to k_timer_tick, starting a timer that expires sooner wakes it.
+ * If there are no active timers, then TIMER_NONE is returned.
+ *
+ * Returns:
+ *   uint64_t - the number of ticks until the next timer event
+ */
+uint64_t k_timer_idle();
+
+
+/**
+ * Advances the timer wheel by one tick and calls the callbacks of all
+ * timers that expire on that tick.
+ * This is called by the timer interrupt handler.
+ */
+void k_timer_tick();
+
+
+#endif
@@ -16,4 +16,13 @@
 void k_tty_init();
 
 
+/**
+ * Lets the TTY know that there may be a new key event or new output
+ * for it to handle. The TTY task sleeps while it has nothing to do,
+ * so this must be called whenever either of those things happen.
+ * It's safe to call this from an interrupt handler.
+ */
+void k_tty_notify();
+
+
 #endif
\ No newline at end of file
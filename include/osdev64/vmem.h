@@ -0,0 +1,165 @@
+#ifndef JEP_VMEM_H
+#define JEP_VMEM_H
+
+
+// Virtual Address Space Interface
+//
+// Functions and data types for reserving ranges of virtual addresses.
+// A virtual address space is a single contiguous range of addresses
+// from which smaller ranges, called spans, are reserved and released.
+// This interface only keeps track of which addresses are in use.
+// It does not create or remove any page table entries.
+// Each reserved span has a tag, which is a value that the owner of the
+// address space can use to remember how the span is mapped.
+//
+// Each span is a node in a balanced binary search tree (AVL tree).
+// Free spans are kept in two trees: one ordered by address, which is
+// used to merge a released span with the free spans on either side of it,
+// and one ordered by size, which is used to find the smallest free span
+// that can hold a request (best fit). Reserved spans are kept in a third
+// tree ordered by address, which is used to find a span when it's
+// released. All operations take O(log n) time, where n is the number
+// of spans.
+
+
+#include "osdev64/axiom.h"
+
+
+// A range of virtual addresses.
+// The contents of this struct are only meant to be used by the
+// virtual address space interface.
+typedef struct k_vmem_span {
+  k_regn start;                 // first address in the span
+  k_regn size;                  // number of bytes in the span
+  struct k_vmem_span* left[2];  // left children in each tree
+  struct k_vmem_span* right[2]; // right children in each tree
+  int height[2];                // heights of the subtrees in each tree
+  uint64_t tag;                 // owner-defined value (reserved spans only)
+}k_vmem_span;
+
+
+// A virtual address space.
+typedef struct k_vmem {
+  k_regn base;            // first address in the space
+  k_regn size;            // number of bytes in the space
+  k_vmem_span* free_addr; // free spans ordered by address
+  k_vmem_span* free_size; // free spans ordered by size
+  k_vmem_span* used;      // reserved spans ordered by address
+  k_regn free_bytes;      // number of bytes in free spans
+  uint64_t free_count;    // number of free spans
+  uint64_t used_count;    // number of reserved spans
+}k_vmem;
+
+
+/**
+ * Initializes a virtual address space.
+ * The base address and size should be multiples of 4096.
+ * Upon success, this function returns 1.
+ * On failure, 0 is returned.
+ *
+ * Params:
+ *   k_vmem* - a virtual address space
+ *   k_regn - the first address in the space
+ *   k_regn - the number of bytes in the space
+ *
+ * Returns:
+ *   int - 1 on success or 0 on failure
+ */
+int k_vmem_init(k_vmem*, k_regn base, k_regn size);
+
+
+/**
+ * Reserves a range of addresses in a virtual address space.
+ * The size is rounded up to a multiple of 4096. The alignment must be a
+ * power of two, and it's treated as 4096 if it's smaller than that.
+ * The first address of the range will be the phase plus some multiple
+ * of the alignment. The phase must be a multiple of 4096 that is less
+ * than the alignment. It's usually 0, but a nonzero phase lets a virtual
+ * range line up with a physical range that isn't aligned itself, so that
+ * large pages can still be used for most of it.
+ * Of all the free spans that can hold the range at the requested
+ * alignment, the smallest one is used. The tag of the new span is 0.
+ * Upon success, this function returns the first address in the range.
+ * On failure, 0 is returned.
+ *
+ * Params:
+ *   k_vmem* - a virtual address space
+ *   k_regn - the number of bytes to reserve
+ *   k_regn - the alignment of the first address
+ *   k_regn - the offset of the first address from the alignment
+ *
+ * Returns:
+ *   k_regn - the first address of the reserved range or 0
+ */
+k_regn k_vmem_alloc(k_vmem*, k_regn size, k_regn align, k_regn phase);
+
+
+/**
+ * Gets the size of a previously reserved range of addresses.
+ * If the address is not the first address of a reserved range,
+ * then 0 is returned.
+ *
+ * Params:
+ *   k_vmem* - a virtual address space
+ *   k_regn - the first address of a reserved range
+ *
+ * Returns:
+ *   k_regn - the number of bytes in the range or 0
+ */
+k_regn k_vmem_lookup(k_vmem*, k_regn addr);
+
+
+/**
+ * Finds the reserved span that contains an address.
+ * The span's tag may be changed by the caller, but its start and size
+ * must not be.
+ * If the address is not in any reserved span, then NULL is returned.
+ *
+ * Params:
+ *   k_vmem* - a virtual address space
+ *   k_regn - any address
+ *
+ * Returns:
+ *   k_vmem_span* - the reserved span containing the address or NULL
+ */
+k_vmem_span* k_vmem_find(k_vmem*, k_regn addr);
+
+
+/**
+ * Releases a previously reserved range of addresses so they can be
+ * reserved again. If the address is not the first address of a reserved
+ * range, then nothing happens and 0 is returned.
+ *
+ * Params:
+ *   k_vmem* - a virtual address space
+ *   k_regn - the first address of a reserved range
+ *
+ * Returns:
+ *   k_regn - the number of bytes released
+ */
+k_regn k_vmem_free(k_vmem*, k_regn addr);
+
+
+/**
+ * Frees every span of a virtual address space, whether it's reserved
+ * or free. The address space can't be used again unless it's
+ * initialized again.
+ *
+ * Params:
+ *   k_vmem* - a virtual address space
+ */
+void k_vmem_destroy(k_vmem*);
+
+
+/**
+ * Writes statistics about a virtual address space and a list of its
+ * spans to some output stream. It is intended to be used for debugging.
+ * The actual output destination is undefined.
+ *
+ * Params:
+ *   k_vmem* - a virtual address space
+ */
+void k_vmem_print(k_vmem*);
+
+
+#endif
@@ -11,6 +11,9 @@ k_byte* g_madt = NULL;
 // The MCFG
 k_byte* g_mcfg = NULL;
 
+// The HPET description table
+k_byte* g_hpet = NULL;
+
 extern k_byte* g_sys_rsdp;
 extern int g_sys_acpi_ver;
 
@@ -284,6 +287,39 @@ void k_acpi_init()
         }
       }
     }
+
+    // The signature "HPET" indicates the HPET description table.
+    if (sdt[0] == 'H' && sdt[1] == 'P' && sdt[2] == 'E' && sdt[3] == 'T')
+    {
+      uint32_t len = *(uint32_t*)(sdt + 4);
+
+      // Calculate the checksum.
+      k_byte check = 0;
+      for (uint32_t j = 0; j < len; j++)
+      {
+        check += sdt[j];
+      }
+
+      // If we validated the checksum, then we found the HPET table.
+      if (check == 0)
+      {
+        fprintf(stddbg, "[ACPI] located the HPET table\n");
+
+        // Allocate memory to store the HPET table.
+        g_hpet = k_memory_alloc_pages(len / 0x1000 + 1);
+        if (g_hpet == NULL)
+        {
+          fprintf(stddbg, "[ERROR] failed to allocate memory for the HPET table\n");
+          HANG();
+        }
+
+        // Copy the HPET table into our dynamic memory.
+        for (uint32_t j = 0; j < len; j++)
+        {
+          g_hpet[j] = sdt[j];
+        }
+      }
+    }
   }
 }
 
@@ -1,13 +1,17 @@
 #include "osdev64/firmware.h"
 #include "osdev64/apic.h"
 #include "osdev64/bitmask.h"
+#include "osdev64/control.h"
 #include "osdev64/acpi.h"
 #include "osdev64/paging.h"
 #include "osdev64/msr.h"
 #include "osdev64/interrupts.h"
 #include "osdev64/task.h"
+#include "osdev64/timer.h"
 #include "osdev64/instructor.h"
 #include "osdev64/ps2.h"
+#include "osdev64/pit.h"
+#include "osdev64/smp.h"
 
 #include "klibc/stdio.h"
 
@@ -26,6 +30,46 @@
 #define LAPIC_ISR6 ((uint64_t)0x160)
 #define LAPIC_ISR7 ((uint64_t)0x170)
 
+#define LAPIC_ICR_LO ((uint64_t)0x300)
+#define LAPIC_ICR_HI ((uint64_t)0x310)
+
+#define LAPIC_LVT_TIMER ((uint64_t)0x320)
+#define LAPIC_TIMER_INIT ((uint64_t)0x380)
+#define LAPIC_TIMER_CURRENT ((uint64_t)0x390)
+#define LAPIC_TIMER_DIV ((uint64_t)0x3E0)
+
+// ICR bit 12 is set while an IPI is still being sent.
+#define LAPIC_ICR_PENDING 0x1000
+
+// ICR values for an INIT IPI and a startup IPI
+// (level assert, physical destination)
+#define LAPIC_ICR_INIT 0x4500
+#define LAPIC_ICR_STARTUP 0x4600
+
+// ICR value for a fixed IPI (level assert, physical destination)
+// The vector goes in bits [7:0].
+#define LAPIC_ICR_FIXED 0x4000
+
+// ICR destination shorthands in bits [19:18]
+#define LAPIC_ICR_SELF 0x40000
+#define LAPIC_ICR_OTHERS 0xC0000
+
+// LVT bit 16 masks the interrupt.
+#define LAPIC_LVT_MASKED 0x10000
+
+// LVT timer bit 17 makes the timer start over each time it reaches 0.
+#define LAPIC_LVT_PERIODIC 0x20000
+
+// IDT index of the local APIC timer ISR
+#define LAPIC_TIMER_VECTOR 0x40
+
+// Value of the divide configuration register that divides the
+// timer's input clock by 16.
+#define LAPIC_TIMER_DIV_16 0x3
+
+// number of PIT ticks to count while calibrating the local APIC timer
+#define LAPIC_TIMER_CALIBRATION 50
+
 // IOAPIC registers
 #define IOAPICVER ((uint32_t)1)
 
@@ -42,8 +86,19 @@ volatile uint32_t* volatile g_lapic = NULL;
 volatile uint32_t* volatile g_ioapic = NULL;
 
 
-// PIT tick count
-extern uint64_t g_pit_ticks;
+// global system interrupt of the PIT's IRQ
+static uint32_t s_pit_gsi = 0;
+
+// number of local APIC timer counts in one tick (0 if uncalibrated)
+static uint32_t s_timer_counts = 0;
+
+// local APIC timer counts that didn't add up to a whole tick
+// the last time the processor was idle
+static uint64_t s_timer_carry = 0;
+
+// 1 while the timer is counting down to the end of an idle period
+// instead of counting ticks
+static volatile int s_timer_idle = 0;
 
 
 // polarity
@@ -143,6 +198,32 @@ static uint32_t ioapic_write(uint32_t index, uint32_t value)
 }
 
 
+/**
+ * Masks or unmasks a redirect entry in an I/O APIC.
+ *
+ * Params:
+ *   uint32_t - the global system interrupt of the redirect entry
+ *   int - 1 to mask the interrupt or 0 to unmask it
+ */
+static void ioapic_mask(uint32_t gsi, int masked)
+{
+  uint32_t lo_index = 0x10 + gsi * 2;
+  uint32_t lo_contents = ioapic_read(lo_index);
+
+  // Bit 16 is the mask.
+  if (masked)
+  {
+    lo_contents |= 0x10000;
+  }
+  else
+  {
+    lo_contents &= ~(0x10000);
+  }
+
+  ioapic_write(lo_index, lo_contents);
+}
+
+
 
 
 //============================================================
@@ -151,6 +232,9 @@ static uint32_t ioapic_write(uint32_t index, uint32_t value)
 
 void apic_generic_isr();
 void apic_spurious_isr();
+void apic_timer_isr();
+void apic_ipi_call_isr();
+void apic_ipi_wake_isr();
 void apic_generic_legacy_isr();
 void debug_isr();
 
@@ -182,23 +266,45 @@ void apic_spurious_handler()
   fprintf(stddbg, "[INT] APIC spurious interrupt handler\n");
 }
 
-// uint64_t g_apic_ticks = 0;
-uint64_t* apic_pit_handler(uint64_t* regs)
+uint64_t* apic_timer_handler(uint64_t* regs)
 {
-  uint64_t* next_task = regs;
-
-  // g_apic_ticks++;
-  g_pit_ticks++;
+  // The timer interrupt comes from this processor's own local APIC,
+  // so it always needs an EOI.
+  lapic_write(LAPIC_EOI, 0);
 
-  next_task = k_task_switch(regs);
+  SMP_CPU_FIELD(ticks)++;
 
-  uint32_t isr1 = lapic_read(LAPIC_ISR1);
-  if (isr1 & (0x10000 << 0))
+  // The timer wheel is only advanced by the BSP, since every processor
+  // has its own local APIC timer.
+  if (SMP_CPU_FIELD(index) == 0)
   {
-    lapic_write(LAPIC_EOI, 0);
+    // The end of an idle period is handled by k_lapic_idle.
+    if (s_timer_idle)
+    {
+      return regs;
+    }
+
+    // Expired timers may wake sleeping tasks, so they're handled
+    // before deciding whether to preempt the current task.
+    k_timer_tick();
   }
 
-  return next_task;
+  return k_task_tick(regs);
+}
+
+void apic_ipi_call_handler()
+{
+  // Run whatever function another processor asked this one to run.
+  k_smp_poll();
+
+  lapic_write(LAPIC_EOI, 0);
+}
+
+void apic_ipi_wake_handler()
+{
+  // The interrupt only has to wake the processor from HLT.
+  // The idle task checks its run queue after that.
+  lapic_write(LAPIC_EOI, 0);
 }
 
 void apic_generic_legacy_handler(uint8_t irqn)
@@ -273,7 +379,7 @@ void k_apic_init()
 
     switch (entry_type)
     {
-    case 0: // Local APIC
+    case 0: // Local APIC (the processors are started by the SMP interface)
       break;
 
     case 1:
@@ -329,7 +435,7 @@ void k_apic_init()
   g_lapic_phys = lapic_base;
 
   // Map the local APIC into virtual address space.
-  uint64_t lapic_virt = k_paging_map_range(lapic_base, lapic_base + 0x3F0);
+  uint64_t lapic_virt = k_paging_map_range(lapic_base, lapic_base + 0x3F0, PAGING_UC);
   if (lapic_virt == 0)
   {
     fprintf(stddbg, "[ERROR] failed to map local APIC virtual base\n");
@@ -338,7 +444,7 @@ void k_apic_init()
   g_lapic = (volatile uint32_t*)lapic_virt;
 
   // Map the I/O APIC into virtual address space.
-  uint64_t ioapic_virt = k_paging_map_range(ioapic_base, ioapic_base + 0x3F0);
+  uint64_t ioapic_virt = k_paging_map_range(ioapic_base, ioapic_base + 0x3F0, PAGING_UC);
   if (ioapic_virt == 0)
   {
     fprintf(stddbg, "[ERROR] failed to map IO APIC virtual base\n");
@@ -359,17 +465,11 @@ int k_apic_available()
 // Local APIC
 //============================================================
 
-void k_lapic_enable()
+/**
+ * Enables the local APIC of the processor that calls it.
+ */
+static void lapic_enable()
 {
-  // Install the APIC version of the generic ISRs.
-  for (int i = 0x30; i < 0xFF; i++)
-  {
-    k_install_isr(apic_generic_isr, i);
-  }
-
-  // Install the spurious interrupt handler at index 255;
-  k_install_isr(apic_spurious_isr, 0xFF);
-
   // Ensure that the physical address of the local APIC
   // is in the IA32_APIC_BASE MSR.
   uint64_t apic_base = k_msr_get(IA32_APIC_BASE);
@@ -393,6 +493,57 @@ void k_lapic_enable()
 }
 
 
+/**
+ * Sends an interprocessor interrupt and waits for it to be accepted.
+ *
+ * Params:
+ *   uint32_t - the local APIC ID of the destination processor
+ *   uint32_t - the contents of the low ICR register
+ */
+static void icr_send(uint32_t id, uint32_t lo)
+{
+  // An interrupt handler that sends an IPI between the writes to the
+  // two halves of the ICR would change the destination.
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  // The destination is in bits [63:56] of the ICR, and writing
+  // the low register sends the IPI.
+  lapic_write(LAPIC_ICR_HI, id << 24);
+  lapic_write(LAPIC_ICR_LO, lo);
+
+  while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING);
+
+  k_set_rflags(flags);
+}
+
+
+void k_lapic_enable()
+{
+  // Install the APIC version of the generic ISRs.
+  for (int i = 0x30; i < 0xFF; i++)
+  {
+    k_install_isr(apic_generic_isr, i);
+  }
+
+  // Install the spurious interrupt handler at index 255;
+  k_install_isr(apic_spurious_isr, 0xFF);
+
+  // Install the IPI handlers.
+  // The IDT is shared, so the APs get them too.
+  k_install_isr(apic_ipi_call_isr, APIC_IPI_CALL);
+  k_install_isr(apic_ipi_wake_isr, APIC_IPI_WAKE);
+
+  lapic_enable();
+}
+
+
+void k_lapic_enable_cpu()
+{
+  lapic_enable();
+}
+
+
 uint32_t k_lapic_get_id()
 {
   // The ID is located in bits [31:24] of the ID register.
@@ -417,6 +568,138 @@ uint32_t k_lapic_get_maxlvt()
 }
 
 
+void k_lapic_timer_init()
+{
+  k_install_isr(apic_timer_isr, LAPIC_TIMER_VECTOR);
+
+  lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+
+  // Wait for the start of a PIT tick, then let the timer count down
+  // from its highest value for a few ticks to see how fast it counts.
+  k_pit_wait(1);
+
+  lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+  k_pit_wait(LAPIC_TIMER_CALIBRATION);
+  uint32_t left = lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+
+  s_timer_counts = (0xFFFFFFFF - left) / LAPIC_TIMER_CALIBRATION;
+
+  fprintf(stddbg, "[APIC] timer counts per tick: %u\n", s_timer_counts);
+
+  if (s_timer_counts == 0)
+  {
+    fprintf(stddbg, "[ERROR] local APIC timer is not counting\n");
+    HANG();
+  }
+
+  k_lapic_timer_start();
+}
+
+
+void k_lapic_timer_start()
+{
+  // Every local APIC timer is assumed to count at the same rate
+  // as the one that was calibrated.
+  lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INIT, s_timer_counts);
+}
+
+
+void k_lapic_idle(uint64_t ticks)
+{
+  // If the timer hasn't been calibrated, or the next tick has work to do
+  // anyway, then the periodic tick keeps going while the processor waits.
+  if (s_timer_counts == 0 || ticks < 2)
+  {
+    k_halt();
+    return;
+  }
+
+  // The initial count register is only 32 bits wide.
+  if (ticks > 0xFFFFFFFF / s_timer_counts)
+  {
+    ticks = 0xFFFFFFFF / s_timer_counts;
+  }
+
+  uint32_t count = (uint32_t)(ticks * s_timer_counts);
+
+  // Part of the current tick has already gone by.
+  s_timer_carry += s_timer_counts - lapic_read(LAPIC_TIMER_CURRENT);
+
+  // Replace the periodic tick with a one-shot countdown.
+  s_timer_idle = 1;
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INIT, count);
+
+  k_halt();
+
+  // The processor was woken by either the one-shot timer or some other
+  // interrupt. Either way, see how long the countdown ran, and then
+  // start the periodic tick again.
+  uint32_t left = lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INIT, s_timer_counts);
+  s_timer_idle = 0;
+
+  s_timer_carry += count - left;
+  uint64_t skipped = s_timer_carry / s_timer_counts;
+  s_timer_carry %= s_timer_counts;
+
+  // Catch up on the ticks that were skipped.
+  while (skipped--)
+  {
+    k_timer_tick();
+  }
+}
+
+
+void k_lapic_halt()
+{
+  // An initial count of 0 stops the timer. Without its tick, the processor
+  // sleeps until a device or another processor interrupts it.
+  lapic_write(LAPIC_TIMER_INIT, 0);
+
+  k_halt();
+
+  lapic_write(LAPIC_TIMER_INIT, s_timer_counts);
+}
+
+
+void k_lapic_send_init(uint32_t id)
+{
+  icr_send(id, LAPIC_ICR_INIT);
+}
+
+
+void k_lapic_send_startup(uint32_t id, uint8_t page)
+{
+  // The vector of a startup IPI is the page number
+  // where the processor starts executing.
+  icr_send(id, LAPIC_ICR_STARTUP | page);
+}
+
+
+void k_lapic_send_ipi(uint32_t id, uint8_t vector)
+{
+  icr_send(id, LAPIC_ICR_FIXED | vector);
+}
+
+
+void k_lapic_send_ipi_others(uint8_t vector)
+{
+  // The destination field is ignored when a shorthand is used.
+  icr_send(0, LAPIC_ICR_FIXED | LAPIC_ICR_OTHERS | vector);
+}
+
+
+void k_lapic_send_ipi_self(uint8_t vector)
+{
+  icr_send(0, LAPIC_ICR_FIXED | LAPIC_ICR_SELF | vector);
+}
+
 
 //============================================================
 // I/O APIC
@@ -577,6 +860,12 @@ void k_ioapic_configure()
 
       // Apply the appropriate redirection entry to the I/O APIC.
       ioapic_set_redirect(gsi, irq_base + irq_src, pol, trig);
+
+      // Remember where the PIT's IRQ went so it can be masked.
+      if (irq_src == 0)
+      {
+        s_pit_gsi = gsi;
+      }
     }
     break;
 
@@ -586,6 +875,10 @@ void k_ioapic_configure()
 
     i += entry_len;
   }
+
+  // The local APIC timer drives the scheduler, and the PIT is only
+  // polled, so its IRQ isn't needed.
+  ioapic_mask(s_pit_gsi, 1);
 }
 
 
@@ -0,0 +1,320 @@
+#include "osdev64/clock.h"
+#include "osdev64/cpuid.h"
+#include "osdev64/instructor.h"
+#include "osdev64/bitmask.h"
+#include "osdev64/pit.h"
+#include "osdev64/timer.h"
+#include "osdev64/syscall.h"
+#include "osdev64/hpet.h"
+#include "osdev64/sync.h"
+
+#include "klibc/stdio.h"
+
+
+// number of PIT ticks to count while measuring the rate of a clock source
+#define CLOCK_CALIBRATION 50
+
+// number of nanoseconds in one second
+#define NS_PER_SEC ((uint64_t)1000000000)
+
+// number of nanoseconds in one timer tick
+#define NS_PER_TICK (NS_PER_SEC / TIMER_HZ)
+
+// number of bits the product of a count and a multiplier is shifted right
+// when converting to nanoseconds
+#define CLOCK_SHIFT 32
+
+// number of times a clock source is read to check that it never goes
+// backwards
+#define CLOCK_READS 1000
+
+// largest difference between a clock source's reported rate and its
+// measured rate, in parts per thousand
+#define CLOCK_TOLERANCE 10
+
+// A clock source that is measured against a more precise one only
+// needs to count for 1 / CLOCK_REFERENCE_DIV seconds.
+#define CLOCK_REFERENCE_DIV 100
+
+
+// A clock source.
+typedef struct clock_source {
+  const char* name;   // name of the clock source
+  uint64_t (*read)(); // function that reads the counter
+  uint64_t hz;        // number of counts per second
+  uint64_t mult;      // nanoseconds per count, shifted left by CLOCK_SHIFT
+  uint64_t base;      // value of the counter when the clock started
+}clock_source;
+
+
+/**
+ * Reads the time stamp counter.
+ *
+ * Returns:
+ *   uint64_t - the value of the time stamp counter
+ */
+static uint64_t tsc_read()
+{
+  return k_rdtsc();
+}
+
+
+// the time stamp counter
+static clock_source s_tsc_clock = { "TSC", tsc_read, 0, 0, 0 };
+
+// the HPET's main counter
+static clock_source s_hpet_clock = { "HPET", k_hpet_read, 0, 0, 0 };
+
+// the timer tick
+static clock_source s_tick_clock = { "tick", k_timer_now, TIMER_HZ, 0, 0 };
+
+// the clock source that was chosen at boot
+static clock_source* s_clock = &s_tick_clock;
+
+// lock for s_clock and the base and multiplier of the clock source
+// Any processor may read the time while the clock source is started.
+static k_seqlock s_clock_lock = K_SEQLOCK_INIT;
+
+
+/**
+ * Checks if the time stamp counter is invariant.
+ *
+ * Returns:
+ *   int - 1 if the TSC is invariant or 0 if it's not
+ */
+static int tsc_invariant()
+{
+  if (k_cpuid_rax(0x80000000) < 0x80000007)
+  {
+    return 0;
+  }
+
+  // Bit 8 of EDX is set if the TSC is invariant.
+  return (k_cpuid_rdx(0x80000007) & BM_8) ? 1 : 0;
+}
+
+
+/**
+ * Measures the rate of a clock source.
+ * If there's a reference clock source whose rate is already known, then
+ * it's used to measure the rate. Otherwise, the PIT is used.
+ *
+ * Params:
+ *   clock_source* - a clock source
+ *   clock_source* - a reference clock source or NULL
+ *
+ * Returns:
+ *   uint64_t - the number of counts per second
+ */
+static uint64_t calibrate(clock_source* c, clock_source* ref)
+{
+  if (ref == NULL)
+  {
+    // Wait for the start of a PIT tick so that the whole
+    // measurement is made of complete ticks.
+    k_pit_wait(1);
+
+    uint64_t start = c->read();
+    k_pit_wait(CLOCK_CALIBRATION);
+    uint64_t end = c->read();
+
+    return (end - start) * TIMER_HZ / CLOCK_CALIBRATION;
+  }
+
+  uint64_t span = ref->hz / CLOCK_REFERENCE_DIV;
+  uint64_t ref_start = ref->read();
+  uint64_t start = c->read();
+  uint64_t ref_end;
+
+  do
+  {
+    ref_end = ref->read();
+  } while (ref_end - ref_start < span);
+
+  uint64_t end = c->read();
+
+  // The rate is counts * ref->hz / ref_counts, but the product may not
+  // fit in 64 bits, and there's no 128-bit division without libgcc.
+  // Dividing first and then scaling the remainder gives the same result.
+  // The remainder is less than ref_counts, which is about
+  // ref->hz / CLOCK_REFERENCE_DIV, so its product with ref->hz fits.
+  uint64_t counts = end - start;
+  uint64_t ref_counts = ref_end - ref_start;
+
+  return (counts / ref_counts) * ref->hz
+    + (counts % ref_counts) * ref->hz / ref_counts;
+}
+
+
+/**
+ * Checks that a clock source never goes backwards and that it
+ * actually counts.
+ *
+ * Params:
+ *   clock_source* - a clock source
+ *
+ * Returns:
+ *   int - 1 if the clock source passed or 0 if it failed
+ */
+static int check_monotonic(clock_source* c)
+{
+  uint64_t first = c->read();
+  uint64_t prev = first;
+
+  for (int i = 0; i < CLOCK_READS; i++)
+  {
+    uint64_t now = c->read();
+    if (now < prev)
+    {
+      return 0;
+    }
+    prev = now;
+  }
+
+  return (prev > first) ? 1 : 0;
+}
+
+
+/**
+ * Checks that a clock source counts at the rate that it reports.
+ *
+ * Params:
+ *   clock_source* - a clock source whose rate is known
+ *
+ * Returns:
+ *   int - 1 if the clock source passed or 0 if it failed
+ */
+static int check_rate(clock_source* c)
+{
+  uint64_t measured = calibrate(c, NULL);
+  uint64_t diff = measured > c->hz ? measured - c->hz : c->hz - measured;
+
+  return (diff * 1000 <= c->hz * CLOCK_TOLERANCE) ? 1 : 0;
+}
+
+
+/**
+ * Starts a clock source so that it can be used to tell time.
+ *
+ * Params:
+ *   clock_source* - a clock source whose rate is known
+ */
+static void start(clock_source* c)
+{
+  k_regn flags = k_seqlock_write_begin(&s_clock_lock);
+
+  c->mult = (NS_PER_SEC << CLOCK_SHIFT) / c->hz;
+  c->base = c->read();
+  s_clock = c;
+
+  k_seqlock_write_end(&s_clock_lock, flags);
+}
+
+
+void k_clock_init()
+{
+  clock_source* ref = NULL;
+
+  // The sources are tried from best to worst: TSC, HPET, then the
+  // timer tick. The HPET is checked first anyway, since it's a more
+  // precise reference than the PIT for measuring the TSC.
+  if (k_hpet_available())
+  {
+    s_hpet_clock.hz = k_hpet_hz();
+    if (check_monotonic(&s_hpet_clock) && check_rate(&s_hpet_clock))
+    {
+      ref = &s_hpet_clock;
+    }
+    else
+    {
+      fprintf(stddbg, "[CLOCK] HPET failed the quality test\n");
+    }
+  }
+
+  if (tsc_invariant())
+  {
+    s_tsc_clock.hz = calibrate(&s_tsc_clock, ref);
+    if (s_tsc_clock.hz != 0 && check_monotonic(&s_tsc_clock))
+    {
+      start(&s_tsc_clock);
+    }
+  }
+
+  if (s_clock != &s_tsc_clock)
+  {
+    start(ref != NULL ? ref : &s_tick_clock);
+  }
+
+  fprintf(stddbg, "[CLOCK] source: %s, rate: %llu Hz\n",
+    s_clock->name,
+    s_clock->hz
+  );
+}
+
+
+const char* k_clock_name()
+{
+  return s_clock->name;
+}
+
+
+uint64_t k_time_ns()
+{
+  clock_source* c;
+  uint64_t base;
+  uint64_t mult;
+  uint64_t seq;
+
+  // The source, base, and multiplier have to match each other.
+  do
+  {
+    seq = k_seqlock_read_begin(&s_clock_lock);
+    c = s_clock;
+    base = c->base;
+    mult = c->mult;
+  } while (k_seqlock_read_retry(&s_clock_lock, seq));
+
+  uint64_t counts = c->read() - base;
+
+  return (uint64_t)(((__uint128_t)counts * mult) >> CLOCK_SHIFT);
+}
+
+
+uint64_t k_time_cycles()
+{
+  return k_rdtsc();
+}
+
+
+void k_delay_us(uint64_t us)
+{
+  // The timer tick doesn't advance while interrupts are disabled,
+  // so the PIT is polled directly instead. The first PIT tick may
+  // end right away, so one more is added.
+  if (s_clock == &s_tick_clock)
+  {
+    k_pit_wait((us * TIMER_HZ + 999999) / 1000000 + 1);
+    return;
+  }
+
+  uint64_t end = k_time_ns() + us * 1000;
+
+  while (k_time_ns() < end);
+}
+
+
+void k_sleep_ns(uint64_t ns)
+{
+  uint64_t end = k_time_ns() + ns;
+
+  // A sleep of n ticks ends during the nth tick, so it never lasts
+  // longer than n whole ticks.
+  uint64_t ticks = ns / NS_PER_TICK;
+  if (ticks)
+  {
+    k_syscall_sleep(ticks);
+  }
+
+  // Wait for the part of a tick that's left.
+  while (k_time_ns() < end);
+}
@@ -2,11 +2,11 @@
 // These functions are called from ISRs.
 
 #include "osdev64/axiom.h"
+#include "osdev64/control.h"
+#include "osdev64/paging.h"
 
 #include "klibc/stdio.h"
 
-extern uint64_t g_endpoint;
-
 /**
  * Handles a divide error, which triggers interrupt 0.
  */
@@ -29,10 +29,22 @@ void gp_fault_handler()
 
 /**
  * Handles a page fault, which trigger interrupt 14.
+ * Faults in reserved memory are resolved by mapping a page, after which
+ * the faulting instruction is executed again. Any other fault is fatal.
+ *
+ * Params:
+ *   k_regn - the error code pushed by the processor
  */
-void page_fault_handler()
+void page_fault_handler(k_regn err)
 {
-  fprintf(stddbg, "page fault. last endpoint: %llX\n", g_endpoint);
+  k_regn addr = k_get_cr2();
+
+  if (k_paging_fault(addr, err))
+  {
+    return;
+  }
+
+  fprintf(stddbg, "page fault at %llX, error code: %llX\n", addr, err);
   // fprintf(stderr, "page fault\n");
   for (;;);
 }
@@ -2,20 +2,10 @@
 #include "osdev64/core.h"
 #include "osdev64/bitmask.h"
 #include "osdev64/memory.h"
+#include "osdev64/smp.h"
 
 #include "klibc/stdio.h"
 
-// GDT
-// Currently expects 5 entries
-seg_desc* g_gdt;
-
-// TSS
-// uint32_t g_tss[TSS_COUNT];
-uint32_t* g_tss;
-
-// IST1 stack
-k_byte* g_ist1;
-
 /**
  * Creates a segment descriptor which describes a 64-bit code or data
  * segment.
@@ -85,12 +75,29 @@ void k_lgdt(uint16_t, seg_desc*);
 // an assembly procedure that executes the LTR instruction
 void k_ltr(uint16_t);
 
-void k_gdt_init()
+/**
+ * Builds a GDT, a TSS, and the IST stacks for the processor that
+ * calls it, and then loads the GDT and TSS.
+ * Each processor needs its own TSS, since the TSS descriptor is marked
+ * as busy when it's loaded, and its own IST stacks, since they may be
+ * in use at the same time.
+ *
+ * The tables are kept in the processor's k_cpu structure.
+ *
+ * Params:
+ *   k_cpu* - the processor that is calling this
+ */
+static void gdt_setup(k_cpu* cpu)
 {
+  seg_desc* gdt;
+  uint32_t* tss;
+  k_byte* ist1;
+  k_byte* ist2;
+
   // Reserve some memory for the GDT.
   // 4 KiB should be more than enough.
-  g_gdt = (seg_desc*)k_memory_alloc_pages(1);
-  if (g_gdt == NULL)
+  gdt = (seg_desc*)k_memory_alloc_pages(1);
+  if (gdt == NULL)
   {
     fprintf(stddbg, "[ERROR] failed to allocate memory for GDT\n");
     for (;;);
@@ -98,21 +105,21 @@ void k_gdt_init()
 
   uint16_t gdt_count = 0;
 
-  g_gdt[gdt_count++] = 0; // null descriptor
+  gdt[gdt_count++] = 0; // null descriptor
 
   // code segment descriptor
   // type: execute/read, conforming, not yet accessed
-  g_gdt[gdt_count++] = build_cd_descriptor(0, 0x0FFFFF, CD_SEG_ERC);
+  gdt[gdt_count++] = build_cd_descriptor(0, 0x0FFFFF, CD_SEG_ERC);
 
   // data segment descriptor
   // type: read/write, expand down, not yet accessed
-  g_gdt[gdt_count++] = build_cd_descriptor(0, 0x0FFFFF, CD_SEG_RWD);
+  gdt[gdt_count++] = build_cd_descriptor(0, 0x0FFFFF, CD_SEG_RWD);
 
 
   // Reserve memory for the TSS.
   // The TSS contains 26 32-bit entries, so 4 KiB should be plenty.
-  g_tss = (uint32_t*)k_memory_alloc_pages(1);
-  if (g_tss == NULL)
+  tss = (uint32_t*)k_memory_alloc_pages(1);
+  if (tss == NULL)
   {
     fprintf(stddbg, "[ERROR] failed to allocate memory for TSS\n");
     for (;;);
@@ -121,7 +128,7 @@ void k_gdt_init()
   // Initialize all the values of the TSS to 0.
   for (int i = 0; i < TSS_COUNT; i++)
   {
-    g_tss[i] = 0;
+    tss[i] = 0;
   }
 
   // Reserve two pages for IST1.
@@ -129,16 +136,31 @@ void k_gdt_init()
   // the beginning of the IST stack is the base of the second page.
   // So if we allocated two pages starting at address 0xA000, then
   // the beginning of the stack would be 0xB000.
-  g_ist1 = (unsigned char*)k_memory_alloc_pages(2);
-  if (g_ist1 == NULL)
+  ist1 = (unsigned char*)k_memory_alloc_pages(2);
+  if (ist1 == NULL)
   {
     fprintf(stddbg, "[ERROR] failed to allocate memory for IST1\n");
     for (;;);
   }
 
   // Put IST1 in the TSS.
-  g_tss[9] = (uint32_t)((PTR_TO_N(g_ist1 + 4096) & 0xFFFFFFFF));
-  g_tss[10] = (uint32_t)((PTR_TO_N(g_ist1 + 4096) & 0xFFFFFFFF00000000) >> 32);
+  tss[9] = (uint32_t)((PTR_TO_N(ist1 + 4096) & 0xFFFFFFFF));
+  tss[10] = (uint32_t)((PTR_TO_N(ist1 + 4096) & 0xFFFFFFFF00000000) >> 32);
+
+  // Reserve two pages for IST2, which is used for page faults.
+  // A page fault can be caused by a task running off the end of its
+  // stack, in which case the processor can't push anything onto that
+  // stack, so page faults need a stack of their own.
+  ist2 = (unsigned char*)k_memory_alloc_pages(2);
+  if (ist2 == NULL)
+  {
+    fprintf(stddbg, "[ERROR] failed to allocate memory for IST2\n");
+    for (;;);
+  }
+
+  // Put IST2 in the TSS.
+  tss[11] = (uint32_t)((PTR_TO_N(ist2 + 8192) & 0xFFFFFFFF));
+  tss[12] = (uint32_t)((PTR_TO_N(ist2 + 8192) & 0xFFFFFFFF00000000) >> 32);
 
   // In 64-bit mode, a TSS descriptor is 128 bits, so we use two descriptors
   // to represent the low and high bits.
@@ -156,19 +178,39 @@ void k_gdt_init()
 
   // The TSS base address is split over the high and low
   // descriptor portions.
-  tss_lo |= ((PTR_TO_N(g_tss) & 0xFF000000) << 32);
-  tss_lo |= ((PTR_TO_N(g_tss) & 0x00FFFFFF) << 16);
-  tss_hi |= ((PTR_TO_N(g_tss) & 0xFFFFFFFF00000000) >> 32);
+  tss_lo |= ((PTR_TO_N(tss) & 0xFF000000) << 32);
+  tss_lo |= ((PTR_TO_N(tss) & 0x00FFFFFF) << 16);
+  tss_hi |= ((PTR_TO_N(tss) & 0xFFFFFFFF00000000) >> 32);
 
   // Put the TSS descriptor in the GDT.
-  g_gdt[gdt_count++] = tss_lo;
-  g_gdt[gdt_count++] = tss_hi;
+  gdt[gdt_count++] = tss_lo;
+  gdt[gdt_count++] = tss_hi;
 
   uint16_t limit = (sizeof(seg_desc) * gdt_count) - 1;
 
   // load the GDT
-  k_lgdt(limit, g_gdt);
+  k_lgdt(limit, gdt);
 
   // load the TSS
   k_ltr(0x18);
+
+  // Loading the GDT reloaded GS, which cleared the GS base.
+  k_smp_load_cpu(cpu);
+
+  cpu->gdt = gdt;
+  cpu->tss = tss;
+  cpu->ist1 = ist1;
+  cpu->ist2 = ist2;
+}
+
+
+void k_gdt_init()
+{
+  gdt_setup(k_smp_get(0));
+}
+
+
+void k_gdt_init_cpu(k_cpu* cpu)
+{
+  gdt_setup(cpu);
 }
@@ -137,7 +137,9 @@ void k_graphics_map_framebuffer()
   uint64_t fb_end = fb_phys + fb_size;    // physical end
 
   // Map the physical address range to a virtual address range.
-  uint64_t fb_virt = k_paging_map_range(fb_phys, fb_end);
+  // The framebuffer is only ever written to in large sequential runs,
+  // so it's mapped as write-combining.
+  uint64_t fb_virt = k_paging_map_range(fb_phys, fb_end, PAGING_WC);
   if (!fb_virt)
   {
     fprintf(stddbg, "[ERROR] failed to map framebuffer\n");
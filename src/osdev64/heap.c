@@ -1,35 +1,485 @@
 #include "osdev64/heap.h"
 #include "osdev64/memory.h"
+#include "osdev64/instructor.h"
+#include "osdev64/control.h"
+#include "osdev64/spinlock.h"
 
 #include "klibc/stdio.h"
 
 
-// The initial heap used by the kernel.
-static k_byte* s_heap;
-static k_regn s_start;
-static k_regn s_end;
+// flags
+#define AVAILABLE 0x1      // the block is free
+#define PREV_AVAILABLE 0x2 // the block before this one is free
+#define FIRST_BLOCK 0x4    // the block is the first one in its arena
 
 
-// flags
-#define AVAILABLE 0x1
+// number of pages in a heap arena unless a larger arena is needed
+#define ARENA_PAGES 32
+
+// number of segregated free lists
+// Free list i holds free blocks whose size is in [2^i, 2^(i+1)).
+#define BINS 64
+
+// size of the part of a heap header that is present in every block
+#define HEADER_SIZE 16
+
+// size of the footer at the end of a free block
+#define FOOTER_SIZE 8
+
+// size of the smallest block
+// A free block has to be able to hold a full header and a footer.
+#define BLOCK_MIN 48
+
 
+// number of slab size classes
+// The classes are powers of two from 16 bytes to 1024 bytes.
+#define SLAB_CLASSES 7
 
-// Describes a region of dynamic memory.
-// The current expected size of this struct is 24 bytes.
+// size of the smallest slab size class
+#define SLAB_MIN 16
+
+// size of the largest slab size class
+#define SLAB_MAX 1024
+
+
+// Describes a block of dynamic memory.
+// The size and flags are the boundary tag at the start of each block.
+// The size includes the header itself.
+// The next and prev pointers are only present in free blocks, where
+// they overlap the memory that would be returned by an allocation.
+// A free block also ends with a footer containing a copy of its size
+// so that the block after it can find it when merging.
+// The current expected size of this struct is 32 bytes.
 typedef struct k_heap_header {
-  struct k_heap_header* next; // 8 bytes
   k_regn size;                // 8 bytes
-  k_byte flags;               // 1 byte
-  // compiler padding         // 7 bytes
+  k_regn flags;               // 8 bytes
+  struct k_heap_header* next; // 8 bytes
+  struct k_heap_header* prev; // 8 bytes
 }k_heap_header;
 
 
+// A run of contiguous pages obtained from the physical memory manager.
+// The arena header is followed by the blocks, and the last 16 bytes of
+// the arena are an epilogue header with a size of 0 that is never free.
+// The current expected size of this struct is 32 bytes.
+typedef struct k_heap_arena {
+  struct k_heap_arena* next; // 8 bytes
+  struct k_heap_arena* prev; // 8 bytes
+  k_regn pages;              // 8 bytes
+  k_regn reserved;           // 8 bytes
+}k_heap_arena;
+
+
+// list of heap arenas
+// The first arena is the initial heap, which is never released.
+static k_heap_arena* s_arenas;
+
+// segregated free lists
+static k_heap_header* s_bins[BINS];
+
+// bit i is set if free list i is not empty
+static uint64_t s_bin_map;
+
+
+// A slab is a single page that is divided into objects of the same size.
+// The slab header is at the start of the page, and the objects
+// follow it. Free objects are linked together through their
+// first 8 bytes.
+typedef struct k_slab {
+  struct k_slab* next; // next slab in the partial list
+  struct k_slab* prev; // previous slab in the partial list
+  void* free;          // first free object
+  uint32_t used;       // number of allocated objects
+  uint32_t total;      // number of objects in the slab
+  uint32_t cls;        // index of the size class
+  // compiler padding  // 4 bytes
+}k_slab;
+
+
+// A collection of slabs whose objects are all the same size.
+typedef struct k_slab_class {
+  k_slab* partial; // slabs with at least one allocated and one free object
+  k_slab* empty;   // a slab with no allocated objects kept for reuse
+  size_t size;     // size of each object
+  uint64_t slabs;  // number of slabs
+  uint64_t used;   // number of allocated objects
+}k_slab_class;
+
+
+// slab size classes
+static k_slab_class s_classes[SLAB_CLASSES];
+
+
+// statistics for the heap lock
+static k_spin_stats s_lock_stats;
+
+// lock for the arenas, free lists, and slabs
+static k_mcs_lock s_lock = K_MCS_LOCK_INIT(&s_lock_stats);
+
+
+/**
+ * Gets the index of the smallest size class that can hold n bytes.
+ *
+ * Params:
+ *   size_t - the number of bytes requested
+ *
+ * Returns:
+ *   int - the index of a size class
+ */
+static inline int slab_class_index(size_t n)
+{
+  if (n <= SLAB_MIN)
+  {
+    return 0;
+  }
+
+  // The index is the base 2 log of n rounded up, minus the
+  // base 2 log of the smallest class size.
+  return 64 - __builtin_clzll(n - 1) - 4;
+}
+
+
+/**
+ * Puts a slab at the front of its class's partial list.
+ */
+static inline void slab_push(k_slab_class* c, k_slab* s)
+{
+  s->prev = NULL;
+  s->next = c->partial;
+  if (c->partial != NULL)
+  {
+    c->partial->prev = s;
+  }
+  c->partial = s;
+}
+
+
+/**
+ * Removes a slab from its class's partial list.
+ */
+static inline void slab_remove(k_slab_class* c, k_slab* s)
+{
+  if (s->prev != NULL)
+  {
+    s->prev->next = s->next;
+  }
+  else
+  {
+    c->partial = s->next;
+  }
+
+  if (s->next != NULL)
+  {
+    s->next->prev = s->prev;
+  }
+
+  s->next = NULL;
+  s->prev = NULL;
+}
+
+
+/**
+ * Creates a new slab for a size class.
+ *
+ * Params:
+ *   int - the index of a size class
+ *
+ * Returns:
+ *   k_slab* - a new slab with no allocated objects or NULL on failure
+ */
+static k_slab* slab_create(int cls)
+{
+  k_slab_class* c = &s_classes[cls];
+
+  k_slab* s = (k_slab*)k_memory_alloc_pages(1);
+  if (s == NULL)
+  {
+    return NULL;
+  }
+
+  // The tag tells k_heap_free that objects in this page belong to a slab.
+  k_memory_tag_pages((void*)s, 1);
+
+  // The first object starts at the first 16 byte boundary
+  // after the slab header.
+  k_regn start = PTR_TO_N(s) + ((sizeof(k_slab) + 0xF) & ~((k_regn)0xF));
+  k_regn end = PTR_TO_N(s) + 0x1000;
+
+  s->next = NULL;
+  s->prev = NULL;
+  s->used = 0;
+  s->total = (end - start) / c->size;
+  s->cls = cls;
+
+  // Link all the objects together in address order.
+  s->free = (void*)start;
+  for (uint32_t i = 0; i < s->total - 1; i++)
+  {
+    *(void**)(start + i * c->size) = (void*)(start + (i + 1) * c->size);
+  }
+  *(void**)(start + (s->total - 1) * c->size) = NULL;
+
+  c->slabs++;
+
+  return s;
+}
+
+
+/**
+ * Allocates an object from a slab size class.
+ *
+ * Params:
+ *   int - the index of a size class
+ *
+ * Returns:
+ *   void* - the address of an object or NULL on failure
+ */
+static void* slab_alloc(int cls)
+{
+  k_slab_class* c = &s_classes[cls];
+  k_slab* s = c->partial;
+
+  // If there are no partially used slabs, then use the empty slab
+  // if there is one, or create a new one if there isn't.
+  if (s == NULL)
+  {
+    if (c->empty != NULL)
+    {
+      s = c->empty;
+      c->empty = NULL;
+    }
+    else
+    {
+      s = slab_create(cls);
+      if (s == NULL)
+      {
+        return NULL;
+      }
+    }
+
+    slab_push(c, s);
+  }
+
+  void* obj = s->free;
+  s->free = *(void**)obj;
+  s->used++;
+  c->used++;
+
+  // Full slabs are not kept in any list.
+  // They are found again from their objects' addresses when freed.
+  if (s->used == s->total)
+  {
+    slab_remove(c, s);
+  }
+
+  return obj;
+}
+
+
+/**
+ * Returns an object to its slab.
+ *
+ * Params:
+ *   void* - the address of an object allocated from a slab
+ */
+static void slab_free(void* obj)
+{
+  // Slabs are exactly one page, so the slab header is at the
+  // start of the page that contains the object.
+  k_slab* s = (k_slab*)(PTR_TO_N(obj) & ~((k_regn)0xFFF));
+  k_slab_class* c = &s_classes[s->cls];
+
+  // If the slab was full, then it has a free object again.
+  if (s->used == s->total)
+  {
+    slab_push(c, s);
+  }
+
+  *(void**)obj = s->free;
+  s->free = obj;
+  s->used--;
+  c->used--;
+
+  // Keep one empty slab for each class so that an allocation and free
+  // at a slab boundary doesn't allocate and free a page every time.
+  if (s->used == 0)
+  {
+    slab_remove(c, s);
+
+    if (c->empty == NULL)
+    {
+      c->empty = s;
+    }
+    else
+    {
+      c->slabs--;
+      k_memory_tag_pages((void*)s, 0);
+      k_memory_free_pages((void*)s);
+    }
+  }
+}
+
+
+/**
+ * Gets the index of the free list for a block of a given size.
+ */
+static inline int bin_index(k_regn size)
+{
+  return 63 - __builtin_clzll(size);
+}
+
+
+/**
+ * Puts a free block in the free list for its size and writes its footer.
+ */
+static inline void bin_push(k_heap_header* h)
+{
+  int i = bin_index(h->size);
+
+  *(k_regn*)(PTR_TO_N(h) + h->size - FOOTER_SIZE) = h->size;
+
+  h->flags |= AVAILABLE;
+  h->prev = NULL;
+  h->next = s_bins[i];
+  if (h->next != NULL)
+  {
+    h->next->prev = h;
+  }
+  s_bins[i] = h;
+  s_bin_map |= ((uint64_t)1 << i);
+}
+
+
+/**
+ * Removes a free block from the free list for its size.
+ */
+static inline void bin_remove(k_heap_header* h)
+{
+  int i = bin_index(h->size);
+
+  if (h->prev != NULL)
+  {
+    h->prev->next = h->next;
+  }
+  else
+  {
+    s_bins[i] = h->next;
+  }
+
+  if (h->next != NULL)
+  {
+    h->next->prev = h->prev;
+  }
+
+  if (s_bins[i] == NULL)
+  {
+    s_bin_map &= ~((uint64_t)1 << i);
+  }
+
+  h->flags &= ~(AVAILABLE);
+}
+
+
+// Gets the header of the block after a block.
+static inline k_heap_header* next_block(k_heap_header* h)
+{
+  return (k_heap_header*)(PTR_TO_N(h) + h->size);
+}
+
+
+// Gets the header of the first block in an arena.
+static inline k_heap_header* first_block(k_heap_arena* a)
+{
+  return (k_heap_header*)(PTR_TO_N(a) + sizeof(k_heap_arena));
+}
+
+
+/**
+ * Creates a new arena large enough to hold a block of a given size
+ * and puts its memory in the free lists.
+ *
+ * Params:
+ *   k_regn - the size of a block
+ *
+ * Returns:
+ *   k_heap_arena* - a new arena or NULL on failure
+ */
+static k_heap_arena* arena_create(k_regn size)
+{
+  k_regn overhead = sizeof(k_heap_arena) + HEADER_SIZE;
+  k_regn pages = (size + overhead + 0xFFF) / 0x1000;
+  if (pages < ARENA_PAGES)
+  {
+    pages = ARENA_PAGES;
+  }
+
+  k_heap_arena* a = (k_heap_arena*)k_memory_alloc_pages(pages);
+  if (a == NULL)
+  {
+    return NULL;
+  }
+
+  a->pages = pages;
+  a->prev = NULL;
+  a->next = s_arenas;
+  if (s_arenas != NULL)
+  {
+    s_arenas->prev = a;
+  }
+  s_arenas = a;
+
+  // The whole arena starts out as a single free block.
+  k_heap_header* h = first_block(a);
+  h->size = pages * 0x1000 - overhead;
+  h->flags = FIRST_BLOCK;
+  bin_push(h);
+
+  // The epilogue marks the end of the arena.
+  k_heap_header* e = next_block(h);
+  e->size = 0;
+  e->flags = PREV_AVAILABLE;
+
+  return a;
+}
+
+
+/**
+ * Returns an arena's memory to the physical memory manager.
+ * The arena must contain a single free block.
+ */
+static void arena_release(k_heap_arena* a)
+{
+  bin_remove(first_block(a));
+
+  if (a->prev != NULL)
+  {
+    a->prev->next = a->next;
+  }
+  else
+  {
+    s_arenas = a->next;
+  }
+
+  if (a->next != NULL)
+  {
+    a->next->prev = a->prev;
+  }
+
+  k_memory_free_pages((void*)a);
+}
+
+
 void k_heap_init()
 {
-  // Allocate 128 KiB of contiguous memory for the initial kernel heap.
-  s_heap = (k_byte*)k_memory_alloc_pages(32);
+  s_arenas = NULL;
+  s_bin_map = 0;
+  for (int i = 0; i < BINS; i++)
+  {
+    s_bins[i] = NULL;
+  }
 
-  if (s_heap == NULL)
+  // Allocate 128 KiB of contiguous memory for the initial kernel heap.
+  if (arena_create(0) == NULL)
   {
     fprintf(
       stddbg,
@@ -38,157 +488,251 @@ void k_heap_init()
     HANG();
   }
 
-  // Given a header struct h with an address of a, the starting
-  // address can be calculated as
-  // s = a + sizeof(h).
-  s_start = PTR_TO_N(s_heap) + sizeof(k_heap_header);
-
-  // Given a starting address of s, and a number of bytes available of n,
-  // the ending address e can be calculated as
-  // e = s + n - 1.
-  s_end = s_start + 0x20000 - sizeof(k_heap_header) - 1;
+  // Initialize the slab size classes.
+  for (int i = 0; i < SLAB_CLASSES; i++)
+  {
+    s_classes[i].partial = NULL;
+    s_classes[i].empty = NULL;
+    s_classes[i].size = SLAB_MIN << i;
+    s_classes[i].slabs = 0;
+    s_classes[i].used = 0;
+  }
+}
 
-  // The initial header will have a next pointer of NULL to indicate that
-  // it's the last header in the list.
-  ((k_heap_header*)s_heap)[0].next = NULL;
 
-  // Since 128 KiB (or 0x20000 bytes) were allocated for the heap,
-  // the initial size is 0x20000 - sizeof(k_heap_header)
-  ((k_heap_header*)s_heap)[0].size = 0x20000 - sizeof(k_heap_header);
+/**
+ * Allocates n bytes from the segregated free lists.
+ * This is used for allocations that are too large for the slabs.
+ *
+ * Params:
+ *   size_t - the number of bytes to allocate
+ *
+ * Returns:
+ *   void* - the base address of the region of newly allocated memory
+ */
+static void* block_alloc(size_t n)
+{
+  // The block has to hold the header and the requested bytes,
+  // rounded up to a multiple of 16 to keep everything aligned.
+  k_regn size = (n + HEADER_SIZE + 0xF) & ~((k_regn)0xF);
+  if (size < BLOCK_MIN)
+  {
+    size = BLOCK_MIN;
+  }
 
-  ((k_heap_header*)s_heap)[0].flags = AVAILABLE;
-}
+  k_heap_header* h = NULL;
 
+  // Check the free list that the requested size falls into,
+  // since it may have some blocks that are big enough.
+  int i = bin_index(size);
+  for (k_heap_header* b = s_bins[i]; b != NULL; b = b->next)
+  {
+    if (b->size >= size)
+    {
+      h = b;
+      break;
+    }
+  }
 
-void* k_heap_alloc(size_t n)
-{
-  k_heap_header* h = (k_heap_header*)s_heap;
+  // Every block in a higher free list is big enough,
+  // so take the first block from the lowest one that isn't empty.
+  if (h == NULL)
+  {
+    uint64_t higher = i < BINS - 1 ? s_bin_map & ~(((uint64_t)2 << i) - 1) : 0;
+    if (higher)
+    {
+      h = s_bins[__builtin_ctzll(higher)];
+    }
+  }
 
-  // Locate the first free region of memory.
-  // The AVAILABLE flag must be set and the size of the region must be
-  // >= the request amount.
-  while (h->next != NULL && (h->size < n || !(h->flags & AVAILABLE)))
+  // If there are no free blocks big enough, then grow the heap.
+  if (h == NULL)
   {
-    h = h->next;
+    k_heap_arena* a = arena_create(size);
+    if (a == NULL)
+    {
+      return NULL;
+    }
+    h = first_block(a);
   }
 
-  // If we reached the end of heap memory and did not find
-  // any available regions, then the allocation failed.
-  if (h->next == NULL && (h->size < n || !(h->flags & AVAILABLE)))
+  bin_remove(h);
+
+  // Split the block if what's left over is big enough to be
+  // a block of its own.
+  if (h->size - size >= BLOCK_MIN)
   {
-    return NULL;
+    k_heap_header* rest = (k_heap_header*)(PTR_TO_N(h) + size);
+    rest->size = h->size - size;
+    rest->flags = 0;
+    h->size = size;
+    bin_push(rest);
+  }
+  else
+  {
+    next_block(h)->flags &= ~(PREV_AVAILABLE);
   }
 
-  // h now describes a free region of memory that be allocated.
-  // Get the starting and ending addresses of the region.
-  k_regn start = PTR_TO_N(h) + sizeof(k_heap_header);
-  k_regn end = start + h->size - 1;
+  return (void*)(PTR_TO_N(h) + HEADER_SIZE);
+}
+
 
-  // Create a new heap header after the region that has been located.
-  // This is only necessary if there is enough memory remaining in
-  // the requested region to allow for a new heap header describing
-  // at least one byte of memory.
-  if (h->size >= n + sizeof(k_heap_header) + 1)
+/**
+ * Frees a block and merges it with the free blocks before and after it.
+ *
+ * Params:
+ *   void* - the base address of a region of allocated memory
+ */
+static void block_free(void* r)
+{
+  k_heap_header* h = (k_heap_header*)(PTR_TO_N(r) - HEADER_SIZE);
+
+  // Ignore double frees.
+  if (h->flags & AVAILABLE)
   {
-    k_heap_header* newh = (k_heap_header*)(start + n);
+    return;
+  }
 
-    newh->next = h->next != NULL ? h->next : NULL;
-    newh->size = end - (PTR_TO_N(newh) + sizeof(k_heap_header)) + 1;
-    newh->flags = AVAILABLE;
+  // Merge with the next block.
+  k_heap_header* next = next_block(h);
+  if (next->flags & AVAILABLE)
+  {
+    bin_remove(next);
+    h->size += next->size;
+  }
 
-    h->size = n;
-    h->next = newh;
+  // Merge with the previous block.
+  // Its size is in the footer right before this block's header.
+  if (h->flags & PREV_AVAILABLE)
+  {
+    k_regn prev_size = *(k_regn*)(PTR_TO_N(h) - FOOTER_SIZE);
+    k_heap_header* prev = (k_heap_header*)(PTR_TO_N(h) - prev_size);
+    bin_remove(prev);
+    prev->size += h->size;
+    h = prev;
   }
 
-  // Clear the AVAILABLE flag of the allocated region to indicate
-  // that it is now allocated.
-  h->flags &= ~(AVAILABLE);
+  bin_push(h);
+  next_block(h)->flags |= PREV_AVAILABLE;
 
-  return (void*)start;
+  // If the arena is completely free, give it back to the
+  // physical memory manager, unless it's the initial heap.
+  // The first block keeps its flag through merges, and the arena
+  // header is right before it.
+  if ((h->flags & FIRST_BLOCK) && next_block(h)->size == 0)
+  {
+    k_heap_arena* a = (k_heap_arena*)(PTR_TO_N(h) - sizeof(k_heap_arena));
+    if (a->next != NULL)
+    {
+      arena_release(a);
+    }
+  }
 }
 
 
-void k_heap_free(void* r)
+void* k_heap_alloc(size_t n)
 {
-  k_regn s = PTR_TO_N(r);
+  void* r;
 
-  k_heap_header* h = (k_heap_header*)s_heap;
+  k_mcs_node node;
+  k_regn flags = k_mcs_acquire_irqsave(&s_lock, &node);
 
-  // Locate the header of the region whose starting address
-  // matches the argument and whose AVAILABLE is cleared.
-  while (h->next != NULL &&
-    (PTR_TO_N(h) + sizeof(k_heap_header) != s
-      || (h->flags & AVAILABLE))
-    )
+  if (n <= SLAB_MAX)
+  {
+    r = slab_alloc(slab_class_index(n));
+  }
+  else
   {
-    h = h->next;
+    r = block_alloc(n);
   }
 
-  // If we failed to find an allocated region whose starting
-  // address matched the argument, then return.
-  if (h->next == NULL &&
-    (PTR_TO_N(h) + sizeof(k_heap_header) != s
-      || (h->flags & AVAILABLE)))
+  k_mcs_release_irqrestore(&s_lock, &node, flags);
+
+  return r;
+}
+
+
+void k_heap_free(void* r)
+{
+  if (r == NULL)
   {
     return;
   }
 
-  // Set the AVAILABLE flag to indicate that the region is no longer
-  // allocated.
-  h->flags |= AVAILABLE;
+  k_mcs_node node;
+  k_regn flags = k_mcs_acquire_irqsave(&s_lock, &node);
 
-  // Merge the freed region with adjacent regions.
-  if (h->next != NULL && (h->next->flags & AVAILABLE))
+  // Slab pages are tagged, so the page that contains an object tells
+  // which allocator it came from.
+  if (k_memory_tagged((void*)(PTR_TO_N(r) & ~((k_regn)0xFFF))))
   {
-    h->size = h->size + h->next->size + sizeof(k_heap_header);
-
-    h->next = h->next->next;
+    slab_free(r);
+  }
+  else
+  {
+    block_free(r);
   }
+
+  k_mcs_release_irqrestore(&s_lock, &node, flags);
 }
 
+
 // Prints a description of a region of memory based on information
 // found in a heap header.
 static inline void print_header(k_heap_header* h)
 {
-  // Given a header struct h with an address of a, the starting
+  // Given a header h with an address of a, the starting
   // address can be calculated as
-  // s = a + sizeof(h).
-  k_regn start = PTR_TO_N(h) + sizeof(k_heap_header);
+  // s = a + HEADER_SIZE.
+  k_regn start = PTR_TO_N(h) + HEADER_SIZE;
 
-  // Given a starting address of s and a size of z, the ending
-  // address can be calculated as e = s + z - 1.
-  k_regn end = start + h->size - 1;
+  // Given a starting address of s and a block size of z, the ending
+  // address can be calculated as e = s + z - HEADER_SIZE - 1.
+  k_regn end = start + h->size - HEADER_SIZE - 1;
 
   fprintf(
     stddbg,
-    "| %-16llX %-16llX %-16llu                |\n",
+    "| %-16llX %-16llX %-16llu %-14s |\n",
     start,
     end,
-    h->size
+    h->size - HEADER_SIZE,
+    (h->flags & AVAILABLE) ? "free" : "allocated"
   );
 }
 
 void k_heap_print()
 {
-  if (s_heap == NULL)
+  if (s_arenas == NULL)
   {
     fprintf(stddbg, "[HEAP] kernel heap is NULL\n");
     return;
   }
 
-  k_heap_header* h = (k_heap_header*)s_heap;
-
-  fprintf(stddbg, "+-------------------------------------------------------------------+\n");
-  fprintf(stddbg, "| header size: %-3lld  base: %-16llX  limit: %-16llX |\n", sizeof(k_heap_header), PTR_TO_N(s_heap), s_end);
+  for (k_heap_arena* a = s_arenas; a != NULL; a = a->next)
+  {
+    fprintf(stddbg, "+-------------------------------------------------------------------+\n");
+    fprintf(stddbg, "| header size: %-3lld  base: %-16llX  pages: %-16llu |\n", (uint64_t)HEADER_SIZE, PTR_TO_N(a), a->pages);
+    fprintf(stddbg, "+-------------------------------------------------------------------+\n");
+    fprintf(stddbg, "| start            end              size             status         |\n");
+    fprintf(stddbg, "+-------------------------------------------------------------------+\n");
+    for (k_heap_header* h = first_block(a); h->size != 0; h = next_block(h))
+    {
+      print_header(h);
+    }
+  }
   fprintf(stddbg, "+-------------------------------------------------------------------+\n");
-  fprintf(stddbg, "| start            end              size                            |\n");
+  fprintf(stddbg, "| class            slabs            objects                         |\n");
   fprintf(stddbg, "+-------------------------------------------------------------------+\n");
-  while (h->next != NULL)
+  for (int i = 0; i < SLAB_CLASSES; i++)
   {
-    print_header(h);
-    h = h->next;
+    fprintf(
+      stddbg,
+      "| %-16llu %-16llu %-16llu                |\n",
+      (uint64_t)s_classes[i].size,
+      s_classes[i].slabs,
+      s_classes[i].used
+    );
   }
-  print_header(h);
   fprintf(stddbg, "+-------------------------------------------------------------------+\n");
-
+  k_spin_print("heap", &s_lock_stats);
 }
@@ -0,0 +1,164 @@
+#include "osdev64/hpet.h"
+#include "osdev64/bitmask.h"
+#include "osdev64/paging.h"
+
+#include "klibc/stdio.h"
+
+
+// HPET register address offsets
+#define HPET_CAP ((uint64_t)0x000)
+#define HPET_CONFIG ((uint64_t)0x010)
+#define HPET_COUNTER ((uint64_t)0x0F0)
+#define HPET_TIMER_CONFIG(n) ((uint64_t)0x100 + 0x20 * (n))
+
+// general capabilities
+#define HPET_CAP_COUNT_64 BM_13 // the main counter is 64 bits
+
+// general configuration
+#define HPET_CONFIG_ENABLE BM_0 // start the main counter
+#define HPET_CONFIG_LEGACY BM_1 // replace the PIT and RTC IRQs
+
+// comparator configuration
+#define HPET_TIMER_ENABLE BM_2 // enable the interrupt
+
+// largest period allowed by the specification (100 ns) in femtoseconds
+#define HPET_MAX_PERIOD 100000000
+
+// smallest period that's believed (1 ns) in femtoseconds
+// No HPET counts faster than 1 GHz, so a smaller period means the
+// register is wrong. The HPET is the reference for measuring the TSC,
+// and the 64-bit arithmetic in clock.c relies on its rate being sane.
+#define HPET_MIN_PERIOD 1000000
+
+// number of femtoseconds in one second
+#define FS_PER_SEC ((uint64_t)1000000000000000)
+
+
+// The HPET description table (obtained from the ACPI interface)
+extern k_byte* g_hpet;
+
+// HPET base
+static volatile k_byte* s_hpet = NULL;
+
+// main counter rate in counts per second
+static uint64_t s_hz = 0;
+
+
+/**
+ * Reads a value from an HPET register.
+ *
+ * Params:
+ *   uint64_t - the offset of the register from the base address
+ *
+ * Returns:
+ *   uint64_t - the contents of the register
+ */
+static uint64_t hpet_read(uint64_t offset)
+{
+  return *(volatile uint64_t*)(s_hpet + offset);
+}
+
+
+/**
+ * Writes a value to an HPET register.
+ *
+ * Params:
+ *   uint64_t - the offset of the register from the base address
+ *   uint64_t - the contents to write to the register
+ */
+static void hpet_write(uint64_t offset, uint64_t value)
+{
+  *(volatile uint64_t*)(s_hpet + offset) = value;
+}
+
+
+void k_hpet_init()
+{
+  if (g_hpet == NULL)
+  {
+    fprintf(stddbg, "[HPET] No HPET detected\n");
+    return;
+  }
+
+  // The base address is a generic address structure at offset 40.
+  // Its first byte is the address space, which must be 0 (memory),
+  // and the address itself is at offset 44.
+  if (g_hpet[40] != 0)
+  {
+    fprintf(stddbg, "[ERROR] HPET registers are not memory mapped\n");
+    return;
+  }
+
+  uint64_t base = *(uint64_t*)(g_hpet + 44);
+
+  uint64_t virt = k_paging_map_range(base, base + 0x3FF, PAGING_UC);
+  if (virt == 0)
+  {
+    fprintf(stddbg, "[ERROR] failed to map HPET virtual base\n");
+    return;
+  }
+  s_hpet = (volatile k_byte*)virt;
+
+  // The period of the main counter in femtoseconds
+  // is in bits [63:32] of the capabilities register.
+  uint64_t cap = hpet_read(HPET_CAP);
+  uint64_t period = cap >> 32;
+
+  if (period < HPET_MIN_PERIOD || period > HPET_MAX_PERIOD)
+  {
+    fprintf(stddbg, "[ERROR] invalid HPET period: %llu fs\n", period);
+    s_hpet = NULL;
+    return;
+  }
+
+  // A 32-bit main counter wraps around every few minutes,
+  // which is too often for it to be used as a clock.
+  if (!(cap & HPET_CAP_COUNT_64))
+  {
+    fprintf(stddbg, "[HPET] main counter is only 32 bits\n");
+    s_hpet = NULL;
+    return;
+  }
+
+  s_hz = FS_PER_SEC / period;
+
+  // Stop the main counter, and turn off legacy replacement so the
+  // PIT's IRQ still goes where the MADT says it does.
+  uint64_t config = hpet_read(HPET_CONFIG);
+  config &= ~(HPET_CONFIG_ENABLE | HPET_CONFIG_LEGACY);
+  hpet_write(HPET_CONFIG, config);
+
+  // Disable the interrupts of all comparators.
+  // The number of comparators - 1 is in bits [12:8].
+  int timers = ((cap >> 8) & 0x1F) + 1;
+  for (int i = 0; i < timers; i++)
+  {
+    uint64_t tc = hpet_read(HPET_TIMER_CONFIG(i));
+    hpet_write(HPET_TIMER_CONFIG(i), tc & ~HPET_TIMER_ENABLE);
+  }
+
+  // Start the main counter from 0.
+  hpet_write(HPET_COUNTER, 0);
+  hpet_write(HPET_CONFIG, config | HPET_CONFIG_ENABLE);
+
+  fprintf(stddbg, "[HPET] rate: %llu Hz, comparators: %d\n", s_hz, timers);
+}
+
+
+int k_hpet_available()
+{
+  return s_hpet == NULL ? 0 : 1;
+}
+
+
+uint64_t k_hpet_read()
+{
+  return hpet_read(HPET_COUNTER);
+}
+
+
+uint64_t k_hpet_hz()
+{
+  return s_hz;
+}
+
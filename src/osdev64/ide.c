@@ -3,7 +3,7 @@
 #include "osdev64/memory.h"
 #include "osdev64/instructor.h"
 #include "osdev64/paging.h"
-#include "osdev64/pit.h"
+#include "osdev64/clock.h"
 
 #include "klibc/stdio.h"
 
@@ -90,6 +90,12 @@
 #define      ATA_READ      0x00
 #define      ATA_WRITE     0x01
 
+// Delays in microseconds.
+// A drive needs 400 ns to respond after it's selected, and the wiki's
+// example waits 1 ms after sending an IDENTIFY command.
+#define IDE_SELECT_DELAY 1
+#define IDE_COMMAND_DELAY 1000
+
 
 typedef struct ide_cfg {
   uint16_t io;
@@ -235,11 +241,11 @@ void k_ide_init()
 
       // Select a drive.
       ide_write(i, IDE_ATA, 0xA0 | (j << 4));
-      k_pit_wait(10);
+      k_delay_us(IDE_SELECT_DELAY);
 
       // Identify the drive.
       ide_write(i, ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
-      k_pit_wait(10);
+      k_delay_us(IDE_COMMAND_DELAY);
 
       // for (int polling = 1; polling && polling < 1000;)
       for (int polling = 1; polling;)
@@ -278,7 +284,7 @@ void k_ide_init()
         {
           type = IDE_ATAPI;
           ide_write(i, ATA_REG_COMMAND, ATA_CMD_IDENTIFY_PACKET);
-          k_pit_wait(10);
+          k_delay_us(IDE_COMMAND_DELAY);
 
           // Clear the error.
           err = 0;
@@ -67,11 +67,16 @@ void k_install_isr(void (isr)(), int i)
   // Bits [34:32] are the IST index, ranging from 1-7 if an IST
   // is used, or 0 if no IST is used.
   // ISR0 will use IST1 for handling divide errors.
+  // ISR14 will use IST2 for handling page faults.
   // All other ISRs will just not bother with the IST for now.
   if (i == 0)
   {
     lo |= ((uint64_t)1 << 32);
   }
+  else if (i == 14)
+  {
+    lo |= ((uint64_t)2 << 32);
+  }
 
   // Bits [43:40] are the type configuration for a 32-bit interrupt gate.
   // We're currently using the bits 1 1 1 0
@@ -148,6 +153,12 @@ void k_idt_init()
     k_install_isr(generic_isr, i);
   }
 
+  k_idt_load();
+}
+
+
+void k_idt_load()
+{
   uint16_t limit = (sizeof(int_desc) * 512) - 1;
 
   k_lidt(limit, g_idt);
@@ -53,6 +53,19 @@ k_enable_interrupts:
   retq
 
 
+# Enables interrupts and executes the HLT instruction to stop the
+# processor until the next interrupt arrives. Since STI doesn't take
+# effect until after the instruction that follows it, an interrupt
+# can't slip in between the two and leave the processor halted.
+# Interrupts are disabled again before returning.
+.global k_halt
+k_halt:
+  sti
+  hlt
+  cli
+  retq
+
+
 # Executes the OUT isntruction to write an 8-bit value to a 16-bit port.
 # The first argument is a 16-bit port number, and the second argument
 # is an 8-bit value to be written.
@@ -257,6 +270,22 @@ k_set_cr0:
   retq
 
 
+# Reads the value of CR2.
+# After a page fault, CR2 contains the address that caused the fault.
+#
+# Returns:
+#   RAX - the value read from CR2
+.global k_get_cr2
+k_get_cr2:
+  push %rbp
+  mov %rsp, %rbp
+
+  mov %cr2, %rax
+
+  leaveq
+  retq
+
+
 # Reads the value of CR3.
 #
 # Returns:
@@ -285,6 +314,31 @@ k_set_cr3:
   leaveq
   retq
 
+# Invalidates the TLB entries for the page containing an address.
+# Params:
+#
+#   RDI - a virtual address
+.global k_invlpg
+k_invlpg:
+  push %rbp
+  mov %rsp, %rbp
+
+  invlpg (%rdi)
+
+  leaveq
+  retq
+
+# Writes back all modified cache lines and invalidates the caches.
+.global k_wbinvd
+k_wbinvd:
+  push %rbp
+  mov %rsp, %rbp
+
+  wbinvd
+
+  leaveq
+  retq
+
 
 # Reads the value of CR4.
 #
@@ -389,6 +443,30 @@ k_cpuid_rdx:
   retq
 
 
+# Executes the CPUID instruction and returns the value that was placed
+# in RCX. The subleaf input in RCX is 0.
+#
+# Params:
+#   RDI - the input provided to CPUID
+#
+# Returns:
+#   RAX - the value placed in RCX by the CPUID instruction
+.global k_cpuid_rcx
+k_cpuid_rcx:
+  push %rbp
+  mov %rsp, %rbp
+  push %rbx
+
+  mov %rdi, %rax
+  xor %rcx, %rcx
+  cpuid
+  mov %rcx, %rax
+
+  pop %rbx
+  leaveq
+  retq
+
+
 # Executes the CPUID instruction to get the vendor identification string.
 # At the start of the procedure, RDI is expected to contain the address
 # of at least 12 bytes of memory.
@@ -488,6 +566,20 @@ k_xchg:
   retq
 
 
+# Executes the RDTSC instruction to read the time stamp counter.
+# RDTSC puts the low 32 bits in EAX and the high 32 bits in EDX,
+# so they're combined into RAX.
+#
+# Returns:
+#   RAX - the value of the time stamp counter
+.global k_rdtsc
+k_rdtsc:
+  rdtsc
+  shl $32, %rdx
+  or %rdx, %rax
+  retq
+
+
 # Executes the XADD instruction to add the value of RDI to the
 # value pointed to by RSI. The previous value held at the memory
 # location is returned. The lock prefix is added to lock the bus.
@@ -696,6 +788,60 @@ k_syscall_sleep:
   leaveq
   retq
 
+# Invokes the SLEEP_SYNC syscall.
+.global k_syscall_sleep_sync
+k_syscall_sleep_sync:
+  push %rbp
+  mov %rsp, %rbp
+
+  mov $3, %rax   # syscall ID is 3 (for SLEEP_SYNC)
+  mov %rdi, %rcx # synchronization type
+  mov %rsi, %rdx # address of the synchronization value
+  int $0xA0
+
+  leaveq
+  retq
+
+# Invokes the FUTEX_WAIT syscall.
+.global k_syscall_futex_wait
+k_syscall_futex_wait:
+  push %rbp
+  mov %rsp, %rbp
+
+  mov $8, %rax   # syscall ID is 8 (for FUTEX_WAIT)
+  mov %rdi, %rcx # address of the futex word
+  mov %rsi, %rdx # expected value
+  int $0xA0
+
+  leaveq
+  retq
+
+# Invokes the FUTEX_WAKE syscall.
+.global k_syscall_futex_wake
+k_syscall_futex_wake:
+  push %rbp
+  mov %rsp, %rbp
+
+  mov $9, %rax   # syscall ID is 9 (for FUTEX_WAKE)
+  mov %rdi, %rcx # address of the futex word
+  mov %rsi, %rdx # most tasks to wake
+  int $0xA0
+
+  leaveq
+  retq
+
+# Invokes the YIELD syscall.
+.global k_syscall_yield
+k_syscall_yield:
+  push %rbp
+  mov %rsp, %rbp
+
+  mov $7, %rax # syscall ID is 7 (for YIELD)
+  int $0xA0
+
+  leaveq
+  retq
+
 .global k_syscall_write
 k_syscall_write:
   push %rbp
@@ -142,6 +142,9 @@
 .global generic_isr
 .global apic_generic_isr
 .global apic_spurious_isr
+.global apic_timer_isr
+.global apic_ipi_call_isr
+.global apic_ipi_wake_isr
 .global apic_generic_legacy_isr
 
 
@@ -195,7 +198,11 @@
 .extern pic_handler
 .extern apic_generic_handler
 .extern apic_spurious_handler
-.extern apic_pit_handler
+.extern apic_timer_handler
+.extern k_task_switch_done
+.extern apic_ipi_call_handler
+.extern apic_ipi_wake_handler
+.extern hpet_handler
 .extern apic_generic_legacy_handler
 
 # debug handler
@@ -266,9 +273,15 @@ isr13:
   iretq
 
 
+# The processor pushes an error code for page faults,
+# which has to be removed before returning.
 isr14:
   cld
+  push_caller_saved
+  mov 80(%rsp), %rdi # ARG 1 (error code)
   call page_fault_handler
+  pop_caller_saved
+  add $8, %rsp # Remove the error code.
   iretq
 
 
@@ -449,57 +462,7 @@ pic_irq_15:
 
 
 apic_irq_0:
-  cld
-
-  # RSP is now assumed to be 16-byte aligned
-  # The stack should have this structure:
-  # +------------+
-  # | SS         |
-  # | RSP        | <- RSP from before entering this ISR
-  # | RFLAGS     |
-  # | CS         |
-  # | RIP        |
-  # +------------+ <- RSP currently points to the top of this stack frame
-
-  # Push the task registers onto the stack.
-  push_task_regs
-
-  # After pushing the current task's registers onto the stack,
-  # the local stack frame should have this structure:
-  #
-  # +------------+
-  # | SS         |
-  # | RSP        |
-  # | RFLAGS     |
-  # | CS         |
-  # | RIP        |
-  # |------------|
-  # | RAX        |
-  # | RBX        |
-  # | RCX        |
-  # | RDX        |
-  # | RSI        |
-  # | RDI        |
-  # | r8         |
-  # | r9         |
-  # | r10        |
-  # | r11        |
-  # | r12        |
-  # | r13        |
-  # | r14        |
-  # | r15        |
-  # | RBP        |
-  # | padding    |
-  # +------------+ <- RSP now points to the top of this stack frame
-
-  # Call the timer handler.
-  mov %rsp, %rdi
-  call apic_pit_handler
-  mov %rax, %rsp
-
-  # Pop the task registers from the stack.
-  pop_task_regs
-
+  handle_generic_irq 0, apic_generic_legacy_handler
   iretq
 
 apic_irq_1:
@@ -581,6 +544,75 @@ apic_spurious_isr:
   pop_caller_saved
   iretq
 
+apic_timer_isr:
+  cld
+
+  # RSP is now assumed to be 16-byte aligned
+  # The stack should have this structure:
+  # +------------+
+  # | SS         |
+  # | RSP        | <- RSP from before entering this ISR
+  # | RFLAGS     |
+  # | CS         |
+  # | RIP        |
+  # +------------+ <- RSP currently points to the top of this stack frame
+
+  # Push the task registers onto the stack.
+  push_task_regs
+
+  # After pushing the current task's registers onto the stack,
+  # the local stack frame should have this structure:
+  #
+  # +------------+
+  # | SS         |
+  # | RSP        |
+  # | RFLAGS     |
+  # | CS         |
+  # | RIP        |
+  # |------------|
+  # | RAX        |
+  # | RBX        |
+  # | RCX        |
+  # | RDX        |
+  # | RSI        |
+  # | RDI        |
+  # | r8         |
+  # | r9         |
+  # | r10        |
+  # | r11        |
+  # | r12        |
+  # | r13        |
+  # | r14        |
+  # | r15        |
+  # | RBP        |
+  # | padding    |
+  # +------------+ <- RSP now points to the top of this stack frame
+
+  # Call the timer handler.
+  mov %rsp, %rdi
+  call apic_timer_handler
+  mov %rax, %rsp
+  call k_task_switch_done
+
+  # Pop the task registers from the stack.
+  pop_task_regs
+
+  iretq
+
+apic_ipi_call_isr:
+  cld
+  push_caller_saved
+  call apic_ipi_call_handler
+  pop_caller_saved
+  iretq
+
+apic_ipi_wake_isr:
+  cld
+  push_caller_saved
+  call apic_ipi_wake_handler
+  pop_caller_saved
+  iretq
+
 apic_generic_legacy_isr:
   cld
   push_caller_saved
@@ -604,6 +636,7 @@ debug_isr:
 # Currently supported system calls:
 # 2 STOP  stops the current task
 # 3 SLEEP puts the current task to sleep
+# 7 YIELD gives up the rest of the current task's time slice
 # 0xFACE FACE  writes a number somewhere
 .global k_syscall_isr
 k_syscall_isr:
@@ -640,6 +673,15 @@ k_syscall_isr:
   cmpq $6, %rax # check for READ syscall
   je .sc_read
 
+  cmpq $7, %rax # check for YIELD syscall
+  je .sc_yield
+
+  cmpq $8, %rax # check for FUTEX_WAIT syscall
+  je .sc_futex_wait
+
+  cmpq $9, %rax # check for FUTEX_WAKE syscall
+  je .sc_futex_wake
+
   cmpq $0xFACE, %rax # check for FACE syscall
   je .sc_face
 
@@ -652,6 +694,17 @@ k_syscall_isr:
   mov %rsp, %rsi # ARG 2 (register stack)
   call k_syscall # Invoke the syscall.
   mov %rax, %rsp # Get the new register stack.
+  call k_task_switch_done # Let go of the previous task.
+  pop_task_regs  # Restore the task register stack.
+  iretq          # return from ISR
+
+.sc_yield:
+  push_task_regs # Save the task register stack.
+  mov %rax, %rdi # ARG 1 (syscall ID)
+  mov %rsp, %rsi # ARG 2 (register stack)
+  call k_syscall # Invoke the syscall.
+  mov %rax, %rsp # Get the new register stack.
+  call k_task_switch_done # Let go of the previous task.
   pop_task_regs  # Restore the task register stack.
   iretq          # return from ISR
 
@@ -664,6 +717,20 @@ k_syscall_isr:
   mov %r11, %rdx # ARG 3 (synchronization type)
   call k_syscall # Invoke the syscall.
   mov %rax, %rsp # Get the new register stack.
+  call k_task_switch_done # Let go of the previous task.
+  pop_task_regs  # Restore the task register stack.
+  iretq          # return from ISR
+
+.sc_futex_wait:
+  push_task_regs # Save the task register stack.
+  mov %rax, %rdi # ARG 1 (syscall ID)
+  mov %rsp, %rsi # ARG 2 (register stack)
+  mov %rcx, %r11 # Store RCX in scratch register
+  mov %rdx, %rcx # ARG 4 (expected value)
+  mov %r11, %rdx # ARG 3 (address of futex word)
+  call k_syscall # Invoke the syscall.
+  mov %rax, %rsp # Get the new register stack.
+  call k_task_switch_done # Let go of the previous task.
   pop_task_regs  # Restore the task register stack.
   iretq          # return from ISR
 
@@ -674,6 +741,7 @@ k_syscall_isr:
   mov %rcx, %rdx # ARG 3 (number of ticks)
   call k_syscall # Invoke the syscall.
   mov %rax, %rsp # Get the new register stack.
+  call k_task_switch_done # Let go of the previous task.
   pop_task_regs  # Restore the task register stack.
   iretq          # return from ISR
 
@@ -702,3 +770,10 @@ k_syscall_isr:
   mov %r8, %rsi     # ARG 2 (file pointer)
   call k_syscall    # Invoke the syscall.
   iretq             # return from ISR
+
+.sc_futex_wake:
+  # RDX already contains ARG 3 (most tasks to wake)
+  mov %rax, %rdi    # ARG 1 (syscall ID)
+  mov %rcx, %rsi    # ARG 2 (address of futex word)
+  call k_syscall    # Invoke the syscall.
+  iretq             # return from ISR
@@ -23,11 +23,15 @@
 #include "osdev64/apic.h"
 #include "osdev64/task.h"
 #include "osdev64/sync.h"
+#include "osdev64/timer.h"
+#include "osdev64/clock.h"
+#include "osdev64/hpet.h"
 #include "osdev64/syscall.h"
 #include "osdev64/ps2.h"
 #include "osdev64/tty.h"
 #include "osdev64/pci.h"
 #include "osdev64/ide.h"
+#include "osdev64/smp.h"
 
 // temporary task demo for debugging task code
 #include "osdev64/task_demo.h"
@@ -53,10 +57,12 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   k_graphics_init();    // graphical output
   k_serial_com1_init(); // serial output
   k_memory_init();      // physical memory management
+  k_smp_reserve();      // memory below 1 MiB for starting the APs
   k_heap_init();        // heap management
   k_console_init();     // text output
   k_acpi_init();        // ACPI tables
   k_sync_init();        // synchronization
+  k_timer_init();       // timers
   k_ps2_init();         // PS/2 keyboard emulation
 
   fprintf(stddbg, "[INFO] graphics, serial, console, and memory have been initialized.\n");
@@ -180,6 +186,12 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   // Initialize the PIT to start generating timer IRQs.
   k_pit_init();
 
+  // Start the HPET's main counter, if there is one.
+  k_hpet_init();
+
+  // Choose a clock source and measure it against the PIT.
+  k_clock_init();
+
   // Initialize the APIC interface.
   k_apic_init();
 
@@ -217,6 +229,10 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
     // Configure the IRQ redirection in the I/O APIC.
     k_ioapic_configure();
 
+    // Calibrate the local APIC timer against the PIT
+    // and start the scheduler's tick.
+    k_lapic_timer_init();
+
     fprintf(stddbg, "---------------------------------------\n");
   }
   else
@@ -237,6 +253,9 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   k_task* main_task = k_task_create(NULL);
   k_task_schedule(main_task);
 
+  // Start the application processors.
+  k_smp_init();
+
   // END Stage 2 initialization
   //==============================
 
@@ -289,22 +308,22 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   // char* my_ram2 = (char*)k_memory_alloc_pages(1);
   // char* my_ram3 = (char*)k_memory_alloc_pages(1);
   // char* my_ram4 = NULL;
-  // k_memory_print_ledger();
+  // k_memory_print_orders();
 
   // // Free the second region of memory.
   // fprintf(stddbg, "freeing 1 page\n");
   // k_memory_free_pages((void*)my_ram2);
-  // k_memory_print_ledger();
+  // k_memory_print_orders();
 
   // // Allocate three pages for the second memory region.
   // fprintf(stddbg, "reserving 3 pages\n");
   // my_ram2 = (char*)k_memory_alloc_pages(3);
-  // k_memory_print_ledger();
+  // k_memory_print_orders();
 
   // // Allocate one more page. 
   // fprintf(stddbg, "reserving 1 page\n");
   // my_ram4 = (char*)k_memory_alloc_pages(1);
-  // k_memory_print_ledger();
+  // k_memory_print_orders();
 
   //==========================================
   // END physical memory demo
@@ -313,7 +332,7 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
 
 
   //==========================================
-  // BEGIN virtual address ledger
+  // BEGIN dynamic virtual address space
   //==========================================
 
   // fprintf(stddbg, "mapping a range of physical addreses into dynamic virtual address space\n");
@@ -321,21 +340,21 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   // char* phys_dat = (char*)k_memory_alloc_pages(2);
   // char* virt_dat = (char*)k_paging_map_range(PTR_TO_N(phys_dat), PTR_TO_N(phys_dat) + 0x1000);
 
-  // // Print the dynamic virtual address map ledger.
-  // k_paging_print_ledger();
+  // // Print the dynamic virtual address space.
+  // k_paging_print_map();
 
   // fprintf(stddbg, "mapping a second range\n");
   // // map some more physical memory into dynamic virtual address space.
   // char* phys_dat2 = (char*)k_memory_alloc_pages(2);
   // char* virt_dat2 = (char*)k_paging_map_range(PTR_TO_N(phys_dat2), PTR_TO_N(phys_dat2) + 0x1000);
 
-  // // Print the dynamic virtual address map ledger.
-  // k_paging_print_ledger();
+  // // Print the dynamic virtual address space.
+  // k_paging_print_map();
 
   // fprintf(stddbg, "unmapping the first range\n");
   // k_paging_unmap_range(PTR_TO_N(virt_dat));
 
-  // k_paging_print_ledger();
+  // k_paging_print_map();
 
   // fprintf(stddbg, "mapping a third range\n");
 
@@ -343,7 +362,7 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   // char* phys_dat3 = (char*)k_memory_alloc_pages(2);
   // char* virt_dat3 = (char*)k_paging_map_range(PTR_TO_N(phys_dat3), PTR_TO_N(phys_dat3) + 0x1000);
 
-  // k_paging_print_ledger();
+  // k_paging_print_map();
 
   // virt_dat3[0] = 'J';
   // virt_dat3[1] = 'E';
@@ -356,7 +375,7 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   // fprintf(stddbg, "phys_dat3: %s\n", phys_dat3);
 
   //==========================================
-  // END virtual address ledger
+  // END dynamic virtual address space
   //==========================================
 
 
@@ -367,7 +386,7 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   // k_memory_print_pool();
 
   // fprintf(stddbg, "RAM Ledger:\n");
-  // k_memory_print_ledger();
+  // k_memory_print_orders();
 
   // Print the MADT
   // k_acpi_print_madt();
@@ -388,6 +407,22 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
   // while (sem1->status != TASK_REMOVED);
   // k_task_destroy(sem1);
 
+  // // Demonstrate tasks with their own address spaces.
+  // k_task* space1 = k_task_create(space_demo_1);
+  // k_task_schedule(space1);
+  // while (space1->status != TASK_REMOVED || !k_task_destroy(space1));
+
+  // // Demonstrate a futex lock under contention.
+  // k_task* futex1 = k_task_create(futex_demo_1);
+  // k_task_schedule(futex1);
+  // while (futex1->status != TASK_REMOVED || !k_task_destroy(futex1));
+
+  // // Demonstrate a futex lock in the private half of an address space.
+  // k_task* futex2 = k_task_create(futex_demo_2);
+  // k_task_isolate(futex2);
+  // k_task_schedule(futex2);
+  // while (futex2->status != TASK_REMOVED || !k_task_destroy(futex2));
+
   // END demo code
   //==============================
 
@@ -447,11 +482,17 @@ efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE* systab)
     // Do stuff
     if (count < 10)
     {
-      k_pit_wait(120);
+      k_syscall_sleep(TIMER_HZ);
       // printf("Hello, World!\n");
       printf("[DEBUG] count: %d\n", count++);
       // printf(shell_out, "[DEBUG] count: %d\n", count++);
     }
+    else
+    {
+      // There's nothing left for the main task to do, so it stops
+      // instead of spinning, and the other tasks get the processor.
+      k_syscall_stop();
+    }
 
     // fprintf(
     //   stddbg,
@@ -1,6 +1,10 @@
 #include "osdev64/firmware.h"
 #include "osdev64/core.h"
 #include "osdev64/memory.h"
+#include "osdev64/instructor.h"
+#include "osdev64/control.h"
+#include "osdev64/smp.h"
+#include "osdev64/spinlock.h"
 
 #include "klibc/stdio.h"
 
@@ -9,23 +13,52 @@
 extern k_mem_map g_sys_mem;
 
 
+// page frame flags
+#define FRAME_FREE 0x1 // the frame is the first page of a free block
+#define FRAME_HEAD 0x2 // the frame is the first page of an allocation
+#define FRAME_TAG 0x4  // the allocation was tagged by its owner
+
+// the end of a free list
+#define FRAME_NONE 0xFFFFFFFF
+
+
+// the largest number of extra references to an allocation
+#define FRAME_REFS_MAX 0xFFFF
+
+
 /**
- * A single entry in the physical RAM pool
+ * A page frame descriptor.
+ * There is one descriptor for every page in the RAM pool.
+ * The free list links are indices of other descriptors in the same
+ * region, which keeps the descriptor small.
+ * The reference count of an allocation is the number of references in
+ * addition to the one held by whoever allocated it, so a newly allocated
+ * block always starts at 0 and no initialization is needed.
+ * The current expected size of this struct is 16 bytes.
  */
-typedef struct pool_entry {
-  k_regn address; // physical address
-  k_regn pages;   // number of pages
-}pool_entry;
+typedef struct page_frame {
+  uint32_t next;  // next free block of the same order
+  uint32_t prev;  // previous free block of the same order
+  uint32_t count; // number of pages in an allocation
+  uint8_t order;  // order of the free block that starts at this page
+  uint8_t flags;  // FRAME_FREE, FRAME_HEAD, and FRAME_TAG
+  uint16_t refs;  // number of extra references to an allocation
+}page_frame;
 
 /**
- * A single entry in the page reservation ledger.
+ * A single entry in the physical RAM pool.
+ * Each entry is a region of contiguous pages with its own buddy
+ * allocator free lists.
  */
-typedef struct ledger_entry {
-  int i; // index of available memory region array
-  k_regn address;
-  k_regn pages;
-  k_byte avail; // availability flag
-}ledger_entry;
+typedef struct pool_entry {
+  k_regn address;      // physical address
+  k_regn pages;        // number of pages
+  uint32_t type;       // UEFI memory type
+  page_frame* frames;  // page frame descriptors
+  uint32_t free_map;   // bit n is set if there is a free block of order n
+  uint32_t heads[RAM_ORDER_MAX + 1]; // first free block of each order
+  uint32_t counts[RAM_ORDER_MAX + 1]; // number of free blocks of each order
+}pool_entry;
 
 // number of regions in the RAM pool
 int g_pool_count = 0;
@@ -33,8 +66,18 @@ int g_pool_count = 0;
 // RAM pool
 pool_entry g_ram_pool[RAM_POOL_MAX];
 
-// RAM ledger
-ledger_entry* g_ram_ledger;
+// indices of the RAM pool entries in ascending order of address
+static int s_pool_index[RAM_POOL_MAX];
+
+// statistics for the memory lock
+static k_spin_stats s_lock_stats;
+
+// lock for the free lists and page frame descriptors
+// It's held with interrupts disabled, since pages are allocated by
+// interrupt handlers such as the page fault handler.
+// Every processor that runs out of cached pages takes it, so it's a
+// queued lock.
+static k_mcs_lock s_lock = K_MCS_LOCK_INIT(&s_lock_stats);
 
 uint64_t g_total_ram = 0;
 
@@ -176,9 +219,180 @@ static void print_mmap()
 }
 
 
+/**
+ * Puts a block at the front of the free list for its order.
+ *
+ * Params:
+ *   pool_entry* - the region that contains the block
+ *   uint32_t - index of the first page of the block
+ *   uint32_t - order of the block
+ */
+static inline void list_push(pool_entry* p, uint32_t b, uint32_t k)
+{
+  page_frame* f = &p->frames[b];
+
+  f->flags = FRAME_FREE;
+  f->order = (uint8_t)k;
+  f->prev = FRAME_NONE;
+  f->next = p->heads[k];
+
+  if (f->next != FRAME_NONE)
+  {
+    p->frames[f->next].prev = b;
+  }
+
+  p->heads[k] = b;
+  p->counts[k]++;
+  p->free_map |= ((uint32_t)1 << k);
+}
+
+
+/**
+ * Removes a block from the free list for its order.
+ *
+ * Params:
+ *   pool_entry* - the region that contains the block
+ *   uint32_t - index of the first page of the block
+ *   uint32_t - order of the block
+ */
+static inline void list_remove(pool_entry* p, uint32_t b, uint32_t k)
+{
+  page_frame* f = &p->frames[b];
+
+  if (f->prev != FRAME_NONE)
+  {
+    p->frames[f->prev].next = f->next;
+  }
+  else
+  {
+    p->heads[k] = f->next;
+  }
+
+  if (f->next != FRAME_NONE)
+  {
+    p->frames[f->next].prev = f->prev;
+  }
+
+  f->flags = 0;
+
+  p->counts[k]--;
+  if (p->heads[k] == FRAME_NONE)
+  {
+    p->free_map &= ~((uint32_t)1 << k);
+  }
+}
+
+
+/**
+ * Frees a single block and merges it with its buddy for as long as
+ * the buddy is also a free block of the same order.
+ *
+ * The buddy of a block is found by flipping bit k of its index, so
+ * a block and its buddy always form an aligned block of order k + 1.
+ *
+ * Params:
+ *   pool_entry* - the region that contains the block
+ *   uint32_t - index of the first page of the block
+ *   uint32_t - order of the block
+ */
+static void free_block(pool_entry* p, uint32_t b, uint32_t k)
+{
+  while (k < RAM_ORDER_MAX)
+  {
+    uint32_t buddy = b ^ ((uint32_t)1 << k);
+
+    // The buddy has to exist entirely within the region.
+    if ((uint64_t)buddy + ((uint64_t)1 << k) > p->pages)
+    {
+      break;
+    }
+
+    page_frame* f = &p->frames[buddy];
+    if (!(f->flags & FRAME_FREE) || f->order != k)
+    {
+      break;
+    }
+
+    list_remove(p, buddy, k);
+
+    if (buddy < b)
+    {
+      b = buddy;
+    }
+    k++;
+  }
+
+  list_push(p, b, k);
+}
+
+
+/**
+ * Frees every page in a range of page indices.
+ * The range is broken up into the largest aligned blocks that fit,
+ * and each block is freed separately.
+ *
+ * Params:
+ *   pool_entry* - the region that contains the pages
+ *   uint64_t - index of the first page in the range
+ *   uint64_t - index of the page after the last page in the range
+ */
+static void release_run(pool_entry* p, uint64_t start, uint64_t end)
+{
+  while (start < end)
+  {
+    uint32_t k = 0;
+    while (k < RAM_ORDER_MAX
+      && !(start & ((uint64_t)1 << k))
+      && start + ((uint64_t)2 << k) <= end)
+    {
+      k++;
+    }
+
+    free_block(p, (uint32_t)start, k);
+    start += (uint64_t)1 << k;
+  }
+}
+
+
+/**
+ * Finds the region of the RAM pool that contains an address.
+ *
+ * Params:
+ *   k_regn - a physical address
+ *
+ * Returns:
+ *   pool_entry* - the region containing the address or NULL
+ */
+static pool_entry* find_region(k_regn a)
+{
+  int lo = 0;
+  int hi = g_pool_count - 1;
+
+  while (lo <= hi)
+  {
+    int mid = (lo + hi) / 2;
+    pool_entry* p = &g_ram_pool[s_pool_index[mid]];
+
+    if (a < p->address)
+    {
+      hi = mid - 1;
+    }
+    else if (a >= p->address + p->pages * 0x1000)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      return p;
+    }
+  }
+
+  return NULL;
+}
+
+
 void k_memory_init()
 {
-  ledger_entry root;        // root page reservation
   EFI_MEMORY_DESCRIPTOR* d; // UEFI memory descriptor
   char* start;              // base address of memory map
   char* end;                // end of memory map
@@ -209,6 +423,7 @@ void k_memory_init()
     {
       g_ram_pool[g_pool_count].address = (uint64_t)(d->PhysicalStart);
       g_ram_pool[g_pool_count].pages = (uint64_t)(d->NumberOfPages);
+      g_ram_pool[g_pool_count].type = d->Type;
 
       // Don't allow an entry at address 0.
       // If the base of the region is 0, attempt to use
@@ -265,11 +480,9 @@ void k_memory_init()
   while (!sorted)
   {
     sorted = 1;
-    for (int i = 0; i < g_pool_count; i++)
+    for (int i = 0; i < g_pool_count - 1; i++)
     {
-      if (g_ram_pool[i].pages > g_ram_pool[i + 1].pages
-        && i < g_pool_count - 1
-        )
+      if (g_ram_pool[i].pages > g_ram_pool[i + 1].pages)
       {
         sorted = 0;
         pool_entry tmp = g_ram_pool[i];
@@ -279,98 +492,147 @@ void k_memory_init()
     }
   }
 
-  // Create the page reservation ledger.
+  // Calculate how many pages are needed to hold a page frame
+  // descriptor for every page in the pool.
+  uint64_t total_pages = 0;
   for (int i = 0; i < g_pool_count; i++)
   {
-    // Look for a region that contains at least 41 pages.
-    // Currently, the RAM_LEDGER_MAX is 5000, and each ledger
-    // entry is assumed to be 32 bytes, so 5000 entries would
-    // take up 40 pages. We use page 41 for the system font data.
-    // We use pages 42 and 43 for the temporary loaded app.
-    if (g_ram_pool[i].pages >= 43)
+    total_pages += g_ram_pool[i].pages;
+  }
+  uint64_t frame_pages = (total_pages * sizeof(page_frame) + 0xFFF) / 0x1000;
+
+  // Take the page frame descriptors from the beginning of the first
+  // conventional memory region that is large enough to hold all of them.
+  // Loader and boot services regions are avoided since they still
+  // contain the kernel image and the stack at this point.
+  // Those pages are removed from the region, so they will never be
+  // handed out by the allocator.
+  page_frame* frames = NULL;
+  for (int i = 0; i < g_pool_count && frames == NULL; i++)
+  {
+    if (g_ram_pool[i].type == EfiConventionalMemory
+      && g_ram_pool[i].pages >= frame_pages)
     {
-      // Populate the root memory reservation.
-      root.i = i;
-      root.address = g_ram_pool[i].address;
-      root.pages = 43;
-      root.avail = 0;
+      frames = (page_frame*)(g_ram_pool[i].address);
+      g_ram_pool[i].address += frame_pages * 0x1000;
+      g_ram_pool[i].pages -= frame_pages;
+    }
+  }
+
+  if (frames == NULL)
+  {
+    fprintf(stddbg, "[ERROR] failed to allocate page frame descriptors\n");
+    HANG();
+  }
 
-      // Set the base address of the reservation array.
-      g_ram_ledger = (ledger_entry*)(root.address);
+  // Give each region its portion of the descriptors,
+  // and put all of its pages in the free lists.
+  for (int i = 0; i < g_pool_count; i++)
+  {
+    pool_entry* p = &g_ram_pool[i];
 
-      // Put the root memory reservation in the reservation array.
-      g_ram_ledger[0] = root;
+    p->frames = frames;
+    frames += p->pages;
 
-      // Mark all of the entries as available.
-      for (int j = 1; j < RAM_LEDGER_MAX; j++)
-      {
-        g_ram_ledger[j].avail = 1;
-      }
+    p->free_map = 0;
+    for (int k = 0; k <= RAM_ORDER_MAX; k++)
+    {
+      p->heads[k] = FRAME_NONE;
+      p->counts[k] = 0;
+    }
+
+    for (uint64_t j = 0; j < p->pages; j++)
+    {
+      p->frames[j].flags = 0;
+      p->frames[j].refs = 0;
+    }
 
-      return;
+    release_run(p, 0, p->pages);
+  }
+
+  // Build the index of regions sorted by address so the region
+  // that contains an address can be found with a binary search.
+  for (int i = 0; i < g_pool_count; i++)
+  {
+    int j = i;
+    while (j > 0 && g_ram_pool[s_pool_index[j - 1]].address > g_ram_pool[i].address)
+    {
+      s_pool_index[j] = s_pool_index[j - 1];
+      j--;
     }
+    s_pool_index[j] = i;
   }
 }
 
 
-void* k_memory_alloc_pages(size_t n)
+/**
+ * Takes a series of pages from the free lists.
+ * Only regions that end at or below the limit are used.
+ *
+ * Params:
+ *   size_t - the number of pages requested
+ *   k_regn - the highest address the pages may end at
+ *
+ * Returns:
+ *   void* - a pointer to the region of memory or NULL on failure
+ */
+static void* alloc_pages(size_t n, k_regn limit)
 {
+  if (n == 0)
+  {
+    return NULL;
+  }
+
+  // Find the smallest order whose blocks can hold n pages.
+  uint32_t order = 0;
+  while (order <= RAM_ORDER_MAX && ((uint64_t)1 << order) < n)
+  {
+    order++;
+  }
+
+  if (order > RAM_ORDER_MAX)
+  {
+    fprintf(stddbg, "[ERROR] failed to allocate %llu pages\n", n);
+    return NULL;
+  }
+
   for (int i = 0; i < g_pool_count; i++)
   {
-    // Find a contiguous region of RAM that contains at least
-    // the requested number of pages.
-    if (g_ram_pool[i].pages >= n)
+    pool_entry* p = &g_ram_pool[i];
+
+    if (p->address + p->pages * 0x1000 > limit)
     {
-      // number of addresses in the pool entry.
-      uint64_t p_size = g_ram_pool[i].pages * 0x1000;
+      continue;
+    }
 
-      // start and end addresses of requested memory region
-      uint64_t req_start = g_ram_pool[i].address;
-      uint64_t req_end = req_start + (n * 0x1000) - 1;
+    // Ignore the free lists whose blocks are too small.
+    uint32_t usable = p->free_map & ~(((uint32_t)1 << order) - 1);
+    if (!usable)
+    {
+      continue;
+    }
 
-      for (int j = 0; j < RAM_LEDGER_MAX; j++)
-      {
-        if (g_ram_ledger[j].i == i && !g_ram_ledger[j].avail)
-        {
-          // start and end addresses of reserved memory region
-          uint64_t res_start = g_ram_ledger[j].address;
-          uint64_t res_end = res_start + (g_ram_ledger[j].pages * 0x1000) - 1;
-
-          // If the requested region overlaps a reserved region,
-          // update the start and end addresses of the requested region.
-          if (
-            (req_start >= res_start && req_start <= res_end)
-            ||
-            (res_start >= req_start && res_start <= req_end)
-            )
-          {
-            req_start = res_end + 1;
-            req_end = req_start + (n * 0x1000) - 1;
-          }
-        }
-      }
+    // Take the first block from the smallest free list
+    // that has blocks big enough.
+    uint32_t k = __builtin_ctz(usable);
+    uint32_t b = p->heads[k];
+    list_remove(p, b, k);
 
-      if (req_end <= g_ram_pool[i].address + p_size - 1)
-      {
-        // Create a new page reservation.
-        ledger_entry res;
-        res.i = i;
-        res.avail = 0;
-        res.address = req_start;
-        res.pages = n;
-
-        // Put the new page reservation in the ledger,
-        // and return the base address of the reservation.
-        for (int j = 0; j < RAM_LEDGER_MAX; j++)
-        {
-          if (g_ram_ledger[j].avail)
-          {
-            g_ram_ledger[j] = res;
-            return (void*)(res.address);
-          }
-        }
-      }
+    // Split the block in half until it is the requested order.
+    // The upper half of each split goes back in the free lists.
+    while (k > order)
+    {
+      k--;
+      list_push(p, b + ((uint32_t)1 << k), k);
     }
+
+    // Return the pages at the end of the block that weren't requested.
+    release_run(p, b + n, b + ((uint64_t)1 << order));
+
+    p->frames[b].flags = FRAME_HEAD;
+    p->frames[b].count = n;
+
+    return (void*)(p->address + (k_regn)b * 0x1000);
   }
 
   fprintf(stddbg, "[ERROR] failed to allocate %llu pages\n", n);
@@ -379,22 +641,281 @@ void* k_memory_alloc_pages(size_t n)
 }
 
 
-void k_memory_free_pages(void* addr)
+/**
+ * Checks if any region of the RAM pool has a free block.
+ *
+ * Returns:
+ *   int - 1 if there is free memory or 0 if there isn't
+ */
+static int any_free()
+{
+  for (int i = 0; i < g_pool_count; i++)
+  {
+    if (g_ram_pool[i].free_map)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static void free_pages(void* addr);
+
+/**
+ * Returns pages from the current processor's page cache to the free lists
+ * until the specified number of pages are left in it.
+ * This must be called with the lock held.
+ *
+ * Params:
+ *   k_cpu* - the current processor
+ *   uint32_t - the number of pages to leave in the cache
+ */
+static void cache_trim(k_cpu* cpu, uint32_t keep)
+{
+  while (cpu->page_count > keep)
+  {
+    free_pages(cpu->pages[--cpu->page_count]);
+  }
+}
+
+
+void* k_memory_alloc_pages(size_t n)
+{
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  // Single pages come from the processor's own page cache when it has
+  // any, which doesn't need the lock.
+  // The cache is only used with interrupts disabled, and a page fault
+  // can't re-enter it either. The k_cpu structures are part of the kernel
+  // image, and no function is called between reading the cache and
+  // updating it, so the stack can't grow into an unmapped page there.
+  k_cpu* cpu = k_smp_cpu();
+  if (n == 1 && cpu->page_count > 0)
+  {
+    void* page = cpu->pages[--cpu->page_count];
+    k_set_rflags(flags);
+
+    return page;
+  }
+
+  k_mcs_node node;
+  k_mcs_acquire(&s_lock, &node);
+
+  void* pages = alloc_pages(n, ~(k_regn)0);
+
+  // Cached pages can't merge with their buddies, so they may be what's
+  // keeping a large enough block from forming.
+  if (pages == NULL && cpu->page_count > 0)
+  {
+    cache_trim(cpu, 0);
+    pages = alloc_pages(n, ~(k_regn)0);
+  }
+
+  // Half of an empty cache is refilled while the lock is held, so the
+  // next few single pages don't need it.
+  if (n == 1 && pages != NULL)
+  {
+    while (cpu->page_count < SMP_PAGE_CACHE / 2 && any_free())
+    {
+      cpu->pages[cpu->page_count++] = alloc_pages(1, ~(k_regn)0);
+    }
+  }
+
+  k_mcs_release_irqrestore(&s_lock, &node, flags);
+
+  return pages;
+}
+
+
+void* k_memory_alloc_below(size_t n, k_regn limit)
+{
+  k_mcs_node node;
+  k_regn flags = k_mcs_acquire_irqsave(&s_lock, &node);
+
+  void* pages = alloc_pages(n, limit);
+
+  k_cpu* cpu = k_smp_cpu();
+  if (pages == NULL && cpu->page_count > 0)
+  {
+    cache_trim(cpu, 0);
+    pages = alloc_pages(n, limit);
+  }
+
+  k_mcs_release_irqrestore(&s_lock, &node, flags);
+
+  return pages;
+}
+
+
+/**
+ * Finds the page frame descriptor of the first page of an allocation.
+ *
+ * Params:
+ *   void* - the address of the first page of an allocation
+ *   pool_entry** - where to put the region that contains the allocation
+ *
+ * Returns:
+ *   page_frame* - the descriptor of the first page or NULL
+ */
+static page_frame* find_head(void* addr, pool_entry** region)
 {
   k_regn a = PTR_TO_N(addr);
 
-  for (int i = 1; i < RAM_LEDGER_MAX; i++)
+  pool_entry* p = find_region(a);
+  if (p == NULL || a % 0x1000)
+  {
+    return NULL;
+  }
+
+  page_frame* f = &p->frames[(a - p->address) / 0x1000];
+  if (!(f->flags & FRAME_HEAD))
   {
-    // Find the first entry in the page reservation ledger
-    // that matches the address and mark it as available.
-    // We skip the first entry in the ledger, since it is
-    // the root page reservation.
-    if (g_ram_ledger[i].address == a && !g_ram_ledger[i].avail)
+    return NULL;
+  }
+
+  *region = p;
+
+  return f;
+}
+
+
+/**
+ * Drops a reference to a series of pages, and returns them to the free
+ * lists if it was the last one.
+ *
+ * Params:
+ *   void* - a pointer to a series of pages
+ */
+static void free_pages(void* addr)
+{
+  pool_entry* p;
+
+  // Only the first page of an allocation can be freed.
+  page_frame* f = find_head(addr, &p);
+  if (f == NULL)
+  {
+    return;
+  }
+
+  // Shared pages are only freed when the last reference is dropped.
+  if (f->refs > 0)
+  {
+    f->refs--;
+    return;
+  }
+
+  f->flags = 0;
+
+  uint64_t b = f - p->frames;
+  release_run(p, b, b + f->count);
+}
+
+
+void k_memory_free_pages(void* addr)
+{
+  k_mcs_node node;
+  k_regn flags = k_mcs_acquire_irqsave(&s_lock, &node);
+
+  // A single page that isn't shared goes to the processor's own page
+  // cache instead of being merged back into the free lists. Its
+  // descriptor is read under the lock, since another holder of a shared
+  // page may be changing its reference count.
+  // Pages in a cache stay allocated as far as the free lists are
+  // concerned, so a cached page looks just like a new allocation.
+  k_cpu* cpu = k_smp_cpu();
+  pool_entry* p;
+  page_frame* f = find_head(addr, &p);
+
+  if (f != NULL && f->count == 1 && f->refs == 0)
+  {
+    // Half of a full cache is returned to the free lists at once,
+    // so the next few frees don't have to merge anything.
+    if (cpu->page_count == SMP_PAGE_CACHE)
+    {
+      cache_trim(cpu, SMP_PAGE_CACHE / 2);
+    }
+
+    f->flags &= ~FRAME_TAG;
+    cpu->pages[cpu->page_count++] = addr;
+  }
+  else
+  {
+    free_pages(addr);
+  }
+
+  k_mcs_release_irqrestore(&s_lock, &node, flags);
+}
+
+
+int k_memory_share_pages(void* addr)
+{
+  pool_entry* p;
+  int res = 0;
+
+  k_mcs_node node;
+  k_regn flags = k_mcs_acquire_irqsave(&s_lock, &node);
+
+  page_frame* f = find_head(addr, &p);
+  if (f != NULL && f->refs < FRAME_REFS_MAX)
+  {
+    f->refs++;
+    res = 1;
+  }
+
+  k_mcs_release_irqrestore(&s_lock, &node, flags);
+
+  return res;
+}
+
+
+uint32_t k_memory_page_refs(void* addr)
+{
+  pool_entry* p;
+
+  page_frame* f = find_head(addr, &p);
+  if (f == NULL)
+  {
+    return 0;
+  }
+
+  return (uint32_t)f->refs + 1;
+}
+
+
+void k_memory_tag_pages(void* addr, int tag)
+{
+  pool_entry* p;
+
+  k_mcs_node node;
+  k_regn flags = k_mcs_acquire_irqsave(&s_lock, &node);
+
+  page_frame* f = find_head(addr, &p);
+  if (f != NULL)
+  {
+    if (tag)
+    {
+      f->flags |= FRAME_TAG;
+    }
+    else
     {
-      g_ram_ledger[i].avail = 1;
-      return;
+      f->flags &= ~FRAME_TAG;
     }
   }
+
+  k_mcs_release_irqrestore(&s_lock, &node, flags);
+}
+
+
+int k_memory_tagged(void* addr)
+{
+  pool_entry* p;
+
+  page_frame* f = find_head(addr, &p);
+
+  return (f != NULL && (f->flags & FRAME_TAG)) ? 1 : 0;
 }
 
 
@@ -421,27 +942,40 @@ void k_memory_print_pool()
   }
 
   fprintf(stddbg, "+-----------------------------------+\n");
+
+  k_spin_print("memory", &s_lock_stats);
 }
 
 
-void k_memory_print_ledger()
+void k_memory_print_orders()
 {
-  fprintf(stddbg, "+------------------------------------------------------+\n");
-  fprintf(stddbg, "| start             end               pages            |\n");
-  fprintf(stddbg, "+------------------------------------------------------+\n");
+  uint64_t total = 0;
+
+  fprintf(stddbg, "+---------------------------------------------+\n");
+  fprintf(stddbg, "| order  pages/block  free blocks  free pages |\n");
+  fprintf(stddbg, "+---------------------------------------------+\n");
 
-  for (int i = 0; i < RAM_LEDGER_MAX; i++)
+  for (int k = 0; k <= RAM_ORDER_MAX; k++)
   {
-    if (!g_ram_ledger[i].avail)
+    uint64_t blocks = 0;
+    for (int i = 0; i < g_pool_count; i++)
     {
-      fprintf(stddbg,
-        "| %p  %p  %-16llu |\n",
-        g_ram_ledger[i].address,
-        g_ram_ledger[i].address + (g_ram_ledger[i].pages * 0x1000) - 1,
-        g_ram_ledger[i].pages
-      );
+      blocks += g_ram_pool[i].counts[k];
     }
+
+    uint64_t pages = blocks << k;
+    total += pages;
+
+    fprintf(stddbg,
+      "| %5d  %11llu  %11llu  %10llu |\n",
+      k,
+      (uint64_t)1 << k,
+      blocks,
+      pages
+    );
   }
 
-  fprintf(stddbg, "+------------------------------------------------------+\n");
+  fprintf(stddbg, "+---------------------------------------------+\n");
+  fprintf(stddbg, "| total free pages:                %10llu |\n", total);
+  fprintf(stddbg, "+---------------------------------------------+\n");
 }
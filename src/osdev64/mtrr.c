@@ -2,6 +2,8 @@
 #include "osdev64/msr.h"
 #include "osdev64/bitmask.h"
 #include "osdev64/cpuid.h"
+#include "osdev64/control.h"
+#include "osdev64/instructor.h"
 
 #include "klibc/stdio.h"
 
@@ -228,4 +230,112 @@ void k_mtrr_print_all()
   fprintf(stddbg, "[PAT] PA5: %s\n", pat_type_to_str((pat >> 40) & 7));
   fprintf(stddbg, "[PAT] PA6: %s\n", pat_type_to_str((pat >> 48) & 7));
   fprintf(stddbg, "[PAT] PA7: %s\n", pat_type_to_str((pat >> 56) & 7));
+}
+
+
+int k_mtrr_is_uniform(uint64_t base, uint64_t size)
+{
+  // If there are no MTRRs, then all of memory has the same type.
+  if (!(k_cpuid_rdx(1) & BM_12))
+  {
+    return 1;
+  }
+
+  uint64_t mtrrdef = k_msr_get(IA32_MTRR_DEF_TYPE);
+
+  // If the MTRRs are disabled, then all of memory is UC.
+  if (!(mtrrdef & BM_11))
+  {
+    return 1;
+  }
+
+  uint64_t end = base + size;
+
+  // The fixed range MTRRs divide the first MiB into pieces as small as
+  // 4 KiB, so we don't bother checking whether they all agree.
+  if ((mtrrdef & BM_10) && base < 0x100000)
+  {
+    return 0;
+  }
+
+  // Physical address bits [MAXPHYADDR-1:12] are used by the
+  // variable range MTRRs.
+  uint64_t phys_bits = k_cpuid_rax(0x80000008) & 0xFF;
+  uint64_t addr_mask = (((uint64_t)1 << phys_bits) - 1) & ~((uint64_t)0xFFF);
+
+  uint64_t vcnt = k_msr_get(IA32_MTRRCAP) & 0xFF;
+  if (vcnt > 10)
+  {
+    vcnt = 10;
+  }
+
+  for (uint64_t i = 0; i < vcnt; i++)
+  {
+    uint64_t physmask = k_msr_get(IA32_MTRR_PHYSMASK0 + i * 2);
+
+    // Bit 11 of the mask register is the valid flag.
+    if (!(physmask & BM_11))
+    {
+      continue;
+    }
+
+    uint64_t physbase = k_msr_get(IA32_MTRR_PHYSBASE0 + i * 2);
+
+    uint64_t mask = physmask & addr_mask;
+    uint64_t var_start = physbase & mask;
+    uint64_t var_end = var_start + ((~mask & addr_mask) + 0x1000);
+
+    // If the range overlaps an MTRR without being completely inside of
+    // it, then part of the range may have a different type than the rest.
+    if (var_start < end && base < var_end)
+    {
+      if (base < var_start || end > var_end)
+      {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+
+int k_pat_init()
+{
+  // CPUID.01H:EDX[bit 16] indicates support for the PAT.
+  if (!(k_cpuid_rdx(1) & BM_16))
+  {
+    return 0;
+  }
+
+  // Change PA1 from WT to WC and leave the other entries alone.
+  uint64_t pat = k_msr_get(IA32_PAT);
+  pat &= ~((uint64_t)0x7 << 8);
+  pat |= ((uint64_t)0x1 << 8);
+
+  // The PAT should only be changed with caching disabled and the
+  // caches flushed, so that no cache lines are left over with the
+  // old memory type.
+  k_regn rflags = k_get_rflags();
+  k_disable_interrupts();
+
+  // Set CR0.CD and clear CR0.NW.
+  k_regn cr0 = k_get_cr0();
+  k_set_cr0((cr0 | BM_30) & ~BM_29);
+  k_wbinvd();
+
+  k_msr_set(IA32_PAT, pat);
+
+  // Flush the TLB and caches, then restore CR0.
+  k_set_cr3(k_get_cr3());
+  k_wbinvd();
+  k_set_cr0(cr0);
+
+  // Only enable interrupts if they were enabled before.
+  if (rflags & BM_9)
+  {
+    k_enable_interrupts();
+  }
+
+  return 1;
 }
\ No newline at end of file
@@ -6,6 +6,10 @@
 #include "osdev64/control.h"
 #include "osdev64/msr.h"
 #include "osdev64/memory.h"
+#include "osdev64/mtrr.h"
+#include "osdev64/vmem.h"
+#include "osdev64/heap.h"
+#include "osdev64/smp.h"
 
 #include "klibc/stdio.h"
 
@@ -15,91 +19,179 @@
 extern uint64_t g_total_ram;
 
 
-// Page Tables
-pte* g_pt_mem;
-
-// Page Directories
-pde* g_pd_mem;
-
-// PDPTs
+// PDPT for the static identity mapping
 pdpte* g_pdpt_mem;
 
 // PML4
 pml4e* g_pml4_mem;
 
-// typedef struct map_ledger_entry {
-//   uint64_t start;
-//   uint64_t end;
-//   uint16_t pdpt_start;
-//   uint16_t pdpt_end;
-//   uint16_t pd_start;
-//   uint16_t pd_end;
-//   uint16_t pt_start;
-//   uint16_t pt_end;
-//   unsigned char avail; // availability flag
-// }map_ledger_entry;
-
-/**
- * A single entry in the virtual address mapping ledger.
- */
-typedef struct map_ledger_entry {
-  k_regn start;
-  k_regn end;
-  unsigned char avail; // availability flag
-}map_ledger_entry;
-
-map_ledger_entry* g_map_ledger;
-
-
 // dynamic virtual address base
 //                    0x  80000000 2 GiB
 //                    0x  40000000 1 GiB
 uint64_t g_dyn_base = 0x8000000000;
 
+// size of the dynamic virtual address space (512 GiB)
+#define DYN_SIZE 0x8000000000
+
+// virtual address space for dynamic mapping
+static k_vmem s_dyn_vmem;
+
 
 // PDPT used for dynamic mapping
 pdpte* g_dyn_pdpt;
 
-// bitmap for tracking page directories for dynamic mapping
-uint64_t g_dyn_pd_map[8];
+// first address of the private half of an address space
+#define PRIVATE_BASE 0xFFFF800000000000
 
-// bitmap for tracking page directories for dynamic mapping
-uint64_t* g_dyn_pt_map;
+// size of the part of the private half that ranges are reserved in
+// (512 GiB, which is mapped by PML4[256])
+#define PRIVATE_SIZE 0x8000000000
 
+// tag of a span created by k_paging_reserve
+// The lower bits of the tag are the reservation flags.
+#define TAG_RESERVED 0x100
 
-// NOTE:
-// page sizes in hexadecimal
-// 1 GiB = 0x40000000
-// 2 MiB = 0x200000
-// 4 KiB = 0x1000
+// a page of zeros that backs every page of read-only reservations
+static k_regn s_zero_page;
 
-// NOTE:
-// 1 GiB is 512 2 MiB pages
+// Bit 9 of a PTE is ignored by the processor.
+// It's used to mark a read-only page as copy-on-write, meaning the page
+// is shared with another reserved range, and writing to it gives the
+// writer a copy of its own.
+#define PTE_COW BM_9
+
+// If more than this many pages are unmapped at once, the whole TLB
+// is flushed by reloading CR3 instead of invalidating each page.
+#define INVLPG_MAX 32
+
+// maximum number of pages that are unmapped and freed at once
+// The TLB entries for them are invalidated together before they're freed.
+#define UNMAP_BATCH 32
+
+
+// a request for other processors to invalidate TLB entries
+// If count is more than INVLPG_MAX, then the whole TLB is flushed.
+typedef struct tlb_shootdown {
+  k_regn* pages; // addresses of the pages
+  k_regn count;  // number of pages
+}tlb_shootdown;
+
+// a region of virtual addresses that is mapped by one PDPT
+// Reserved ranges are either in the dynamic mapping region, which every
+// address space shares, or in the private half of one address space.
+typedef struct region {
+  k_vmem* vmem;        // ranges reserved in the region
+  pdpte* pdpt;         // the PDPT that maps the region
+  k_addr_space* space; // the owner of a private half or NULL
+}region;
+
+// the dynamic mapping region
+static region s_dyn_region;
+
+// bits of a memory type
+// A memory type is an index in the PAT, which is selected by the
+// PWT, PCD, and PAT bits of the entry that maps a page.
+#define PAT_PWT 0x1
+#define PAT_PCD 0x2
+#define PAT_PAT 0x4
 
+// whether the PAT has been programmed with a write-combining entry
+static int s_has_pat = 0;
 
-uint64_t get_bit(uint64_t* map, uint64_t bit)
+// the global flag for kernel mappings (BM_8 if CR4.PGE is set)
+static k_regn s_global = 0;
+
+// whether CR4.PCIDE is set
+static int s_has_pcid = 0;
+
+// number of process context identifiers
+#define PCID_COUNT 4096
+
+// bitmap of PCIDs in use
+// PCID 0 is always used by the kernel address space.
+static uint64_t s_pcid_map[PCID_COUNT / 64];
+
+// the address space of the kernel
+// Its PML4 is g_pml4_mem, and it uses PCID 0.
+static k_addr_space s_kernel_space;
+
+// lock for the dynamic mapping region, the PCID bitmap, and the
+// private halves of the address spaces
+// The address space loaded on each processor is kept in its k_cpu.
+static k_regn s_lock = 0;
+
+
+/**
+ * Disables interrupts and acquires the paging lock.
+ * Interrupts stay disabled, since the page fault handler takes the lock.
+ *
+ * Returns:
+ *   k_regn - the RFLAGS from before interrupts were disabled
+ */
+static k_regn paging_lock()
 {
-  uint64_t i = bit / 64; // which index in the array
-  uint64_t b = bit % 64; // which bit in the uint64_t
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  // The holder of the lock may be waiting for this processor to
+  // invalidate TLB entries, so requests from other processors are
+  // handled while waiting.
+  while (k_bts(0, &s_lock))
+  {
+    while (*(volatile k_regn*)&s_lock)
+    {
+      k_smp_poll();
+    }
+  }
 
-  return (map[i] & ((uint64_t)1 << b));
+  return flags;
+}
+
+
+/**
+ * Releases the paging lock and restores the interrupt flag.
+ *
+ * Params:
+ *   k_regn - the RFLAGS returned by paging_lock
+ */
+static void paging_unlock(k_regn flags)
+{
+  k_btr(0, &s_lock);
+  k_set_rflags(flags);
 }
 
-uint64_t set_bit(uint64_t* map, uint64_t bit, int val)
+
+/**
+ * Invalidates every TLB entry, including global entries.
+ * Reloading CR3 doesn't invalidate global entries, but toggling
+ * CR4.PGE does.
+ */
+static void flush_all()
 {
-  uint64_t i = bit / 64; // which index in the array
-  uint64_t b = bit % 64; // which bit in the uint64_t
+  k_regn cr4 = k_get_cr4();
 
-  if (val)
+  if (cr4 & CR4_PGE)
   {
-    map[i] |= ((uint64_t)1 << b);
+    k_set_cr4(cr4 & ~CR4_PGE);
+    k_set_cr4(cr4);
   }
   else
   {
-    map[i] &= ~((uint64_t)1 << b);
+    k_set_cr3(k_get_cr3());
   }
 }
 
+
+// NOTE:
+// page sizes in hexadecimal
+// 1 GiB = 0x40000000
+// 2 MiB = 0x200000
+// 4 KiB = 0x1000
+
+// NOTE:
+// 1 GiB is 512 2 MiB pages
+
+
 /**
  * Creates a PML4E to hold the address of a PDPT.
  * The resulting PML4E is marked as present, read/write, and supervisor mode.
@@ -245,20 +337,160 @@ static inline pde make_pde(pte* pt_addr)
   return p;
 }
 
+/**
+ * Creates a PDPT entry that maps a 1 GiB page.
+ * The resulting PDPTE is marked as present, read/write, and supervisor mode.
+ * The memory cache type bits are set from the memory type.
+ * The global flag is set if the processor supports global pages.
+ * The PKE bits and execute disable bit are left as 0.
+ * The base address of the page must be 1 GiB aligned.
+ *
+ * Params:
+ *   uint64_t - the base address of a 1 GiB page
+ *   int - the memory type
+ *
+ * Returns:
+ *   pdpte - a PDPT entry
+ */
+static inline pdpte make_pdpte_1g(uint64_t page_addr, int type)
+{
+  pdpte p = 0;
+
+  // Bit 0 is the present flag.
+  // Mark the page as present.
+  p |= BM_0;
+
+  // Bit 1 is the read/write flag.
+  // Set this entry to be read/write.
+  p |= BM_1;
+
+  // Bit 2 is the user/supvisor mode flag.
+  // Leaving it at 0 since there's no user mode yet.
+
+  // Bit 3 is the PWT bit.
+  // Bit 4 is the PCD bit.
+  // Together with the PAT bit, they select an entry in the PAT.
+  if (type & PAT_PWT) p |= BM_3;
+  if (type & PAT_PCD) p |= BM_4;
+
+  // Bit 5 is the access flag.
+  // Bit 6 is the dirty flag.
+
+  // Bit 7 is the page size bit and must be 1 in order
+  // to point to a 1 GiB page.
+  p |= BM_7;
+
+  // Bit 8 is the global translation flag.
+  // Kernel mappings are global, so they stay in the TLB across
+  // changes to CR3.
+  p |= s_global;
+  // Bits [11:9] are ignored.
+
+  // Bit 12 is the PAT bit.
+  if (type & PAT_PAT) p |= BM_12;
+
+  // Bits [29:13] are reserved and must be 0.
+
+  // Bits [51:30] are the address of the page.
+  p |= page_addr;
+
+  // Bits [58:52] are ignored.
+
+  // Bits [62:59] are the protection key.
+  // This is only applicable if CR4.PKE = 1.
+
+  // bit 63 is the execute-disable bit.
+  // It's only used if IA32_EFER.NXE = 1, but we'll
+  // leave it as 0 here.
+
+  return p;
+}
+
+/**
+ * Creates a PDE that maps a 2 MiB page.
+ * The resulting PDE is marked as present, read/write, and supervisor mode.
+ * The memory cache type bits are set from the memory type.
+ * The global flag is set if the processor supports global pages.
+ * The PKE bits and execute disable bit are left as 0.
+ * The base address of the page must be 2 MiB aligned.
+ *
+ * Params:
+ *   uint64_t - the base address of a 2 MiB page
+ *   int - the memory type
+ *
+ * Returns:
+ *   pde - a page directory entry
+ */
+static inline pde make_pde_2m(uint64_t page_addr, int type)
+{
+  pde p = 0;
+
+  // Bit 0 is the present flag.
+  // Mark the page as present.
+  p |= BM_0;
+
+  // Bit 1 is the read/write flag.
+  // Set this entry to be read/write.
+  p |= BM_1;
+
+  // Bit 2 is the user/supvisor mode flag.
+  // Leaving it at 0 since there's no user mode yet.
+
+  // Bit 3 is the PWT bit.
+  // Bit 4 is the PCD bit.
+  // Together with the PAT bit, they select an entry in the PAT.
+  if (type & PAT_PWT) p |= BM_3;
+  if (type & PAT_PCD) p |= BM_4;
+
+  // Bit 5 is the access flag.
+  // Bit 6 is the dirty flag.
+
+  // Bit 7 is the page size bit and must be 1 in order
+  // to point to a 2 MiB page.
+  p |= BM_7;
+
+  // Bit 8 is the global translation flag.
+  // Kernel mappings are global, so they stay in the TLB across
+  // changes to CR3.
+  p |= s_global;
+  // Bits [11:9] are ignored.
+
+  // Bit 12 is the PAT bit.
+  if (type & PAT_PAT) p |= BM_12;
+
+  // Bits [20:13] are reserved and must be 0.
+
+  // Bits [51:21] are the address of the page.
+  p |= page_addr;
+
+  // Bits [58:52] are ignored.
+
+  // Bits [62:59] are the protection key.
+  // This is only applicable if CR4.PKE = 1.
+
+  // bit 63 is the execute-disable bit.
+  // It's only used if IA32_EFER.NXE = 1, but we'll
+  // leave it as 0 here.
+
+  return p;
+}
+
 /**
  * Creates a PTE.
  * The resulting PTE is marked as present, read/write, and supervisor mode.
- * The memory cache type bits, PKE bits, and execute disable bit are all
- * left as 0.
+ * The memory cache type bits are set from the memory type.
+ * The global flag is set if the processor supports global pages.
+ * The PKE bits and execute disable bit are left as 0.
  * The base address of the page must be 4 KiB aligned.
  *
  * Params:
  *   uint64_t - the base address of a 4 KiB page
+ *   int - the memory type
  *
  * Returns:
  *   pte - a page table entry
  */
-static inline pte make_pte(uint64_t page_addr)
+static inline pte make_pte(uint64_t page_addr, int type)
 {
   pte p = 0;
 
@@ -275,10 +507,20 @@ static inline pte make_pte(uint64_t page_addr)
 
   // Bit 3 is the PWT bit.
   // Bit 4 is the PCD bit.
+  // Together with the PAT bit, they select an entry in the PAT.
+  if (type & PAT_PWT) p |= BM_3;
+  if (type & PAT_PCD) p |= BM_4;
+
   // Bit 5 is the access flag.
   // Bit 6 is ignored.
+
   // Bit 7 is the PAT bit.
-  // Bit 8 is the global translation flag. Leaving it as 0 for now.
+  if (type & PAT_PAT) p |= BM_7;
+
+  // Bit 8 is the global translation flag.
+  // Kernel mappings are global, so they stay in the TLB across
+  // changes to CR3.
+  p |= s_global;
 
   // Bits [11:9] are ignored.
 
@@ -298,6 +540,9 @@ static inline pte make_pte(uint64_t page_addr)
 }
 
 
+static k_regn* table_create();
+
+
 void k_paging_init()
 {
   // Fail if the system RAM is >= 512 GiB.
@@ -313,69 +558,32 @@ void k_paging_init()
   //=============================================
   // BEGIN static mapping initialization
 
-  // Calculate the paging structures required to map all of RAM.
-  uint64_t ram_counter = 0;
-  uint64_t ptn = 0;   // number of page tables
-  uint64_t pdn = 1;   // number of page directories
-  uint64_t pdptn = 1; // number of page directory pointer tables
-  while (ram_counter < g_total_ram)
-  {
-    if (!(ram_counter % 0x200000))
-    {
-      // If the counter reaches a multiple of 2 MiB,
-      // increment the number of page tables.
-      ptn++;
-
-      // If the number of page tables reaches a multiple
-      // of 512, increment the number of page directories.
-      if (!(ptn % 512))
-      {
-        pdn++;
-      }
-
-      // If the number of page directories reaches a multiple
-      // of 512, increment the number of PDPTs.
-      if (!(pdn % 512))
-      {
-        pdptn++;
-      }
-    }
-    ram_counter += 0x1000;
-  }
-
-  // If we have an even multiple of 512 page directories,
-  // then we preemptively incremented the PDPT count, so
-  // we correct that here.
-  if (!(pdn % 512))
-  {
-    pdptn--;
-  }
+  // All of RAM is identity mapped using the largest pages possible.
+  // Every GiB is mapped with a single 1 GiB page if the processor
+  // supports them. Otherwise, or if the MTRRs give part of that GiB
+  // a different memory type than the rest, it's mapped with 2 MiB pages.
+  // Any 2 MiB region that doesn't have a single memory type is mapped
+  // with 4 KiB pages.
+  // Since RAM is less than 512 GiB, only one PDPT is needed.
 
-  // Correct the page directory count like we did with the
-  // PDPT count
-  if (!(ptn % 512))
-  {
-    pdn--;
-  }
+  // Program the PAT so that write-combining can be used.
+  s_has_pat = k_pat_init();
 
-  // Get memory for the page tables.
-  g_pt_mem = (pte*)k_memory_alloc_pages(ptn);
-  if (g_pt_mem == NULL)
+  // CPUID.01H:EDX[bit 13] indicates support for global pages.
+  if (k_cpuid_rdx(1) & BM_13)
   {
-    fprintf(stddbg, "[ERROR] failed to allocate memory for page tables\n");
-    HANG();
+    s_global = BM_8;
   }
 
-  // Get memory for the page page directories.
-  g_pd_mem = (pde*)k_memory_alloc_pages(pdn);
-  if (g_pd_mem == NULL)
+  // CPUID.80000001H:EDX[bit 26] indicates support for 1 GiB pages.
+  int has_1g = 0;
+  if (k_cpuid_rax(0x80000000) >= 0x80000001)
   {
-    fprintf(stddbg, "[ERROR] failed to allocate memory for page directories\n");
-    HANG();
+    has_1g = (k_cpuid_rdx(0x80000001) & BM_26) ? 1 : 0;
   }
 
-  // Get memory for the PDPTs.
-  g_pdpt_mem = (pdpte*)k_memory_alloc_pages(pdptn);
+  // Get memory for the PDPT.
+  g_pdpt_mem = (pdpte*)k_memory_alloc_pages(1);
   if (g_pdpt_mem == NULL)
   {
     fprintf(stddbg, "[ERROR] failed to allocate memory for PDPTs\n");
@@ -390,107 +598,113 @@ void k_paging_init()
     HANG();
   }
 
-  // Fill the page tables with base addresses of pages.
-  k_regn addr = 0;
-  for (int i = 0; i < ptn * 512; i++)
+  for (int i = 0; i < 512; i++)
   {
-    g_pt_mem[i] = make_pte(addr);
-    addr += 0x1000;
+    g_pdpt_mem[i] = 0;
   }
 
-  // Fill the page directories with addresses of page tables.
-  for (int i = 0; i < pdn; i++)
+  // Fill the PDPT with 1 GiB pages or addresses of page directories.
+  // RAM was checked to be below 512 GiB above, so this never goes past
+  // the end of the PDPT, but the count is clamped in case that changes.
+  uint64_t pdptn = g_total_ram / 0x40000000;
+  if (pdptn > 512)
+  {
+    pdptn = 512;
+  }
+  for (uint64_t i = 0; i < pdptn; i++)
   {
-    for (int j = 0; j < 512; j++)
+    k_regn gib = i * 0x40000000;
+
+    if (has_1g && k_mtrr_is_uniform(gib, 0x40000000))
     {
-      uint64_t pd_offset = 512 * i + j;
+      g_pdpt_mem[i] = make_pdpte_1g(gib, PAGING_WB);
+      continue;
+    }
 
-      if (pd_offset < ptn)
-      {
-        g_pd_mem[pd_offset] = make_pde(&g_pt_mem[512 * pd_offset]);
-      }
-      else
-      {
-        g_pd_mem[pd_offset] = 0;
-      }
+    pde* pd = (pde*)k_memory_alloc_pages(1);
+    if (pd == NULL)
+    {
+      fprintf(stddbg, "[ERROR] failed to allocate memory for page directories\n");
+      HANG();
     }
-  }
 
-  // Fill the PDPTs with addresses of page directories.
-  for (int i = 0; i < pdptn; i++)
-  {
-    for (int j = 0; j < 512; j++)
+    // Fill the page directory with 2 MiB pages or addresses of page tables.
+    for (uint64_t j = 0; j < 512; j++)
     {
-      uint64_t pdpt_offset = 512 * i + j;
+      k_regn mib = gib + j * 0x200000;
+
+      if (k_mtrr_is_uniform(mib, 0x200000))
+      {
+        pd[j] = make_pde_2m(mib, PAGING_WB);
+        continue;
+      }
 
-      if (pdpt_offset < pdn)
+      pte* pt = (pte*)k_memory_alloc_pages(1);
+      if (pt == NULL)
       {
-        g_pdpt_mem[pdpt_offset] = make_pdpte(&g_pd_mem[512 * pdpt_offset]);
+        fprintf(stddbg, "[ERROR] failed to allocate memory for page tables\n");
+        HANG();
       }
-      else
+
+      // Fill the page table with base addresses of pages.
+      for (uint64_t k = 0; k < 512; k++)
       {
-        g_pdpt_mem[pdpt_offset] = 0;
+        pt[k] = make_pte(mib + k * 0x1000, PAGING_WB);
       }
+
+      pd[j] = make_pde(pt);
     }
+
+    g_pdpt_mem[i] = make_pdpte(pd);
   }
 
-  // Fill the PML4 with addresses of PDPTs.
-  for (int i = 0; i < 512; i++)
+  // Fill the PML4 with the address of the PDPT.
+  g_pml4_mem[0] = make_pml4e(g_pdpt_mem);
+  for (int i = 1; i < 512; i++)
   {
-    if (i < pdptn)
-    {
-      g_pml4_mem[i] = make_pml4e(&g_pdpt_mem[512 * i]);
-    }
-    else
-    {
-      g_pml4_mem[i] = 0;
-    }
+    g_pml4_mem[i] = 0;
   }
 
   // Update CR3 with the address of the PML4.
   k_set_cr3(PTR_TO_N(g_pml4_mem));
 
-  // END static mapping initialization
-  //=============================================
-
-
-  //=============================================
-  // BEGIN dynamic mapping initialization
-
-
-  // Create the virtual address map ledger
-  g_map_ledger = (map_ledger_entry*)k_memory_alloc_pages(8);
-  if (g_map_ledger == NULL)
+  // Enable global pages.
+  if (s_global)
   {
-    fprintf(stddbg, "[ERROR] failed to allocate memory for virtual map ledger\n");
-    HANG();
+    k_set_cr4(k_get_cr4() | CR4_PGE);
   }
 
-  // Mark all ledger entries as available.
-  for (int i = 0; i < MAP_LEDGER_MAX; i++)
+  // CPUID.01H:ECX[bit 17] indicates support for PCIDs.
+  // CR4.PCIDE can only be set while CR3[11:0] is 0, which it is
+  // since the kernel uses PCID 0.
+  if (k_cpuid_rcx(1) & BM_17)
   {
-    g_map_ledger[i].avail = 1;
+    k_set_cr4(k_get_cr4() | CR4_PCIDE);
+    s_has_pcid = 1;
   }
 
-
-  // Get memory for the dynamic page table bitmap
-  g_dyn_pt_map = (uint64_t*)k_memory_alloc_pages(8);
-  if (g_dyn_pt_map == NULL)
+  s_kernel_space.pml4 = g_pml4_mem;
+  s_kernel_space.pcid = 0;
+  s_kernel_space.fresh = 0;
+  for (int i = 0; i < PCID_COUNT / 64; i++)
   {
-    fprintf(stddbg, "[ERROR] failed to allocate memory for dynamic page table bitmap.\n");
-    HANG();
+    s_pcid_map[i] = 0;
   }
+  s_pcid_map[0] = 1;
+
+  // END static mapping initialization
+  //=============================================
+
+
+  //=============================================
+  // BEGIN dynamic mapping initialization
 
-  // Set all the entries in the dynamic page table bitmap to 0.
-  for (int i = 0; i < 4096; i++)
-  {
-    g_dyn_pt_map[i] = 0;
-  }
 
-  // Set all the entries in the dynamic page directory bitmap to 0.
-  for (int i = 0; i < 8; i++)
+  // Create the virtual address space for dynamic mapping.
+  if (!k_vmem_init(&s_dyn_vmem, g_dyn_base, DYN_SIZE))
   {
-    g_dyn_pd_map[i] = 0;
+    fprintf(stddbg, "[ERROR] failed to create dynamic virtual address space\n");
+    HANG();
   }
 
 
@@ -511,6 +725,18 @@ void k_paging_init()
   // Put the dynamic PDPT in the PML4.
   g_pml4_mem[1] = make_pml4e(g_dyn_pdpt);
 
+  s_dyn_region.vmem = &s_dyn_vmem;
+  s_dyn_region.pdpt = g_dyn_pdpt;
+  s_dyn_region.space = NULL;
+
+  // Create the shared page of zeros for read-only reservations.
+  s_zero_page = PTR_TO_N(table_create());
+  if (s_zero_page == 0)
+  {
+    fprintf(stddbg, "[ERROR] failed to allocate memory for the zero page\n");
+    HANG();
+  }
+
 
   // END dynamic mapping initialization
   //=============================================
@@ -524,296 +750,1250 @@ void k_paging_init()
 // 
 // so PML4[1] can map the range from 0x8000000000 to 0xFFFFFFFFFF
 // using one PDPT, 512 PDs, and 262,144 PTs.
+// The private half of an address space is mapped the same way by
+// PML4[256], from 0xFFFF800000000000 to 0xFFFF807FFFFFFFFF.
 // 
+// Page directories and page tables for dynamic mapping are only
+// allocated when a mapping needs them, and they're freed when
+// they no longer contain any entries.
 
 
-k_regn k_paging_map_range(k_regn start, k_regn end)
+/**
+ * Gets the address of the paging structure that a paging structure
+ * entry points to.
+ */
+static inline k_regn entry_addr(k_regn entry)
 {
-  // Immediately fail if the start address is higher
-  // than the end address.
-  if (start > end)
+  return entry & (BM_40_BITS << 12);
+}
+
+
+/**
+ * Determines whether a paging structure has no present entries.
+ *
+ * Params:
+ *   k_regn* - the base address of a paging structure
+ *
+ * Returns:
+ *   int - 1 if the paging structure is empty, otherwise 0
+ */
+static inline int table_empty(k_regn* table)
+{
+  for (int i = 0; i < 512; i++)
   {
-    return 0;
+    if (table[i] & BM_0)
+    {
+      return 0;
+    }
   }
 
-  // physical addresses
-  k_regn phys_start = start;
-  k_regn phys_end = end;
+  return 1;
+}
 
-  // virtual addresses
-  k_regn virt_start;
-  k_regn virt_end;
 
-  // virtual address offset
-  k_regn virt_offset = 0;
+/**
+ * Allocates a page for a paging structure and clears all of its entries.
+ *
+ * Returns:
+ *   k_regn* - the base address of a new paging structure or NULL
+ */
+static k_regn* table_create()
+{
+  k_regn* table = (k_regn*)k_memory_alloc_pages(1);
+  if (table == NULL)
+  {
+    return NULL;
+  }
+
+  for (int i = 0; i < 512; i++)
+  {
+    table[i] = 0;
+  }
+
+  return table;
+}
+
+
+/**
+ * Gets the region of the private half of an address space.
+ *
+ * Params:
+ *   k_addr_space* - an address space or NULL for the kernel's
+ *   region* - where to put the region
+ *
+ * Returns:
+ *   int - 1 on success or 0 if the address space has no private half
+ */
+static int private_region(k_addr_space* space, region* r)
+{
+  if (space == NULL)
+  {
+    return 0;
+  }
+
+  r->vmem = &space->vmem;
+  r->pdpt = (pdpte*)entry_addr(space->pml4[256]);
+  r->space = space;
+
+  return 1;
+}
+
+
+/**
+ * Gets the region that contains a virtual address.
+ * Addresses in the private half are looked up in the address space
+ * that's loaded on the current processor.
+ *
+ * Params:
+ *   k_regn - a virtual address
+ *   region* - where to put the region
+ *
+ * Returns:
+ *   int - 1 on success or 0 if the address isn't in any region
+ */
+static int find_region(k_regn addr, region* r)
+{
+  if (addr >= g_dyn_base && addr - g_dyn_base < DYN_SIZE)
+  {
+    *r = s_dyn_region;
+    return 1;
+  }
+
+  if (addr >= PRIVATE_BASE && addr - PRIVATE_BASE < PRIVATE_SIZE)
+  {
+    return private_region(SMP_CPU_FIELD(space), r);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Creates a PTE that maps a page of RAM in a region.
+ * Pages in a private half aren't global, since they must not be seen
+ * from other address spaces.
+ *
+ * Params:
+ *   region* - a region
+ *   k_regn - the address of a 4 KiB page
+ *
+ * Returns:
+ *   pte - a page table entry
+ */
+static inline pte region_make_pte(region* r, k_regn page_addr)
+{
+  pte p = make_pte(page_addr, PAGING_WB);
+
+  return (r->space == NULL) ? p : p & ~BM_8;
+}
+
+
+/**
+ * Gets the address of the PDE for a virtual address in a region.
+ * If create is nonzero, a missing page directory is created.
+ *
+ * Params:
+ *   region* - a region
+ *   k_regn - a virtual address in the region
+ *   int - whether to create a missing page directory
+ *
+ * Returns:
+ *   pde* - the address of a PDE or NULL
+ */
+static pde* region_pde(region* r, k_regn virt, int create)
+{
+  k_regn pdpt_index = (virt >> 30) & BM_9_BITS;
+  k_regn pd_index = (virt >> 21) & BM_9_BITS;
+
+  if (!(r->pdpt[pdpt_index] & BM_0))
+  {
+    if (!create)
+    {
+      return NULL;
+    }
+
+    pde* pd = (pde*)table_create();
+    if (pd == NULL)
+    {
+      fprintf(stddbg, "failed to allocate memory for page directory\n");
+      return NULL;
+    }
+
+    r->pdpt[pdpt_index] = make_pdpte(pd);
+  }
+
+  pde* pd = (pde*)entry_addr(r->pdpt[pdpt_index]);
+
+  return &pd[pd_index];
+}
+
+
+/**
+ * Gets the address of the PTE for a virtual address in a region.
+ * If create is nonzero, any missing page directory or page table
+ * is created. If the address is mapped by a 2 MiB page, then there
+ * is no PTE, and NULL is returned.
+ *
+ * Params:
+ *   region* - a region
+ *   k_regn - a virtual address in the region
+ *   int - whether to create missing paging structures
+ *
+ * Returns:
+ *   pte* - the address of a PTE or NULL
+ */
+static pte* region_pte(region* r, k_regn virt, int create)
+{
+  k_regn pt_index = (virt >> 12) & BM_9_BITS;
+
+  pde* d = region_pde(r, virt, create);
+  if (d == NULL || (*d & BM_7))
+  {
+    return NULL;
+  }
+
+  if (!(*d & BM_0))
+  {
+    if (!create)
+    {
+      return NULL;
+    }
+
+    pte* pt = (pte*)table_create();
+    if (pt == NULL)
+    {
+      fprintf(stddbg, "failed to allocate memory for page table\n");
+      return NULL;
+    }
+
+    *d = make_pde(pt);
+  }
+
+  pte* pt = (pte*)entry_addr(*d);
+
+  return &pt[pt_index];
+}
+
+
+/**
+ * Maps a range of physical addresses into the dynamic mapping region.
+ * This is k_paging_map_range without the lock.
+ *
+ * Params:
+ *   k_regn - the first physical address
+ *   k_regn - the last physical address
+ *   int - the memory type
+ *
+ * Returns:
+ *   k_regn - the virtual address of the first physical address or 0
+ */
+static void unmap(region* r, k_regn virt_start);
+
+static k_regn map_range(k_regn start, k_regn end, int type)
+{
+  // Immediately fail if the start address is higher
+  // than the end address.
+  if (start > end)
+  {
+    return 0;
+  }
+
+  // physical addresses
+  k_regn phys_start = start;
+  k_regn phys_end = end;
+
+  // virtual addresses
+  k_regn virt_start;
+
+  // virtual address offset
+  k_regn virt_offset = 0;
+
+  // Round the starting and ending addresses down to the nearest 4 KiB
+  // boundary.
+  for (;phys_start % 0x1000; phys_start--) virt_offset++;
+  for (;phys_end % 0x1000; phys_end--);
+
+  // Determine the size of the range.
+  k_regn size = phys_end - phys_start;
+
+
+  // Without a PAT, there's no way to select write-combining,
+  // so fall back to uncacheable.
+  if (type == PAGING_WC && !s_has_pat)
+  {
+    type = PAGING_UC;
+  }
+
+  // Reserve a range of virtual addresses.
+  // Ranges of 2 MiB or more are placed so that the virtual addresses
+  // have the same offset from a 2 MiB boundary as the physical
+  // addresses, which lets most of the range be mapped with 2 MiB pages.
+  k_regn align = 0x1000;
+  k_regn phase = 0;
+  if (size + 0x1000 >= 0x200000)
+  {
+    align = 0x200000;
+    phase = phys_start % 0x200000;
+  }
+
+  virt_start = k_vmem_alloc(s_dyn_region.vmem, size + 0x1000, align, phase);
+  if (virt_start == 0)
+  {
+    return 0;
+  }
+
+
+  //=====================================
+  // BEGIN paging structure population
+
+  k_regn virt = virt_start;
+  k_regn addr = phys_start;
+  while (addr <= phys_end)
+  {
+    // Use a 2 MiB page if one fits entirely in what's left of the range.
+    if (!(virt % 0x200000) && phys_end - addr >= 0x1FF000)
+    {
+      pde* d = region_pde(&s_dyn_region, virt, 1);
+      if (d == NULL)
+      {
+        unmap(&s_dyn_region, virt_start);
+        return 0;
+      }
+
+      *d = make_pde_2m(addr, type);
+      addr += 0x200000;
+      virt += 0x200000;
+      continue;
+    }
+
+    pte* p = region_pte(&s_dyn_region, virt, 1);
+    if (p == NULL)
+    {
+      unmap(&s_dyn_region, virt_start);
+      return 0;
+    }
+
+    *p = make_pte(addr, type);
+    addr += 0x1000;
+    virt += 0x1000;
+  }
+
+  // END paging structure population
+  //=====================================
+
+  return virt_start + virt_offset;
+}
+
+
+k_regn k_paging_map_range(k_regn start, k_regn end, int type)
+{
+  k_regn flags = paging_lock();
+
+  k_regn virt = map_range(start, end, type);
+
+  paging_unlock(flags);
+
+  return virt;
+}
+
+
+/**
+ * Invalidates the TLB entries of pages in the dynamic mapping region
+ * on the current processor.
+ * If there are more than INVLPG_MAX pages, then the whole TLB is
+ * flushed instead, and only the count is used.
+ * INVLPG only invalidates non-global entries for the current PCID,
+ * so if dynamic mappings aren't global and PCIDs are in use, the whole
+ * TLB is flushed as well.
+ *
+ * Params:
+ *   k_regn* - the addresses of the pages
+ *   k_regn - the number of pages
+ */
+static void invalidate_local(k_regn* pages, k_regn count)
+{
+  if (count > INVLPG_MAX || (s_has_pcid && !s_global))
+  {
+    flush_all();
+    return;
+  }
+
+  for (k_regn i = 0; i < count; i++)
+  {
+    k_invlpg(pages[i]);
+  }
+}
+
+
+/**
+ * Invalidates the TLB entries described by a TLB shootdown.
+ * This runs on each of the other processors.
+ *
+ * Params:
+ *   void* - a pointer to a tlb_shootdown
+ */
+static void shootdown(void* data)
+{
+  tlb_shootdown* s = (tlb_shootdown*)data;
+
+  invalidate_local(s->pages, s->count);
+}
+
+
+/**
+ * Invalidates the TLB entries of pages in the dynamic mapping region
+ * on every processor after their PTEs have been changed.
+ * The dynamic mapping region is shared by every address space, so every
+ * processor may have entries for it. All of the pages are sent to the
+ * other processors in one request, so each one is only interrupted once.
+ * The paging lock must be held.
+ *
+ * Params:
+ *   k_regn* - the addresses of the pages
+ *   k_regn - the number of pages
+ */
+static void invalidate(k_regn* pages, k_regn count)
+{
+  if (count == 0)
+  {
+    return;
+  }
+
+  invalidate_local(pages, count);
+
+  if (k_smp_count() > 1)
+  {
+    tlb_shootdown s = { pages, count };
+    k_smp_call_others(shootdown, &s);
+  }
+}
+
+
+/**
+ * Invalidates the TLB entries of pages in a region on every processor.
+ * Pages in a private half may also be cached under the address space's
+ * PCID by processors that have loaded another address space since, and
+ * INVLPG can't reach those entries. So every other processor is made to
+ * flush the PCID the next time it loads the address space. Processors
+ * that have it loaded right now are handled by the shootdown.
+ * The paging lock must be held.
+ *
+ * Params:
+ *   region* - the region the pages are in
+ *   k_regn* - the addresses of the pages
+ *   k_regn - the number of pages
+ */
+static void region_invalidate(region* r, k_regn* pages, k_regn count)
+{
+  if (count == 0)
+  {
+    return;
+  }
+
+  if (r->space != NULL)
+  {
+    uint64_t bit = (uint64_t)1 << SMP_CPU_FIELD(index);
+    __sync_fetch_and_or(&r->space->fresh, ~bit);
+  }
+
+  invalidate(pages, count);
+}
+
+
+/**
+ * Invalidates the TLB entries of pages that were unmapped on every
+ * processor, and then frees the memory that was collected while they
+ * were being unmapped.
+ * If page tables or directories were freed and PCIDs are in use, then
+ * the whole TLB is flushed, since INVLPG only invalidates cached paging
+ * structure entries for the current PCID.
+ *
+ * Params:
+ *   region* - the region the pages were in
+ *   k_regn* - the addresses of the first INVLPG_MAX unmapped pages
+ *   k_regn - the number of unmapped pages
+ *   int - 1 if any page tables or directories were freed
+ *   void** - the pages to free
+ *   int - the number of pages to free
+ */
+static void unmap_flush(
+  region* r,
+  k_regn* list,
+  k_regn pages,
+  int tables,
+  void** freed,
+  int freed_count
+)
+{
+  if (tables && s_has_pcid)
+  {
+    pages = INVLPG_MAX + 1;
+  }
+
+  region_invalidate(r, list, pages);
+
+  for (int i = 0; i < freed_count; i++)
+  {
+    k_memory_free_pages(freed[i]);
+  }
+}
+
+
+/**
+ * Clears the page table entries of a range of virtual addresses in a
+ * region, invalidates their TLB entries, frees any paging structures
+ * that become empty, and releases the range.
+ * If the range was created by k_paging_reserve, then the physical pages
+ * that were mapped by the page fault handler are freed as well.
+ *
+ * Params:
+ *   region* - the region the range is in
+ *   k_regn - the first address of a reserved range
+ */
+static void unmap(region* r, k_regn virt_start)
+{
+  k_vmem_span* span = k_vmem_find(r->vmem, virt_start);
+  if (span == NULL || span->start != virt_start)
+  {
+    return;
+  }
+
+  k_regn size = span->size;
+  int reserved = (span->tag & TAG_RESERVED) ? 1 : 0;
+
+  k_regn virt_end = virt_start + size - 1;
+
+  // Pages of the range and page directories and page tables that become
+  // empty are collected here and freed after the TLB entries have been
+  // invalidated on every processor. Until then, another processor may
+  // still be using them through stale TLB entries.
+  void* freed[UNMAP_BATCH];
+  int freed_count = 0;
+  int tables = 0;
+
+  // The first INVLPG_MAX pages are collected for invalidation.
+  // Beyond that, only the count is used.
+  k_regn list[INVLPG_MAX];
+  k_regn pages = 0;
+
+  k_regn virt = virt_start;
+  while (virt <= virt_end)
+  {
+    k_regn pdpt_index = (virt >> 30) & BM_9_BITS;
+    k_regn pd_index = (virt >> 21) & BM_9_BITS;
+
+    // Skip over any directories or tables that don't exist.
+    pde* d = region_pde(r, virt, 0);
+    if (d == NULL)
+    {
+      virt = (virt + 0x40000000) & ~((k_regn)0x3FFFFFFF);
+      continue;
+    }
+
+    if (!(*d & BM_0))
+    {
+      virt = (virt + 0x200000) & ~((k_regn)0x1FFFFF);
+      continue;
+    }
+
+    pde* pd = (pde*)entry_addr(r->pdpt[pdpt_index]);
+
+    if (*d & BM_7)
+    {
+      // Clear a 2 MiB page.
+      // Since a whole directory entry was cleared, the directory
+      // may now be empty.
+      *d = 0;
+      pages += 512;
+      virt += 0x200000;
+
+      if (table_empty(pd))
+      {
+        r->pdpt[pdpt_index] = 0;
+        freed[freed_count++] = pd;
+        tables = 1;
+      }
+    }
+    else
+    {
+      pte* pt = (pte*)entry_addr(*d);
+      k_regn* p = &pt[(virt >> 12) & BM_9_BITS];
+
+      // Pages that were mapped on demand belong to the range,
+      // except for the shared page of zeros.
+      if (reserved && (*p & BM_0) && entry_addr(*p) != s_zero_page)
+      {
+        freed[freed_count++] = (void*)entry_addr(*p);
+      }
+
+      *p = 0;
+      if (pages < INVLPG_MAX)
+      {
+        list[pages] = virt;
+      }
+      pages++;
+      virt += 0x1000;
+
+      // When the last PTE in a page table has been cleared,
+      // or the range ends, check whether the page table can be freed.
+      if (virt > virt_end || !((virt >> 12) & BM_9_BITS))
+      {
+        if (table_empty(pt))
+        {
+          pd[pd_index] = 0;
+          freed[freed_count++] = pt;
+          tables = 1;
+
+          if (table_empty(pd))
+          {
+            r->pdpt[pdpt_index] = 0;
+            freed[freed_count++] = pd;
+          }
+        }
+      }
+    }
+
+    // Each step frees at most three pages, so the pages collected so far
+    // are released before the list can overflow. This takes a single
+    // round of invalidation for the whole batch.
+    if (freed_count > UNMAP_BATCH - 3)
+    {
+      unmap_flush(r, list, pages, tables, freed, freed_count);
+      freed_count = 0;
+      tables = 0;
+      pages = 0;
+    }
+  }
+
+  if (pages > 0 || freed_count > 0)
+  {
+    unmap_flush(r, list, pages, tables, freed, freed_count);
+  }
+
+  k_vmem_free(r->vmem, virt_start);
+}
+
+
+void k_paging_unmap_range(k_regn start)
+{
+  // The address returned by k_paging_map_range may include an offset
+  // into the first page, so only the page address is used.
+  k_regn flags = paging_lock();
+
+  unmap(&s_dyn_region, start & ~((k_regn)0xFFF));
+
+  paging_unlock(flags);
+}
+
+
+k_regn k_paging_reserve(k_regn size, int flags)
+{
+  // Guard pages don't count toward the usable size.
+  if (flags & PAGING_GUARD)
+  {
+    size += 0x1000;
+  }
+
+  k_regn rflags = paging_lock();
+
+  // The kernel address space has no private half.
+  region r = s_dyn_region;
+  if ((flags & PAGING_PRIVATE) && !private_region(SMP_CPU_FIELD(space), &r))
+  {
+    paging_unlock(rflags);
+    return 0;
+  }
 
-  // Round the starting and ending addresses down to the nearest 4 KiB
-  // boundary.
-  for (;phys_start % 0x1000; phys_start--) virt_offset++;
-  for (;phys_end % 0x1000; phys_end--);
+  k_regn start = k_vmem_alloc(r.vmem, size, 0x1000, 0);
+  if (start != 0)
+  {
+    k_vmem_find(r.vmem, start)->tag = TAG_RESERVED | flags;
+  }
+
+  paging_unlock(rflags);
+
+  if (start == 0)
+  {
+    return 0;
+  }
+
+  // The caller gets the first usable address.
+  return (flags & PAGING_GUARD) ? start + 0x1000 : start;
+}
 
-  // Determine the size of the range.
-  k_regn size = phys_end - phys_start;
 
+static int fault(k_regn addr, k_regn err);
 
-  // Initialize the start of the virtual address range to the
-  // global dynamic virtual address base.
-  virt_start = g_dyn_base;
-  virt_end = virt_start + size;
+int k_paging_commit(k_regn start, k_regn size)
+{
+  k_regn flags = paging_lock();
 
-  // Check the ledger to see if there are existing virtual address
-  // ranges that were previously mapped but are now available.
-  for (int i = 0; i < MAP_LEDGER_MAX; i++)
+  // Each page is mapped as if it had been read. A fault on a page that's
+  // already mapped just succeeds.
+  int res = 1;
+  k_regn page = start & ~((k_regn)0xFFF);
+  for (; page < start + size && res; page += 0x1000)
   {
-    if (!g_map_ledger[i].avail)
-    {
-      // start and end addresses of reserved memory region
-      k_regn res_start = g_map_ledger[i].start;
-      k_regn res_end = g_map_ledger[i].end;
+    res = fault(page, 0);
+  }
 
-      // If the requested region overlaps a reserved region,
-      // update the start and end addresses of the requested region.
-      if (
-        (virt_start >= res_start && virt_start <= res_end)
-        ||
-        (res_start >= virt_start && res_start <= virt_end)
-        )
-      {
-        virt_start = res_end + 0x1000;
-        virt_end = virt_start + size;
-      }
+  paging_unlock(flags);
+
+  return res;
+}
+
+
+void k_paging_release(k_regn start)
+{
+  k_regn flags = paging_lock();
+
+  region r;
+  if (find_region(start, &r))
+  {
+    k_vmem_span* span = k_vmem_find(r.vmem, start);
+    if (span != NULL && (span->tag & TAG_RESERVED))
+    {
+      unmap(&r, span->start);
     }
   }
 
-  // Create a new virtual address reservation.
-  for (int i = 0, entry = 0; i < MAP_LEDGER_MAX && !entry; i++)
+  paging_unlock(flags);
+}
+
+
+/**
+ * Resolves a write to a page that is mapped read-only.
+ * If the page is copy-on-write, then the writer gets a copy of the page,
+ * and its reference to the shared page is dropped. If it holds the only
+ * remaining reference, then the page is just made writable.
+ *
+ * Params:
+ *   region* - the region the page is in
+ *   k_regn - the address of the page
+ *
+ * Returns:
+ *   int - 1 if the fault was resolved or 0 if it was not
+ */
+static int copy_on_write(region* r, k_regn page)
+{
+  pte* p = region_pte(r, page, 0);
+  if (p == NULL || !(*p & BM_0))
+  {
+    return 0;
+  }
+
+  // The PTE may have been made writable after the TLB entry was
+  // loaded, in which case only this processor's TLB entry is stale.
+  if (*p & BM_1)
+  {
+    invalidate_local(&page, 1);
+    return 1;
+  }
+
+  if (!(*p & PTE_COW))
+  {
+    return 0;
+  }
+
+  void* shared = (void*)entry_addr(*p);
+
+  if (k_memory_page_refs(shared) > 1)
   {
-    if (g_map_ledger[i].avail)
+    k_regn* copy = (k_regn*)k_memory_alloc_pages(1);
+    if (copy == NULL)
     {
-      g_map_ledger[i].avail = 0;
-      g_map_ledger[i].start = virt_start;
-      g_map_ledger[i].end = virt_end;
-      entry = 1;
+      return 0;
     }
 
-    // If there was no available entry, the reservation failed.
-    if (i == MAP_LEDGER_MAX - 1)
+    for (int i = 0; i < 512; i++)
     {
-      return 0;
+      copy[i] = ((k_regn*)shared)[i];
     }
+
+    *p = region_make_pte(r, PTR_TO_N(copy));
+    k_memory_free_pages(shared);
+  }
+  else
+  {
+    *p = (*p | BM_1) & ~PTE_COW;
   }
 
+  region_invalidate(r, &page, 1);
 
-  //=====================================
-  // BEGIN paging structure population
+  return 1;
+}
+
+
+/**
+ * Makes a copy-on-write copy of a reserved range.
+ * This is k_paging_clone without the lock.
+ *
+ * Params:
+ *   k_regn - an address in a reserved range
+ *
+ * Returns:
+ *   k_regn - the first usable address of the copy or 0
+ */
+static k_regn clone(k_regn start)
+{
+  // The copy is made in the same region as the original.
+  region r;
+  if (!find_region(start, &r))
+  {
+    return 0;
+  }
+
+  k_vmem_span* span = k_vmem_find(r.vmem, start);
+  if (span == NULL || !(span->tag & TAG_RESERVED))
+  {
+    return 0;
+  }
+
+  k_regn src = span->start;
+  k_regn size = span->size;
+  k_regn tag = span->tag;
+
+  k_regn dst = k_vmem_alloc(r.vmem, size, 0x1000, 0);
+  if (dst == 0)
+  {
+    return 0;
+  }
+
+  k_vmem_find(r.vmem, dst)->tag = tag;
 
-  // Determine the paging structures needed to map the range.
-  uint64_t ram_counter = 0;
-  uint64_t ptn = 0;   // number of page tables
-  uint64_t pdn = 1;   // number of page directories
-  uint64_t pdptn = 1; // number of page directory pointer tables
-  while (ram_counter < size)
+  // Pages of the original range that were writable are made read-only,
+  // so their TLB entries have to be invalidated afterward.
+  k_regn changed[INVLPG_MAX];
+  k_regn changed_count = 0;
+
+  k_regn offset = 0;
+  while (offset < size)
   {
-    if (!(ram_counter % 0x200000))
+    // Skip over any directories or tables that don't exist,
+    // so only the parts of the range that have been touched
+    // take any time.
+    pde* d = region_pde(&r, src + offset, 0);
+    if (d == NULL)
+    {
+      offset = ((src + offset + 0x40000000) & ~((k_regn)0x3FFFFFFF)) - src;
+      continue;
+    }
+
+    if (!(*d & BM_0))
+    {
+      offset = ((src + offset + 0x200000) & ~((k_regn)0x1FFFFF)) - src;
+      continue;
+    }
+
+    pte* from = (pte*)entry_addr(*d) + (((src + offset) >> 12) & BM_9_BITS);
+    if (!(*from & BM_0))
+    {
+      offset += 0x1000;
+      continue;
+    }
+
+    pte* to = region_pte(&r, dst + offset, 1);
+    if (to == NULL)
+    {
+      region_invalidate(&r, changed, changed_count);
+      unmap(&r, dst);
+      return 0;
+    }
+
+    void* frame = (void*)entry_addr(*from);
+
+    if (PTR_TO_N(frame) == s_zero_page)
+    {
+      // The page of zeros is never written, so it isn't counted.
+      *to = *from;
+    }
+    else if (k_memory_share_pages(frame))
     {
-      // If the counter reaches a multiple of 2 MiB,
-      // increment the number of page tables.
-      ptn++;
+      // Both ranges get a read-only copy-on-write mapping of the page.
+      if (*from & BM_1)
+      {
+        *from = (*from & ~BM_1) | PTE_COW;
 
-      // If the number of page tables reaches a multiple
-      // of 512, increment the number of page directories.
-      if (!(ptn % 512))
+        if (changed_count < INVLPG_MAX)
+        {
+          changed[changed_count] = src + offset;
+        }
+        changed_count++;
+      }
+      *to = *from;
+    }
+    else
+    {
+      // The page can't be shared, so it's copied.
+      k_regn* copy = (k_regn*)k_memory_alloc_pages(1);
+      if (copy == NULL)
       {
-        pdn++;
+        region_invalidate(&r, changed, changed_count);
+        unmap(&r, dst);
+        return 0;
       }
 
-      // If the number of page directories reaches a multiple
-      // of 512, increment the number of PDPTs.
-      if (!(pdn % 512))
+      for (int i = 0; i < 512; i++)
       {
-        pdptn++;
+        copy[i] = ((k_regn*)frame)[i];
       }
+
+      *to = region_make_pte(&r, PTR_TO_N(copy));
     }
-    ram_counter += 0x1000;
+
+    offset += 0x1000;
+  }
+
+  region_invalidate(&r, changed, changed_count);
+
+  // The caller gets the first usable address.
+  return (tag & PAGING_GUARD) ? dst + 0x1000 : dst;
+}
+
+
+k_regn k_paging_clone(k_regn start)
+{
+  k_regn flags = paging_lock();
+
+  k_regn dst = clone(start);
+
+  paging_unlock(flags);
+
+  return dst;
+}
+
+
+/**
+ * Resolves a page fault in a reserved range.
+ * This is k_paging_fault without the lock.
+ *
+ * Params:
+ *   k_regn - the address that caused the fault
+ *   k_regn - the error code
+ *
+ * Returns:
+ *   int - 1 if the fault was resolved or 0 if it was not
+ */
+static int fault(k_regn addr, k_regn err)
+{
+  region r;
+  if (!find_region(addr, &r))
+  {
+    return 0;
+  }
+
+  k_vmem_span* span = k_vmem_find(r.vmem, addr);
+  if (span == NULL || !(span->tag & TAG_RESERVED))
+  {
+    return 0;
+  }
+
+  k_regn page = addr & ~((k_regn)0xFFF);
+
+  // Bit 0 of the error code is set if the page was present, which
+  // means the access violated its protection (a write to a read-only
+  // page). Bit 1 is set if the access was a write.
+  if (err & BM_0)
+  {
+    return (err & BM_1) ? copy_on_write(&r, page) : 0;
+  }
+
+  if ((span->tag & PAGING_GUARD) && page == span->start)
+  {
+    return 0;
+  }
+
+  if ((span->tag & PAGING_RO) && (err & BM_1))
+  {
+    return 0;
   }
 
-  // If we have an even multiple of 512 page directories,
-  // then we preemptively incremented the PDPT count, so
-  // we correct that here.
-  if (!(pdn % 512))
+  pte* p = region_pte(&r, page, 1);
+  if (p == NULL)
   {
-    pdptn--;
+    return 0;
   }
 
-  // Correct the page directory count like we did with the
-  // PDPT count
-  if (!(ptn % 512))
+  // Another processor may have touched the same page and mapped it
+  // while this one was waiting for the lock. Entries that aren't present
+  // are never cached in the TLB, so the access just has to be retried.
+  if (*p & BM_0)
   {
-    pdn--;
+    return 1;
   }
 
+  // Read-only pages all share the page of zeros.
+  // Bit 1 is cleared to make the page read-only.
+  if (span->tag & PAGING_RO)
+  {
+    *p = region_make_pte(&r, s_zero_page) & ~BM_1;
+    return 1;
+  }
 
-  // A virtual address is 48 bits with the following structure:
-  // 
-  //    [47:39]      [38:30]     [29:21]    [20:12]     [11:0]
-  // +------------+------------+----------+----------+------------+
-  // | PML4 index | PDPT index | PD index | PT index |   offset   |
-  // +------------+------------+----------+----------+------------+
-  //   9 bits       9 bits       9 bits     9 bits       12 bits
+  k_regn* frame = (k_regn*)k_memory_alloc_pages(1);
+  if (frame == NULL)
+  {
+    return 0;
+  }
 
+  if (span->tag & PAGING_ZERO)
+  {
+    for (int i = 0; i < 512; i++)
+    {
+      frame[i] = 0;
+    }
+  }
 
-  // Break the starting and ending virtual addresses into their
-  // paging structure index components.
-  k_regn pml4_start = (virt_start & (BM_9_BITS << 39)) >> 39;
-  k_regn pdpt_start = (virt_start & (BM_9_BITS << 30)) >> 30;
-  k_regn pd_start = (virt_start & (BM_9_BITS << 21)) >> 21;
-  k_regn pt_start = (virt_start & (BM_9_BITS << 12)) >> 12;
-  k_regn pt_offset = virt_start & BM_12_BITS;
+  // The entry wasn't present, so there's no TLB entry to invalidate.
+  *p = region_make_pte(&r, PTR_TO_N(frame));
 
-  k_regn pml4_end = (virt_end & (BM_9_BITS << 39)) >> 39;
-  k_regn pdpt_end = (virt_end & (BM_9_BITS << 30)) >> 30;
-  k_regn pd_end = (virt_end & (BM_9_BITS << 21)) >> 21;
-  k_regn pt_end = (virt_end & (BM_9_BITS << 12)) >> 12;
+  return 1;
+}
 
-  // fprintf(stddbg, "[PAGING] virt start: %llX, virt end: %llX\n", virt_start, virt_end);
-  // fprintf(stddbg, "[PAGING] START PDPT: %3llu, PD: %3llu, PT: %3llu\n", pml4_start, pdpt_start, pd_start);
-  // fprintf(stddbg, "[PAGING] END   PDPT: %3llu, PD: %3llu, PT: %3llu\n", pml4_end, pdpt_end, pd_end);
 
-  // Currently, we don't allow mappings that pass 0xFFFFFFFFFF
-  if (pml4_end > 1)
+int k_paging_fault(k_regn addr, k_regn err)
+{
+  // Faults anywhere else are reported without taking the lock, since
+  // they may have happened while it was held.
+  if ((addr < g_dyn_base || addr - g_dyn_base >= DYN_SIZE)
+    && (addr < PRIVATE_BASE || addr - PRIVATE_BASE >= PRIVATE_SIZE))
   {
     return 0;
   }
 
-  k_regn addr = phys_start;
+  k_regn flags = paging_lock();
 
-  // Starting values for the index values of the table and directory.
-  // When completing a mapping in the middle of a paging structure,
-  // we want to resume from the next index when creating a new mapping.
-  // If we fill a structure during a single mapping, we want to reset
-  // the index to 0.
-  k_regn pt_index = pt_start;
-  k_regn pd_index = pd_start;
+  int res = fault(addr, err);
 
-  // Allocate page directories
-  for (uint64_t i = pdpt_start; i <= pdpt_end; i++)
+  paging_unlock(flags);
+
+  return res;
+}
+
+
+k_addr_space* k_paging_create_space()
+{
+  k_addr_space* space = (k_addr_space*)k_heap_alloc(sizeof(k_addr_space));
+  if (space == NULL)
   {
-    // Ensure that the page directory exists.
-    if (!get_bit(g_dyn_pd_map, i))
-    {
-      fprintf(stddbg, "[DEBUG] creating new page directory\n");
+    return NULL;
+  }
 
-      pde* new_dir = (pde*)k_memory_alloc_pages(1);
-      if (new_dir == NULL)
-      {
-        fprintf(stddbg, "failed to allocate memory for dynamic page directory\n");
-        return 0;
-      }
+  space->pml4 = (pml4e*)table_create();
+  if (space->pml4 == NULL)
+  {
+    k_heap_free(space);
+    return NULL;
+  }
+
+  // The lower half of the PML4 is shared with the kernel.
+  // Those PML4 entries never change after paging is initialized,
+  // so copying them is enough to see every kernel mapping.
+  for (int i = 0; i < 256; i++)
+  {
+    space->pml4[i] = g_pml4_mem[i];
+  }
+
+  // Like the dynamic mapping region, the private half has one PDPT
+  // for as long as the address space exists.
+  pdpte* pdpt = (pdpte*)table_create();
+  if (pdpt == NULL)
+  {
+    k_memory_free_pages((void*)space->pml4);
+    k_heap_free(space);
+    return NULL;
+  }
 
-      g_dyn_pdpt[i] = make_pdpte(new_dir);
+  if (!k_vmem_init(&space->vmem, PRIVATE_BASE, PRIVATE_SIZE))
+  {
+    k_memory_free_pages((void*)pdpt);
+    k_memory_free_pages((void*)space->pml4);
+    k_heap_free(space);
+    return NULL;
+  }
 
-      set_bit(g_dyn_pd_map, i, 1);
+  space->pml4[256] = make_pml4e(pdpt);
+  space->refs = 1;
 
-      // Allocate page tables
-      pte* new_tabs = (pte*)k_memory_alloc_pages(512);
-      if (new_tabs == NULL)
-      {
-        fprintf(stddbg, "failed to allocate memory for dynamic page tables\n");
-        return 0;
-      }
+  // Find an unused PCID.
+  // If they're all in use, then the address space shares PCID 0 with
+  // the kernel, and the TLB is flushed whenever it's loaded.
+  space->pcid = 0;
+  if (s_has_pcid)
+  {
+    k_regn flags = paging_lock();
 
-      // Fill the new page directory.
-      for (int j = 0; j < 512; j++)
+    for (int i = 1; i < PCID_COUNT && space->pcid == 0; i++)
+    {
+      if (!(s_pcid_map[i / 64] & ((uint64_t)1 << (i % 64))))
       {
-        for (int k = 0; k < 512; k++)
-        {
-          new_tabs[512 * j + k] = 0;
-        }
-
-        new_dir[j] = make_pde(&new_tabs[512 * j]);
+        s_pcid_map[i / 64] |= ((uint64_t)1 << (i % 64));
+        space->pcid = i;
       }
     }
 
-    // Extract the directory address from the PDPTE.
-    pde* dir = (pde*)(g_dyn_pdpt[i] & (BM_40_BITS << 12));
+    paging_unlock(flags);
+  }
 
-    // Populate the page directory.
-    for (uint64_t j = pd_index; j <= (i < pdpt_end ? 511 : pd_end); j++)
-    {
-      // Extract the table address from the directory.
-      pte* tab = (pte*)(dir[j] & (BM_40_BITS << 12));
+  // The PCID may have been used by an address space that was
+  // destroyed, so the TLB entries for it are flushed the first time
+  // it's loaded on each processor.
+  space->fresh = ~(uint64_t)0;
 
-      // Populate the page table.
-      for (uint64_t k = pt_index; k <= (i < pdpt_end || j < pd_end ? 511 : pt_end); k++)
-      {
-        if (addr <= phys_end)
-        {
-          // for debugging
-          // fprintf(stddbg,
-          //   "[DEBUG] mapping physical %p to virtual: %p\n",
-          //   addr,
-          //   (((uint64_t)1 << 39) | (i << 30) | (j << 21) | (k << 12))
-          // );
-
-          tab[k] = make_pte(addr);
-          addr += 0x1000;
-        }
-      }
+  return space;
+}
 
-      // Reset the page table index so that we start at the
-      // beginning of the next page table.
-      pt_index = 0;
 
+/**
+ * Frees a paging structure in a private half and everything below it,
+ * including the pages that were mapped by the page fault handler.
+ * The private half only has 4 KiB pages, which all belong to reserved
+ * ranges, except for the shared page of zeros.
+ *
+ * Params:
+ *   k_regn* - the base address of a paging structure
+ *   int - 3 for a PDPT, 2 for a PD, or 1 for a PT
+ */
+static void table_destroy(k_regn* table, int level)
+{
+  for (int i = 0; i < 512; i++)
+  {
+    if (!(table[i] & BM_0))
+    {
+      continue;
     }
 
-    // Reset the page directory index so that we start at the
-    // beginning of the next page directory.
-    pd_index = 0;
+    if (level > 1)
+    {
+      table_destroy((k_regn*)entry_addr(table[i]), level - 1);
+    }
+    else if (entry_addr(table[i]) != s_zero_page)
+    {
+      k_memory_free_pages((void*)entry_addr(table[i]));
+    }
   }
 
-  // END paging structure population
-  //=====================================
+  k_memory_free_pages((void*)table);
+}
 
-  // Update the global dynamic mapping base address.
-  // g_dyn_base = virt_end + 0x1000;
 
-  return virt_start + virt_offset;
+k_addr_space* k_paging_share_space(k_addr_space* space)
+{
+  k_regn flags = paging_lock();
+
+  space->refs++;
+
+  paging_unlock(flags);
+
+  return space;
 }
 
 
-void k_paging_unmap_range(k_regn start)
+int k_paging_destroy_space(k_addr_space* space)
 {
-  for (int i = 0; i < MAP_LEDGER_MAX; i++)
+  if (space == NULL || space == &s_kernel_space)
+  {
+    return 0;
+  }
+
+  k_regn flags = paging_lock();
+
+  // The address space is kept until its last user is done with it.
+  if (space->refs > 1)
+  {
+    space->refs--;
+    paging_unlock(flags);
+    return 1;
+  }
+
+  // An address space can't be destroyed while any processor
+  // has it loaded.
+  for (uint32_t i = 0; i < k_smp_count(); i++)
   {
-    // Find the first entry in the virtual address ledger
-    // whose starting address matches the specified address
-    // and mark it as available.
-    if (g_map_ledger[i].start == start && !g_map_ledger[i].avail)
+    if (k_smp_get(i)->space == space)
     {
-      g_map_ledger[i].avail = 1;
-      return;
+      paging_unlock(flags);
+      return 0;
+    }
+  }
+
+  // Free the private half.
+  // No processor has the address space loaded, and its PCID is flushed
+  // before it's loaded again, so the TLB entries left behind for it
+  // are never used.
+  for (int i = 256; i < 512; i++)
+  {
+    if (space->pml4[i] & BM_0)
+    {
+      table_destroy((k_regn*)entry_addr(space->pml4[i]), 3);
     }
   }
+
+  k_vmem_destroy(&space->vmem);
+
+  k_memory_free_pages((void*)space->pml4);
+
+  if (space->pcid)
+  {
+    s_pcid_map[space->pcid / 64] &= ~((uint64_t)1 << (space->pcid % 64));
+  }
+
+  paging_unlock(flags);
+
+  k_heap_free(space);
+
+  return 1;
 }
 
 
-void k_paging_print_ledger()
+void k_paging_switch_space(k_addr_space* space)
 {
-  fprintf(stddbg, "+------------------------------------+\n");
-  fprintf(stddbg, "| start             end              |\n");
-  fprintf(stddbg, "+------------------------------------+\n");
+  k_cpu* cpu = SMP_THIS_CPU();
+
+  if (space == &s_kernel_space)
+  {
+    space = NULL;
+  }
+
+  // Don't touch CR3 if the address space is already loaded.
+  if (space == cpu->space)
+  {
+    return;
+  }
+
+  cpu->space = space;
+
+  if (space == NULL)
+  {
+    space = &s_kernel_space;
+  }
 
-  for (int i = 0; i < MAP_LEDGER_MAX; i++)
+  k_regn cr3 = PTR_TO_N(space->pml4);
+
+  // When PCIDs are enabled, bits [11:0] of CR3 are the PCID.
+  // If bit 63 is set, then the TLB entries for the PCID are kept,
+  // so switching back to an address space doesn't flush the TLB.
+  // Each processor has its own TLB, so each one flushes the entries
+  // for a new address space's PCID the first time it loads it.
+  if (s_has_pcid)
   {
-    if (!g_map_ledger[i].avail)
+    uint64_t bit = (uint64_t)1 << cpu->index;
+
+    cr3 |= space->pcid;
+
+    if (space->pcid != 0 && !(space->fresh & bit))
     {
-      fprintf(stddbg,
-        "| %p  %p |\n",
-        g_map_ledger[i].start,
-        g_map_ledger[i].end
-      );
+      cr3 |= BM_63;
     }
+
+    __sync_fetch_and_and(&space->fresh, ~bit);
   }
 
-  fprintf(stddbg, "+------------------------------------+\n");
+  k_set_cr3(cr3);
+}
+
+
+void k_paging_print_map()
+{
+  k_vmem_print(&s_dyn_vmem);
 }
@@ -255,7 +255,7 @@ void k_pci_init()
     | ((uint64_t)7 << 12)
     );
 
-  pci_base.virt_base = k_paging_map_range(pci_base.phys_base, pci_base.phys_base + cfg_max);
+  pci_base.virt_base = k_paging_map_range(pci_base.phys_base, pci_base.phys_base + cfg_max, PAGING_UC);
 
   if (pci_base.virt_base == 0)
   {
@@ -273,7 +273,7 @@ void k_pci_init()
     pci_base.virt_base
   );
 
-  k_paging_print_ledger();
+  k_paging_print_map();
 
   // Gather all available PCI devices into a list.
   pci_collect();
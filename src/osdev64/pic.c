@@ -2,6 +2,7 @@
 #include "osdev64/instructor.h"
 #include "osdev64/bitmask.h"
 #include "osdev64/interrupts.h"
+#include "osdev64/timer.h"
 
 #include "klibc/stdio.h"
 
@@ -108,7 +109,6 @@ void k_pic_disable()
   k_outb(MASTER_DAT, 0xFF);
 }
 
-extern uint64_t g_pit_ticks;
 // uint64_t g_pic_ticks = 0;
 
 // Currently used to handle all IRQs from the PIC.
@@ -151,7 +151,7 @@ void pic_handler(uint8_t irq)
   // Handles timer IRQ.
   if (irq == 0)
   {
-    g_pit_ticks++;
+    k_timer_tick();
   }
 
   // Handle PS/2 keyboard IRQ.
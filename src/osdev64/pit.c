@@ -1,9 +1,27 @@
 #include "osdev64/pit.h"
 #include "osdev64/instructor.h"
+#include "osdev64/timer.h"
 
 #include <stdint.h>
 
-uint64_t g_pit_ticks = 0;
+
+/**
+ * Reads the current count of channel 0.
+ *
+ * Returns:
+ *   uint16_t - the current count
+ */
+static uint16_t pit_read()
+{
+  // Latch the count so that both bytes come from the same moment.
+  k_outb(0x43, 0x00);
+
+  uint8_t l = k_inb(0x40);
+  uint8_t h = k_inb(0x40);
+
+  return (uint16_t)l | ((uint16_t)h << 8);
+}
+
 
 void k_pit_init()
 {
@@ -15,10 +33,12 @@ void k_pit_init()
   // The value we send to the PIT is the value to divide it's input clock
   // (1193180 Hz) by, to get our required frequency. Important to note is
   // that the divisor must be small enough to fit into 16-bits.
-  uint32_t divisor = 1193180 / 120;
+  uint32_t divisor = 1193180 / TIMER_HZ;
 
   // Send the command byte.
-  k_outb(0x43, 0x36);
+  // Channel 0 is put in rate generator mode (mode 2), so the count goes
+  // from the divisor down to 1 exactly once per tick.
+  k_outb(0x43, 0x34);
 
   // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
   uint8_t l = (uint8_t)(divisor & 0xFF);
@@ -31,7 +51,17 @@ void k_pit_init()
 
 void k_pit_wait(uint64_t n)
 {
-  uint64_t current = g_pit_ticks;
+  // The count only goes up when it starts over,
+  // which happens once per tick.
+  uint16_t prev = pit_read();
 
-  while (g_pit_ticks - current < n);
-}
\ No newline at end of file
+  while (n > 0)
+  {
+    uint16_t count = pit_read();
+    if (count > prev)
+    {
+      n--;
+    }
+    prev = count;
+  }
+}
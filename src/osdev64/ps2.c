@@ -1,6 +1,7 @@
 #include "osdev64/ps2.h"
 #include "osdev64/memory.h"
 #include "osdev64/heap.h"
+#include "osdev64/tty.h"
 
 #include "klibc/stdio.h"
 
@@ -160,6 +161,8 @@ static void write_event(k_ps2_event* e)
   // Write the event to the buffer and advance the writer pointer.
   *buf_writer = *e;
   buf_writer = next;
+
+  k_tty_notify();
 }
 
 static int read_event(k_ps2_event* e)
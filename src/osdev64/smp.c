@@ -0,0 +1,454 @@
+#include "osdev64/smp.h"
+#include "osdev64/apic.h"
+#include "osdev64/bitmask.h"
+#include "osdev64/clock.h"
+#include "osdev64/control.h"
+#include "osdev64/descriptor.h"
+#include "osdev64/instructor.h"
+#include "osdev64/memory.h"
+#include "osdev64/msr.h"
+#include "osdev64/task.h"
+
+#include "klibc/stdio.h"
+
+
+// number of pages in the stack an AP uses until it starts running tasks
+#define SMP_STACK_PAGES 4
+
+// microseconds to wait after an INIT IPI
+#define SMP_INIT_DELAY 10000
+
+// microseconds to wait after a startup IPI
+#define SMP_STARTUP_DELAY 200
+
+// microseconds between checks for an AP coming online
+#define SMP_POLL_INTERVAL 100
+
+// number of checks for an AP coming online before giving up on it
+#define SMP_POLL_COUNT 1000
+
+
+// The trampoline data, which is filled in before each AP is started.
+// Its layout must match the data at the end of trampoline.s.
+typedef struct smp_boot {
+  uint32_t cr3_low; // CR3 for enabling paging (must be below 4 GiB)
+  uint32_t cr4;     // CR4 without PCIDE
+  uint32_t cr0;     // CR0
+  uint32_t efer;    // low 32 bits of IA32_EFER
+  uint64_t cr3;     // CR3
+  uint64_t stack;   // top of the stack
+  uint64_t entry;   // entry point
+  uint64_t arg;     // argument for the entry point
+}smp_boot;
+
+
+// A request for other processors to run a function.
+// Only one request is made at a time, and the processor that makes it
+// waits until each processor whose bit is set in pending has run the
+// function and cleared its bit.
+typedef struct smp_call {
+  void (*func)(void*);       // function to run
+  void* data;                // argument for the function
+  volatile uint64_t pending; // processors that haven't run it yet
+}smp_call;
+
+
+// the beginning and end of the trampoline and its data (see trampoline.s)
+extern k_byte k_smp_trampoline[];
+extern k_byte k_smp_trampoline_data[];
+extern k_byte k_smp_trampoline_end[];
+
+// The MADT (obtained from the ACPI interface)
+extern unsigned char* g_madt;
+
+// The PML4 of the kernel's address space
+extern pml4e* g_pml4_mem;
+
+
+// the processors
+static k_cpu s_cpus[SMP_CPU_MAX];
+
+// number of processors that have started
+static volatile uint32_t s_count = 1;
+
+// 1 once the APs may be started
+static int s_started = 0;
+
+// 1 once the BSP's GS base points to its k_cpu structure
+static int s_loaded = 0;
+
+// 1 if every enabled processor in the MADT has started, in which case
+// an IPI can be broadcast to every other processor
+static int s_all_started = 0;
+
+// the current request to run a function on other processors
+static smp_call s_call;
+
+// lock for making a request to run a function on other processors
+static k_regn s_call_lock = 0;
+
+// two pages below 1 MiB: the trampoline, then a copy of the PML4
+static k_byte* s_tramp = NULL;
+
+// the BSP's PAT and CR4, which the APs copy
+static uint64_t s_pat;
+static k_regn s_cr4;
+
+
+/**
+ * The entry point of an AP in long mode.
+ * The AP is using the trampoline's stack and the kernel's paging
+ * structures, but it still has the trampoline's GDT and no IDT.
+ *
+ * Params:
+ *   k_cpu* - the processor that is starting
+ */
+static void ap_main(k_cpu* cpu)
+{
+  // Everything that uses the processor's own data, including
+  // page allocation, depends on the GS base.
+  k_smp_load_cpu(cpu);
+
+  // The PAT and PCIDs weren't set up by the trampoline.
+  k_msr_set(IA32_PAT, s_pat);
+  k_set_cr4(s_cr4);
+
+  k_gdt_init_cpu(cpu);
+  k_idt_load();
+
+  k_lapic_enable_cpu();
+  k_lapic_timer_start();
+
+  cpu->online = 1;
+
+  k_task_start_cpu();
+}
+
+
+/**
+ * Starts an AP and waits for it to come online.
+ *
+ * Params:
+ *   k_cpu* - the processor to start
+ *   smp_boot* - the trampoline data
+ *
+ * Returns:
+ *   int - 1 if the AP came online or 0 if it didn't
+ */
+static int start_ap(k_cpu* cpu, smp_boot* boot)
+{
+  k_byte* stack = (k_byte*)k_memory_alloc_pages(SMP_STACK_PAGES);
+  if (stack == NULL)
+  {
+    fprintf(stddbg, "[ERROR] failed to allocate a stack for CPU %u\n",
+      cpu->index
+    );
+    return 0;
+  }
+
+  boot->stack = PTR_TO_N(stack + SMP_STACK_PAGES * 0x1000);
+  boot->arg = PTR_TO_N(cpu);
+
+  uint8_t page = (uint8_t)(PTR_TO_N(s_tramp) >> 12);
+
+  // The INIT IPI resets the AP, and the startup IPI tells it where
+  // to start. A second startup IPI is sent if the first one was missed.
+  k_lapic_send_init(cpu->apic_id);
+  k_delay_us(SMP_INIT_DELAY);
+
+  k_lapic_send_startup(cpu->apic_id, page);
+  k_delay_us(SMP_STARTUP_DELAY);
+
+  if (!cpu->online)
+  {
+    k_lapic_send_startup(cpu->apic_id, page);
+  }
+
+  for (int i = 0; i < SMP_POLL_COUNT && !cpu->online; i++)
+  {
+    k_delay_us(SMP_POLL_INTERVAL);
+  }
+
+  if (!cpu->online)
+  {
+    k_memory_free_pages(stack);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+void k_smp_load_cpu(k_cpu* cpu)
+{
+  cpu->self = cpu;
+  k_msr_set(IA32_GS_BASE, PTR_TO_N(cpu));
+
+  if (cpu == &s_cpus[0])
+  {
+    s_loaded = 1;
+  }
+}
+
+
+void k_smp_reserve()
+{
+  s_tramp = (k_byte*)k_memory_alloc_below(2, 0x100000);
+  if (s_tramp == NULL)
+  {
+    fprintf(stddbg, "[SMP] no memory below 1 MiB for the trampoline\n");
+  }
+}
+
+
+void k_smp_init()
+{
+  k_cpu* bsp = &s_cpus[0];
+
+  bsp->index = 0;
+  bsp->online = 1;
+
+  if (!k_apic_available() || s_tramp == NULL)
+  {
+    fprintf(stddbg, "[SMP] only the BSP will be used\n");
+    return;
+  }
+
+  bsp->apic_id = k_lapic_get_id();
+  s_started = 1;
+
+  // Copy the trampoline to the first page below 1 MiB.
+  size_t tramp_size = k_smp_trampoline_end - k_smp_trampoline;
+  for (size_t i = 0; i < tramp_size; i++)
+  {
+    s_tramp[i] = k_smp_trampoline[i];
+  }
+
+  // The trampoline enables paging before it can use 64-bit addresses,
+  // so it needs a PML4 below 4 GiB. The one below 1 MiB has the same
+  // entries as the kernel's.
+  pml4e* pml4 = (pml4e*)(s_tramp + 0x1000);
+  for (int i = 0; i < 512; i++)
+  {
+    pml4[i] = g_pml4_mem[i];
+  }
+
+  s_pat = k_msr_get(IA32_PAT);
+  s_cr4 = k_get_cr4();
+
+  smp_boot* boot = (smp_boot*)(s_tramp
+    + (k_smp_trampoline_data - k_smp_trampoline));
+
+  // PCIDs can only be enabled in long mode, and IA32_EFER.LMA is set by
+  // the processor when paging is enabled.
+  boot->cr3_low = (uint32_t)PTR_TO_N(pml4);
+  boot->cr4 = (uint32_t)(s_cr4 & ~CR4_PCIDE);
+  boot->cr0 = (uint32_t)k_get_cr0();
+  boot->efer = (uint32_t)(k_msr_get(IA32_EFER) & ~BM_10);
+  boot->cr3 = PTR_TO_N(g_pml4_mem);
+  boot->entry = PTR_TO_N(ap_main);
+
+  // Start each enabled processor in the MADT, one at a time.
+  // The entry list starts at offset 44.
+  int all = 1;
+  uint32_t table_len = *(uint32_t*)(g_madt + 4);
+  for (uint32_t i = 0; i < table_len - 44;)
+  {
+    unsigned char* entry = &g_madt[44 + i];
+
+    uint8_t entry_type = *(uint8_t*)(entry);
+    uint8_t entry_len = *(uint8_t*)(entry + 1);
+
+    i += entry_len;
+
+    // Only local APIC entries describe processors.
+    // Bit 0 of the flags is set if the processor is enabled.
+    if (entry_type != 0)
+    {
+      continue;
+    }
+
+    uint8_t apic_id = *(uint8_t*)(entry + 3);
+    uint32_t flags = *(uint32_t*)(entry + 4);
+
+    if (!(flags & BM_0) || apic_id == bsp->apic_id)
+    {
+      continue;
+    }
+
+    if (s_count == SMP_CPU_MAX)
+    {
+      fprintf(stddbg, "[SMP] too many processors\n");
+      all = 0;
+      break;
+    }
+
+    k_cpu* cpu = &s_cpus[s_count];
+    cpu->index = s_count;
+    cpu->apic_id = apic_id;
+    cpu->online = 0;
+
+    // The AP is counted as soon as it may start running tasks.
+    s_count++;
+
+    if (!start_ap(cpu, boot))
+    {
+      // No more APs are started, since this one might still start
+      // at some point and use the trampoline.
+      fprintf(stddbg, "[ERROR] CPU with APIC ID %u did not start\n",
+        apic_id
+      );
+      s_count--;
+      all = 0;
+      break;
+    }
+  }
+
+  // Broadcast IPIs can only be used if no processor is left in
+  // an unknown state.
+  s_all_started = all;
+
+  for (uint32_t n = 0; n < s_count; n++)
+  {
+    fprintf(stddbg, "[SMP] CPU %u: APIC ID %u\n",
+      s_cpus[n].index,
+      s_cpus[n].apic_id
+    );
+  }
+}
+
+
+uint32_t k_smp_count()
+{
+  return s_count;
+}
+
+
+k_cpu* k_smp_get(uint32_t index)
+{
+  if (index >= s_count)
+  {
+    return NULL;
+  }
+
+  return &s_cpus[index];
+}
+
+
+k_cpu* k_smp_cpu()
+{
+  if (!s_loaded)
+  {
+    return &s_cpus[0];
+  }
+
+  return SMP_THIS_CPU();
+}
+
+
+void k_smp_call(uint64_t mask, void (func)(void*), void* data)
+{
+  if (!s_started)
+  {
+    return;
+  }
+
+  k_cpu* self = SMP_THIS_CPU();
+  uint64_t others = 0;
+
+  // Only processors that have loaded the IDT can handle the IPI.
+  for (uint32_t i = 0; i < s_count; i++)
+  {
+    if (i != self->index && s_cpus[i].online)
+    {
+      others |= (uint64_t)1 << i;
+    }
+  }
+
+  mask &= others;
+  if (mask == 0)
+  {
+    return;
+  }
+
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  // Two processors may make requests at the same time with interrupts
+  // disabled, so the one that is waiting for the lock handles the other
+  // one's request while it waits.
+  while (k_bts(0, &s_call_lock))
+  {
+    k_smp_poll();
+  }
+
+  s_call.func = func;
+  s_call.data = data;
+  __sync_synchronize();
+  s_call.pending = mask;
+
+  if (mask == others && s_all_started)
+  {
+    k_lapic_send_ipi_others(APIC_IPI_CALL);
+  }
+  else
+  {
+    for (uint32_t i = 0; i < s_count; i++)
+    {
+      if (mask & ((uint64_t)1 << i))
+      {
+        k_lapic_send_ipi(s_cpus[i].apic_id, APIC_IPI_CALL);
+      }
+    }
+  }
+
+  while (s_call.pending != 0);
+
+  k_btr(0, &s_call_lock);
+  k_set_rflags(flags);
+}
+
+
+void k_smp_call_others(void (func)(void*), void* data)
+{
+  k_smp_call(~(uint64_t)0, func, data);
+}
+
+
+void k_smp_poll()
+{
+  if (!s_started)
+  {
+    return;
+  }
+
+  uint64_t bit = (uint64_t)1 << SMP_CPU_FIELD(index);
+
+  if (!(s_call.pending & bit))
+  {
+    return;
+  }
+
+  // The function and its argument are written before the pending bits.
+  __sync_synchronize();
+
+  s_call.func(s_call.data);
+
+  __sync_fetch_and_and(&s_call.pending, ~bit);
+}
+
+
+void k_smp_wake(uint32_t index)
+{
+  if (!s_started || index >= s_count || !s_cpus[index].online)
+  {
+    return;
+  }
+
+  if (index == SMP_CPU_FIELD(index))
+  {
+    return;
+  }
+
+  k_lapic_send_ipi(s_cpus[index].apic_id, APIC_IPI_WAKE);
+}
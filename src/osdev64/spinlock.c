@@ -0,0 +1,208 @@
+#include "osdev64/spinlock.h"
+#include "osdev64/instructor.h"
+#include "osdev64/control.h"
+
+#include "klibc/stdio.h"
+
+
+/**
+ * Records an acquisition of a lock in its statistics.
+ * This is called by the holder of the lock.
+ *
+ * Params:
+ *   k_spin_stats* - the statistics of a lock or NULL
+ *   uint64_t - the TSC when the caller started waiting or 0 if it
+ *              didn't have to wait
+ */
+static inline void record(k_spin_stats* stats, uint64_t start)
+{
+  if (stats == NULL)
+  {
+    return;
+  }
+
+  stats->acquired++;
+
+  if (start != 0)
+  {
+    uint64_t cycles = k_rdtsc() - start;
+
+    stats->contended++;
+    stats->cycles += cycles;
+    if (cycles > stats->max)
+    {
+      stats->max = cycles;
+    }
+  }
+}
+
+
+void k_ticket_init(k_ticket_lock* lock, k_spin_stats* stats)
+{
+  lock->next = 0;
+  lock->owner = 0;
+  lock->stats = stats;
+}
+
+
+void k_ticket_acquire(k_ticket_lock* lock)
+{
+  uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+  uint64_t start = 0;
+
+  if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+  {
+    if (lock->stats != NULL)
+    {
+      start = k_rdtsc();
+    }
+
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+    {
+      __builtin_ia32_pause();
+    }
+  }
+
+  record(lock->stats, start);
+}
+
+
+int k_ticket_try(k_ticket_lock* lock)
+{
+  // The lock is free when the next ticket is the one being served,
+  // and taking that ticket only succeeds if nobody else took it first.
+  uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+  uint32_t expected = owner;
+
+  if (!__atomic_compare_exchange_n(&lock->next, &expected, owner + 1, 0,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    return 0;
+  }
+
+  record(lock->stats, 0);
+
+  return 1;
+}
+
+
+void k_ticket_release(k_ticket_lock* lock)
+{
+  // Only the holder writes the owner, so it doesn't need a locked add.
+  __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+
+k_regn k_ticket_acquire_irqsave(k_ticket_lock* lock)
+{
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  k_ticket_acquire(lock);
+
+  return flags;
+}
+
+
+void k_ticket_release_irqrestore(k_ticket_lock* lock, k_regn flags)
+{
+  k_ticket_release(lock);
+  k_set_rflags(flags);
+}
+
+
+void k_mcs_init(k_mcs_lock* lock, k_spin_stats* stats)
+{
+  lock->tail = NULL;
+  lock->stats = stats;
+}
+
+
+void k_mcs_acquire(k_mcs_lock* lock, k_mcs_node* node)
+{
+  node->next = NULL;
+  node->waiting = 1;
+
+  // Become the last waiter. If there was one before, then link to it
+  // and wait for it to pass the lock on.
+  k_mcs_node* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+  uint64_t start = 0;
+
+  if (prev != NULL)
+  {
+    if (lock->stats != NULL)
+    {
+      start = k_rdtsc();
+    }
+
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&node->waiting, __ATOMIC_ACQUIRE))
+    {
+      __builtin_ia32_pause();
+    }
+  }
+
+  record(lock->stats, start);
+}
+
+
+void k_mcs_release(k_mcs_lock* lock, k_mcs_node* node)
+{
+  k_mcs_node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+  if (next == NULL)
+  {
+    // If the caller is still the last one in the queue, then the
+    // lock becomes free.
+    k_mcs_node* expected = node;
+    if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+      return;
+    }
+
+    // Another waiter has taken the tail but hasn't linked itself yet.
+    while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+    {
+      __builtin_ia32_pause();
+    }
+  }
+
+  __atomic_store_n(&next->waiting, 0, __ATOMIC_RELEASE);
+}
+
+
+k_regn k_mcs_acquire_irqsave(k_mcs_lock* lock, k_mcs_node* node)
+{
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  k_mcs_acquire(lock, node);
+
+  return flags;
+}
+
+
+void k_mcs_release_irqrestore(k_mcs_lock* lock, k_mcs_node* node, k_regn flags)
+{
+  k_mcs_release(lock, node);
+  k_set_rflags(flags);
+}
+
+
+void k_spin_print(const char* name, k_spin_stats* stats)
+{
+  uint64_t average = stats->contended ? stats->cycles / stats->contended : 0;
+
+  fprintf(stddbg,
+    "[LOCK] %s: %llu acquired, %llu contended, %llu cycles waiting "
+    "(average %llu, max %llu)\n",
+    name,
+    stats->acquired,
+    stats->contended,
+    stats->cycles,
+    average,
+    stats->max
+  );
+}
@@ -1,6 +1,10 @@
 #include "osdev64/sync.h"
 #include "osdev64/instructor.h"
 #include "osdev64/memory.h"
+#include "osdev64/smp.h"
+#include "osdev64/spinlock.h"
+#include "osdev64/task.h"
+#include "osdev64/syscall.h"
 
 #include "klibc/stdio.h"
 
@@ -9,48 +13,160 @@
 // Intel's manual contains the following warning about semaphores:
 // "Do not implement semaphores using the WC memory type"
 // Intel also recommends placing sempahores on 128-byte boundaries.
+// Every k_sync_value is aligned to SYNC_ALIGN for that reason.
 
 
+// number of synchronization values in each page of the pool
+#define SYNC_PER_PAGE (0x1000 / sizeof(k_sync_value))
 
-// memory used for storing synchronization values
-static k_regn* sync_memory;
+// number of bits in the index of a futex wait queue
+#define FUTEX_BITS 6
 
-// bitmap for keeping track of synchronization value allocation
-static uint64_t sync_bitmap[8];
+// number of futex wait queues
+#define FUTEX_QUEUES (1 << FUTEX_BITS)
 
-// b should range from 0 to 511
-static uint64_t check_bit(uint64_t bit)
+// first address in the private half of an address space
+#define FUTEX_PRIVATE 0xFFFF800000000000
+
+// states of a lock built on a futex word
+#define FUTEX_FREE 0      // nobody holds the lock
+#define FUTEX_HELD 1      // the lock is held and nobody is waiting
+#define FUTEX_CONTENDED 2 // the lock is held and tasks may be waiting
+
+// fields of the state of a reader-writer lock
+#define RW_READERS 0xFFFFFFFF              // number of readers
+#define RW_WRITER ((k_regn)1 << 32)        // a writer holds the lock
+#define RW_WAITING_ONE ((k_regn)1 << 33)   // one waiting writer
+#define RW_WAITING (~(RW_WAITING_ONE - 1)) // number of waiting writers
+
+
+// Synchronization values that aren't in use
+// Values are taken from the front of the list when they're created and
+// put back when they're destroyed. When the list is empty, another page
+// is divided into values, so there's no limit on how many can exist.
+// Pages are never returned to the page frame allocator.
+static k_sync_value* s_free = NULL;
+
+// lock for the free list
+static k_ticket_lock s_pool_lock = K_TICKET_LOCK_INIT(NULL);
+
+
+// Futex wait queues
+// A task waiting on a futex word sleeps in the queue that its address
+// hashes to. Unrelated words may share a queue, so each task records
+// which word it's waiting on.
+static k_wait_queue s_futex_queues[FUTEX_QUEUES];
+
+
+// A task's reason for waiting on a futex word.
+typedef struct futex_waiter {
+  k_futex* addr;   // the futex word
+  k_regn expected; // the value it had when the task decided to wait
+}futex_waiter;
+
+
+/**
+ * Divides a new page into synchronization values and adds them to the
+ * free list. This is called with the pool lock held.
+ *
+ * Returns:
+ *   int - 1 if the pool grew or 0 if there was no memory
+ */
+static int pool_grow()
 {
-  uint64_t i = bit / 64;
-  uint64_t b = bit % 64;
+  k_sync_value* page = (k_sync_value*)k_memory_alloc_pages(1);
+  if (page == NULL)
+  {
+    return 0;
+  }
+
+  for (size_t i = 0; i < SYNC_PER_PAGE - 1; i++)
+  {
+    page[i].next = &page[i + 1];
+  }
+
+  page[SYNC_PER_PAGE - 1].next = s_free;
+  s_free = page;
+
+  return 1;
+}
 
-  return sync_bitmap[i] & ((uint64_t)1 << b);
+
+/**
+ * Gives a synchronization value an initial value and an empty wait queue.
+ *
+ * Params:
+ *   k_sync_value* - a synchronization value
+ *   k_regn - the initial value
+ */
+static void reset(k_sync_value* v, k_regn n)
+{
+  v->value = n;
+  k_ticket_init(&v->waiters.lock, NULL);
+  v->waiters.head = NULL;
+  v->waiters.tail = NULL;
+  v->next = NULL;
 }
 
-static uint64_t set_bit(uint64_t bit)
+
+/**
+ * Takes a synchronization value from the pool and gives it an initial
+ * value and an empty wait queue.
+ *
+ * Params:
+ *   k_regn - the initial value
+ *
+ * Returns:
+ *   k_sync_value* - a synchronization value or NULL on failure
+ */
+static k_sync_value* pool_take(k_regn n)
 {
-  uint64_t i = bit / 64;
-  uint64_t b = bit % 64;
+  k_regn flags = k_ticket_acquire_irqsave(&s_pool_lock);
 
-  sync_bitmap[i] |= ((uint64_t)1 << b);
+  if (s_free == NULL && !pool_grow())
+  {
+    k_ticket_release_irqrestore(&s_pool_lock, flags);
+    return NULL;
+  }
+
+  k_sync_value* v = s_free;
+  s_free = v->next;
+
+  k_ticket_release_irqrestore(&s_pool_lock, flags);
+
+  reset(v, n);
+
+  return v;
 }
 
-static uint64_t clear_bit(uint64_t bit)
+
+/**
+ * Puts a synchronization value back in the pool.
+ *
+ * Params:
+ *   k_sync_value* - a synchronization value from pool_take
+ */
+static void pool_put(k_sync_value* v)
 {
-  uint64_t i = bit / 64;
-  uint64_t b = bit % 64;
+  if (v == NULL)
+  {
+    return;
+  }
+
+  k_regn flags = k_ticket_acquire_irqsave(&s_pool_lock);
 
-  sync_bitmap[i] &= ~((uint64_t)1 << b);
+  v->next = s_free;
+  s_free = v;
+
+  k_ticket_release_irqrestore(&s_pool_lock, flags);
 }
 
+
 void k_sync_init()
 {
-  // Allocate 4 Kib for the memory pool.
-  // If we use 8 bytes for each synchronization value, that allows
-  // for up to 512 unique values to exist simultaneously.
-  sync_memory = (k_regn*)k_memory_alloc_pages(1);
-
-  if (sync_memory == NULL)
+  // Fill the pool with its first page, so the synchronization values
+  // created during startup don't have to wait for it.
+  if (!pool_grow())
   {
     fprintf(
       stddbg,
@@ -61,34 +177,168 @@ void k_sync_init()
 }
 
 
-k_lock* k_mutex_create()
+/**
+ * Wakes the first task waiting on a synchronization value.
+ * If the yield flag is set, then the woken task is put at the front of
+ * its run queue, and the current task yields to it.
+ *
+ * Params:
+ *   k_sync_value* - a synchronization value
+ *   int - yield flag
+ */
+static void wake(k_sync_value* v, int yield)
 {
-  // Find the first available bit in the bitmap.
-  for (uint64_t b = 0; b < 512; b++)
+  k_wait_queue* q = &v->waiters;
+
+  // The value has already been changed with a locked instruction, so any
+  // task that goes to sleep from now on will see the change once it's in
+  // the queue, and not actually sleep.
+  // That means an empty queue can be checked without disabling
+  // interrupts, and releasing an uncontended lock stays cheap.
+  if (q->head == NULL)
   {
-    if (!check_bit(b))
-    {
-      sync_memory[b] = 0;
-      set_bit(b);
-      return &sync_memory[b];
-    }
+    return;
   }
 
-  return NULL;
+  if (k_task_wake(q, yield ? TASK_WAKE_FIRST : TASK_WAKE_ONE) && yield)
+  {
+    k_syscall_yield();
+  }
 }
 
 
-void k_mutex_destroy(k_lock* sl)
+/**
+ * Checks if a lock has been released.
+ *
+ * Params:
+ *   void* - a pointer to a lock
+ *
+ * Returns:
+ *   int - 1 if the lock is free or 0 if it's held
+ */
+static int lock_ready(void* data)
+{
+  return (*(volatile k_regn*)data & 1) ? 0 : 1;
+}
+
+
+/**
+ * Checks if a semaphore can be decremented.
+ *
+ * Params:
+ *   void* - a pointer to a semaphore
+ *
+ * Returns:
+ *   int - 1 if the semaphore is positive or 0 if it's not
+ */
+static int semaphore_ready(void* data)
 {
-  // Clear the corresponding bit in the bitmap.
-  for (uint64_t b = 0; b < 512; b++)
+  return (*(volatile int64_t*)data > 0) ? 1 : 0;
+}
+
+
+/**
+ * Checks if a reader-writer lock can be acquired for reading.
+ *
+ * Params:
+ *   void* - a pointer to the state of a reader-writer lock
+ *
+ * Returns:
+ *   int - 1 if no writer holds or is waiting for the lock or 0 otherwise
+ */
+static int read_ready(void* data)
+{
+  return (*(volatile k_regn*)data & (RW_WRITER | RW_WAITING)) ? 0 : 1;
+}
+
+
+/**
+ * Checks if a reader-writer lock can be acquired for writing.
+ *
+ * Params:
+ *   void* - a pointer to the state of a reader-writer lock
+ *
+ * Returns:
+ *   int - 1 if nobody holds the lock or 0 otherwise
+ */
+static int write_ready(void* data)
+{
+  return (*(volatile k_regn*)data & (RW_WRITER | RW_READERS)) ? 0 : 1;
+}
+
+
+k_regn* k_sync_sleep(k_regn* regs, k_regn type, k_regn* val)
+{
+  if (val == NULL)
+  {
+    return regs;
+  }
+
+  // The state is the first member of its k_rwlock.
+  if (type == SYNC_TYPE_READ || type == SYNC_TYPE_WRITE)
   {
-    if (&sync_memory[b] == sl)
+    k_rwlock* rw = (k_rwlock*)val;
+    int (*ready)(void*) = type == SYNC_TYPE_READ ? read_ready : write_ready;
+
+    if (ready(val))
+    {
+      return regs;
+    }
+
+    return k_task_wait(
+      regs,
+      type == SYNC_TYPE_READ ? &rw->readers : &rw->writers,
+      ready,
+      val
+    );
+  }
+
+  // The value is the first member of its k_sync_value.
+  k_wait_queue* q = &((k_sync_value*)val)->waiters;
+
+  // The value may have changed since the task decided to sleep,
+  // in which case it goes back and tries again. The value may also be
+  // changed by another processor at any time, so it's checked again
+  // once the task is in the wait queue.
+  if (type == SYNC_TYPE_LOCK)
+  {
+    if (lock_ready(val))
+    {
+      return regs;
+    }
+
+    return k_task_wait(regs, q, lock_ready, val);
+  }
+
+  if (type == SYNC_TYPE_SEMAPHORE)
+  {
+    if (semaphore_ready(val))
     {
-      clear_bit(b);
-      return;
+      return regs;
     }
+
+    return k_task_wait(regs, q, semaphore_ready, val);
   }
+
+  return k_task_wait(regs, q, NULL, NULL);
+}
+
+
+k_lock* k_mutex_create()
+{
+  return pool_take(0);
+}
+
+
+void k_mutex_destroy(k_lock* sl)
+{
+  pool_put(sl);
+}
+
+
+void k_mutex_init(k_lock* sl)
+{
+  reset(sl, 0);
 }
 
 
@@ -96,67 +346,374 @@ void k_mutex_acquire(k_lock* sl, int busy)
 {
   if (busy)
   {
-    k_lock_spin(sl);
+    k_lock_spin(&sl->value);
   }
   else
   {
-    k_lock_sleep(sl);
+    k_lock_sleep(&sl->value);
   }
 }
 
 
-void k_mutex_release(k_lock* sl)
+void k_mutex_release(k_lock* sl, int yield)
 {
-  k_btr(0, sl);
+  k_btr(0, &sl->value);
+  wake(sl, yield);
 }
 
 
 
 k_semaphore* k_semaphore_create(int64_t n)
 {
-  // Find the first available bit in the bitmap.
-  for (uint64_t b = 0; b < 512; b++)
+  return pool_take((k_regn)n);
+}
+
+
+void k_semaphore_destroy(k_semaphore* s)
+{
+  pool_put(s);
+}
+
+
+void k_semaphore_init(k_semaphore* s, int64_t n)
+{
+  reset(s, (k_regn)n);
+}
+
+
+void k_semaphore_wait(k_semaphore* s, int busy)
+{
+  if (busy)
+  {
+    k_sem_wait((int64_t*)&s->value);
+  }
+  else
   {
-    if (!check_bit(b))
+    k_sem_sleep((int64_t*)&s->value);
+  }
+}
+
+
+void k_semaphore_signal(k_semaphore* s, int yield)
+{
+  k_xadd(1, (int64_t*)&s->value);
+  wake(s, yield);
+}
+
+
+void k_rwlock_init(k_rwlock* rw)
+{
+  rw->state = 0;
+  k_ticket_init(&rw->readers.lock, NULL);
+  rw->readers.head = NULL;
+  rw->readers.tail = NULL;
+  k_ticket_init(&rw->writers.lock, NULL);
+  rw->writers.head = NULL;
+  rw->writers.tail = NULL;
+}
+
+
+void k_rwlock_read_acquire(k_rwlock* rw, int busy)
+{
+  k_regn state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+
+  for (;;)
+  {
+    if (!(state & (RW_WRITER | RW_WAITING)))
+    {
+      if (__atomic_compare_exchange_n(&rw->state, &state, state + 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+        return;
+      }
+
+      // The state that was seen is in state now, so try again.
+      continue;
+    }
+
+    if (busy)
     {
-      sync_memory[b] = n;
-      set_bit(b);
-      return &sync_memory[b];
+      __builtin_ia32_pause();
     }
+    else
+    {
+      k_syscall_sleep_sync(SYNC_TYPE_READ, &rw->state);
+    }
+
+    state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
   }
+}
 
-  return NULL;
+
+void k_rwlock_read_release(k_rwlock* rw)
+{
+  // A waiter adds itself to a wait queue and then checks the state
+  // again, so the state is changed and the queue is checked in the
+  // opposite order. Both sides need sequential consistency, or each could
+  // miss the other's write, and the waiter would sleep with no one left
+  // to wake it.
+  k_regn state = __atomic_sub_fetch(&rw->state, 1, __ATOMIC_SEQ_CST);
+
+  // The last reader out hands the lock to a waiting writer.
+  if (!(state & RW_READERS) && (state & RW_WAITING)
+    && __atomic_load_n(&rw->writers.head, __ATOMIC_SEQ_CST) != NULL)
+  {
+    k_task_wake(&rw->writers, TASK_WAKE_ONE);
+  }
 }
 
 
-void k_semaphore_destroy(k_semaphore* s)
+void k_rwlock_write_acquire(k_rwlock* rw, int busy)
 {
-  // Clear the corresponding bit in the bitmap.
-  for (uint64_t b = 0; b < 512; b++)
+  // Announcing the writer first keeps new readers out while it waits.
+  k_regn state = __atomic_add_fetch(&rw->state, RW_WAITING_ONE,
+    __ATOMIC_RELAXED);
+
+  for (;;)
   {
-    if (&sync_memory[b] == s)
+    if (!(state & (RW_WRITER | RW_READERS)))
+    {
+      k_regn next = (state - RW_WAITING_ONE) | RW_WRITER;
+
+      if (__atomic_compare_exchange_n(&rw->state, &state, next, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+        return;
+      }
+
+      continue;
+    }
+
+    if (busy)
     {
-      clear_bit(b);
-      return;
+      __builtin_ia32_pause();
     }
+    else
+    {
+      k_syscall_sleep_sync(SYNC_TYPE_WRITE, &rw->state);
+    }
+
+    state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
   }
 }
 
 
-void k_semaphore_wait(k_semaphore* s, int busy)
+void k_rwlock_write_release(k_rwlock* rw)
 {
-  if (busy)
+  // This has the same ordering requirement as k_rwlock_read_release.
+  k_regn state = __atomic_and_fetch(&rw->state, ~RW_WRITER, __ATOMIC_SEQ_CST);
+
+  // Another writer goes next if there is one. Otherwise, every reader
+  // that gave way to the writers may go at once.
+  if (state & RW_WAITING)
   {
-    k_sem_wait(s);
+    if (__atomic_load_n(&rw->writers.head, __ATOMIC_SEQ_CST) != NULL)
+    {
+      k_task_wake(&rw->writers, TASK_WAKE_ONE);
+    }
   }
-  else
+  else if (__atomic_load_n(&rw->readers.head, __ATOMIC_SEQ_CST) != NULL)
+  {
+    k_task_wake(&rw->readers, TASK_WAKE_ALL);
+  }
+}
+
+
+void k_seqlock_init(k_seqlock* sl)
+{
+  sl->sequence = 0;
+  k_ticket_init(&sl->lock, NULL);
+}
+
+
+uint64_t k_seqlock_read_begin(k_seqlock* sl)
+{
+  uint64_t seq;
+
+  while ((seq = __atomic_load_n(&sl->sequence, __ATOMIC_ACQUIRE)) & 1)
+  {
+    __builtin_ia32_pause();
+  }
+
+  return seq;
+}
+
+
+int k_seqlock_read_retry(k_seqlock* sl, uint64_t seq)
+{
+  // The data must be read before the sequence number is checked again.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  return __atomic_load_n(&sl->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+
+k_regn k_seqlock_write_begin(k_seqlock* sl)
+{
+  k_regn flags = k_ticket_acquire_irqsave(&sl->lock);
+
+  // The odd sequence number must be visible before any of the data
+  // changes.
+  __atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  return flags;
+}
+
+
+void k_seqlock_write_end(k_seqlock* sl, k_regn flags)
+{
+  __atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELEASE);
+
+  k_ticket_release_irqrestore(&sl->lock, flags);
+}
+
+
+/**
+ * Gets the address space that a futex address belongs to.
+ *
+ * Params:
+ *   k_futex* - a pointer to a futex word
+ *
+ * Returns:
+ *   k_addr_space* - the current task's address space if the address is
+ *                   private to it or NULL if it's shared
+ */
+static k_addr_space* futex_space(k_futex* addr)
+{
+  k_task* t = SMP_CPU_FIELD(current);
+
+  if (PTR_TO_N(addr) < FUTEX_PRIVATE || t == NULL)
   {
-    k_sem_sleep(s);
+    return NULL;
   }
+
+  return t->space;
+}
+
+
+/**
+ * Gets the wait queue for a futex word.
+ *
+ * Params:
+ *   k_futex* - a pointer to a futex word
+ *   k_addr_space* - the address space the word belongs to or NULL
+ *
+ * Returns:
+ *   k_wait_queue* - the wait queue
+ */
+static k_wait_queue* futex_queue(k_futex* addr, k_addr_space* space)
+{
+  // Futex words are at least 8-byte aligned, so the low bits carry
+  // nothing. The product is mixed into the top bits, which are used as
+  // the index.
+  uint64_t key = (PTR_TO_N(addr) >> 3) ^ PTR_TO_N(space);
+  uint64_t hash = key * 0x9E3779B97F4A7C15;
+
+  return &s_futex_queues[hash >> (64 - FUTEX_BITS)];
+}
+
+
+/**
+ * Checks if a futex word has changed since a task decided to wait on it.
+ *
+ * Params:
+ *   void* - a pointer to a futex_waiter
+ *
+ * Returns:
+ *   int - 1 if the word no longer has the expected value or 0 if it does
+ */
+static int futex_ready(void* data)
+{
+  futex_waiter* w = (futex_waiter*)data;
+
+  return (*(volatile k_futex*)w->addr != w->expected) ? 1 : 0;
 }
 
 
-void k_semaphore_signal(k_semaphore* s)
+k_regn* k_futex_wait(k_regn* regs, k_futex* addr, k_regn expected)
 {
-  k_xadd(1, s);
+  k_task* t = SMP_CPU_FIELD(current);
+
+  if (addr == NULL || t == NULL)
+  {
+    return regs;
+  }
+
+  futex_waiter w = { addr, expected };
+
+  if (futex_ready(&w))
+  {
+    return regs;
+  }
+
+  k_addr_space* space = futex_space(addr);
+
+  // The key is set before the task is visible in the queue, and
+  // k_task_wait only calls futex_ready before it returns, so the waiter
+  // can live on this stack.
+  t->wait_key = addr;
+  t->wait_space = space;
+
+  return k_task_wait(regs, futex_queue(addr, space), futex_ready, &w);
+}
+
+
+int k_futex_wake(k_futex* addr, k_regn n)
+{
+  if (addr == NULL || n == 0)
+  {
+    return 0;
+  }
+
+  k_addr_space* space = futex_space(addr);
+  k_wait_queue* q = futex_queue(addr, space);
+
+  // As with the other synchronization values, the word was changed
+  // before this was called, so an empty queue can be checked without
+  // the lock.
+  if (q->head == NULL)
+  {
+    return 0;
+  }
+
+  return k_task_wake_key(q, addr, space, n > INT32_MAX ? INT32_MAX : (int)n);
+}
+
+
+void k_futex_lock(k_futex* f)
+{
+  k_regn state = FUTEX_FREE;
+
+  // The lock is usually free, so this is the only atomic operation.
+  if (__atomic_compare_exchange_n(f, &state, FUTEX_HELD, 0,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    return;
+  }
+
+  // Mark the lock as contended, so that whoever releases it knows to
+  // wake a waiter. If it was released in the meantime, then the
+  // exchange acquires it, and it stays marked as contended in case
+  // other tasks are still waiting.
+  if (state != FUTEX_CONTENDED)
+  {
+    state = __atomic_exchange_n(f, FUTEX_CONTENDED, __ATOMIC_ACQUIRE);
+  }
+
+  while (state != FUTEX_FREE)
+  {
+    k_syscall_futex_wait(f, FUTEX_CONTENDED);
+    state = __atomic_exchange_n(f, FUTEX_CONTENDED, __ATOMIC_ACQUIRE);
+  }
+}
+
+
+void k_futex_unlock(k_futex* f)
+{
+  // Only a contended lock needs the kernel.
+  if (__atomic_exchange_n(f, FUTEX_FREE, __ATOMIC_RELEASE) == FUTEX_CONTENDED)
+  {
+    k_syscall_futex_wake(f, 1);
+  }
 }
@@ -1,9 +1,11 @@
 
 #include "osdev64/syscall.h"
 #include "osdev64/task.h"
+#include "osdev64/sync.h"
 #include "osdev64/instructor.h"
 #include "osdev64/file.h"
 #include "osdev64/serial.h"
+#include "osdev64/tty.h"
 
 #include "klibc/stdio.h"
 
@@ -24,16 +26,33 @@ k_regn k_syscall(
     // data1 is the register stack
     // data2 is the synchronization type
     // data3 is the synchronization value
-    k_regn* next = k_task_sleep((k_regn*)data1, (k_regn*)data3, data2, 0);
+    k_regn* next = k_sync_sleep((k_regn*)data1, data2, (k_regn*)data3);
 
     return PTR_TO_N(next);
   }
 
+  case SYSCALL_FUTEX_WAIT:
+  {
+    // data1 is the register stack
+    // data2 is the address of the futex word
+    // data3 is the expected value
+    k_regn* next = k_futex_wait((k_regn*)data1, (k_regn*)data2, data3);
+
+    return PTR_TO_N(next);
+  }
+
+  case SYSCALL_FUTEX_WAKE:
+  {
+    // data1 is the address of the futex word
+    // data2 is the most tasks to wake
+    return (k_regn)k_futex_wake((k_regn*)data1, data2);
+  }
+
   case SYSCALL_SLEEP_TICK:
   {
     // data1 is the register stack
     // data2 is the tick limit
-    k_regn* next = k_task_sleep((k_regn*)data1, NULL, 3, data2);
+    k_regn* next = k_task_sleep((k_regn*)data1, data2);
 
     return PTR_TO_N(next);
   }
@@ -44,6 +63,12 @@ k_regn k_syscall(
     return PTR_TO_N(next);
   }
 
+  case SYSCALL_YIELD:
+  {
+    k_regn* next = k_task_switch((k_regn*)data1);
+    return PTR_TO_N(next);
+  }
+
   case SYSCALL_WRITE:
   {
     FILE* f = (FILE*)data1;   // file
@@ -93,6 +118,9 @@ k_regn k_syscall(
 
       // Update the writer pointer.
       info->writer = writer;
+
+      // The TTY reads standard output, so let it know there's more.
+      k_tty_notify();
     }
 
     // Debug output
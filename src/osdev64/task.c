@@ -4,8 +4,11 @@
 #include "osdev64/interrupts.h"
 #include "osdev64/instructor.h"
 #include "osdev64/apic.h"
+#include "osdev64/control.h"
 #include "osdev64/syscall.h"
 #include "osdev64/file.h"
+#include "osdev64/smp.h"
+#include "osdev64/spinlock.h"
 
 #include "klibc/stdio.h"
 
@@ -17,10 +20,6 @@
 #define TASK_REG_RIP 16
 #define TASK_REG_RBP 1
 
-#define TASK_SYNC_LOCK 1
-#define TASK_SYNC_SEMAPHORE 2
-#define TASK_SYNC_TICK 3
-
 // Memory for the initial contents of a task's stack.
 // It must be large enough to hold a task's entire register stack,
 // since the registers stack is popped upon returning to the IRQ that
@@ -29,6 +28,21 @@
 #define TASK_STACK_SPACE (sizeof(uint64_t) * 28)
 
 
+// Size of a task's stack.
+// The stack is reserved with k_paging_reserve, so a page of physical
+// memory is only used once the task has touched it.
+// It has a guard page below it, so overflowing the stack causes a page
+// fault instead of overwriting other memory.
+#define TASK_STACK_SIZE 0x40000
+
+// Size of the top part of a task's stack that's mapped when the task
+// is created.
+// The page fault handler takes the paging, memory, and heap locks, so
+// kernel code must not grow the stack past this while holding one of
+// them. This is the size of the whole stack before it was reserved.
+#define TASK_STACK_COMMIT 0x4000
+
+
 // number of values in the register stack including padding
 #define TASK_REG_COUNT 21
 
@@ -68,21 +82,47 @@
 // +-------------------+
 
 
-// global PIT tick count
-extern uint64_t g_pit_ticks;
-
-
 // number of tasks that have been created
 uint64_t g_task_count = 0;
 
-// the initial memory pointed to by the current task pointer
-k_task g_primer_task;
 
-// currently task
-k_task* g_current_task = &g_primer_task;
+// number of ticks after a task last ran during which its data is
+// assumed to still be in the cache of the processor it ran on
+#define TASK_CACHE_HOT 2
+
+// number of ticks between attempts to balance a processor's run queue
+// with the busiest one
+#define TASK_BALANCE_TICKS 4
+
+// maximum number of tasks looked at when choosing a task to steal
+#define TASK_STEAL_SCAN 8
 
-// global task list
-k_task* g_task_list = NULL;
+
+// A run queue.
+// Each processor has its own run queue, so processors only contend for
+// a run queue's lock when one of them moves a task to another processor.
+// Each priority level has a FIFO queue of tasks that are ready to run.
+// Bit n of map is set if the queue for priority n is not empty,
+// so the highest priority ready task is found with a single bit scan.
+// The current task of each processor is not in any run queue while
+// it's executing, and neither are the idle tasks.
+typedef struct run_queue {
+  _Alignas(SMP_CACHE_LINE)
+  k_ticket_lock lock;                // lock for the queue
+  volatile uint32_t map;             // priorities that have ready tasks
+  volatile uint32_t count;           // number of tasks in the queue
+  uint64_t balance_at;               // tick of the next balancing attempt
+  k_task* head[TASK_PRIORITY_COUNT]; // first task of each priority
+  k_task* tail[TASK_PRIORITY_COUNT]; // last task of each priority
+}run_queue;
+
+
+// the run queue of each processor, indexed by the processor's index
+// Each run queue starts on its own cache line.
+static run_queue s_queues[SMP_CPU_MAX];
+
+// number of ticks a task runs before it's preempted
+static uint64_t s_time_slice = TASK_TIME_SLICE;
 
 
 // Standard I/O streams.
@@ -91,40 +131,574 @@ static FILE* current_stdin;
 static FILE* current_stdout;
 static FILE* current_stderr;
 
+
+/**
+ * Checks if a task is allowed to run on a processor.
+ *
+ * Params:
+ *   k_task* - a task
+ *   uint32_t - the index of a processor
+ *
+ * Returns:
+ *   int - 1 if the task may run there or 0 if it may not
+ */
+static inline int allowed(k_task* t, uint32_t cpu)
+{
+  return (t->affinity >> cpu) & 1;
+}
+
+
+/**
+ * Puts a task at the end of the queue for its priority in a run queue.
+ * The run queue's lock must be held.
+ *
+ * Params:
+ *   run_queue* - a run queue
+ *   k_task* - a pointer to a task that is ready to run
+ */
+static inline void run_push(run_queue* q, k_task* t)
+{
+  int p = t->priority;
+
+  t->next = NULL;
+  t->level = p;
+  t->queue = q - s_queues;
+
+  if (q->tail[p] == NULL)
+  {
+    q->head[p] = t;
+  }
+  else
+  {
+    q->tail[p]->next = t;
+  }
+
+  q->tail[p] = t;
+  q->map |= ((uint32_t)1 << p);
+  q->count++;
+}
+
+
+/**
+ * Puts a task at the front of the queue for its priority in a run queue.
+ * The run queue's lock must be held.
+ *
+ * Params:
+ *   run_queue* - a run queue
+ *   k_task* - a pointer to a task that is ready to run
+ */
+static inline void run_push_front(run_queue* q, k_task* t)
+{
+  int p = t->priority;
+
+  t->level = p;
+  t->queue = q - s_queues;
+
+  t->next = q->head[p];
+  q->head[p] = t;
+
+  if (q->tail[p] == NULL)
+  {
+    q->tail[p] = t;
+  }
+
+  q->map |= ((uint32_t)1 << p);
+  q->count++;
+}
+
+
 /**
- * Removes a task from the global task list.
+ * Removes a task from a run queue.
+ * The run queue's lock must be held.
  * This function does not free the memory used by a task.
  *
  * Params:
+ *   run_queue* - a run queue
  *   k_task* - a pointer to the task to be removed
+ *
+ * Returns:
+ *   int - 1 if the task was in the queue or 0 if it wasn't
  */
-static void remove_task(k_task* target)
+static int run_remove(run_queue* q, k_task* target)
 {
-  k_task* node = g_task_list;
-  k_task* first = node;
-  k_task* prev;
+  int p = target->level;
+  k_task* prev = NULL;
+  k_task* node = q->head[p];
 
-  while (node != target)
+  while (node != NULL && node != target)
   {
     prev = node;
     node = node->next;
+  }
+
+  // If we didn't find the task, then it wasn't in the queue.
+  if (node == NULL)
+  {
+    return 0;
+  }
+
+  if (prev == NULL)
+  {
+    q->head[p] = node->next;
+  }
+  else
+  {
+    prev->next = node->next;
+  }
+
+  if (q->tail[p] == node)
+  {
+    q->tail[p] = prev;
+  }
 
-    // If we made it back to the first task,
-    // then we couldn't find the task to remove.
-    if (node == first)
+  if (q->head[p] == NULL)
+  {
+    q->map &= ~((uint32_t)1 << p);
+  }
+
+  node->next = NULL;
+  node->queue = -1;
+  q->count--;
+
+  return 1;
+}
+
+
+/**
+ * Takes the first task that may run on a processor from the highest
+ * priority queue of a run queue that has one.
+ * A task that another processor is still switching away from is skipped,
+ * since that processor is still using its stack. The task that the caller
+ * is switching away from may be chosen again, since its stack is the
+ * caller's own.
+ * The run queue's lock must be held.
+ *
+ * Params:
+ *   run_queue* - a run queue
+ *   uint32_t - the index of the processor that will run the task
+ *   k_task* - the task that the caller is switching away from
+ *
+ * Returns:
+ *   k_task* - a pointer to the next task to run or NULL
+ */
+static k_task* run_pop(run_queue* q, uint32_t cpu, k_task* prev)
+{
+  for (uint32_t map = q->map; map != 0; map &= map - 1)
+  {
+    int p = __builtin_ctz(map);
+
+    for (k_task* t = q->head[p]; t != NULL; t = t->next)
     {
+      if ((!t->switching || t == prev) && allowed(t, cpu))
+      {
+        run_remove(q, t);
+        return t;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+/**
+ * Chooses the run queue that a task should wait in.
+ * A task goes back to the processor it last ran on, where its data is
+ * most likely still in the cache, unless it's not allowed to run there.
+ * Otherwise, it goes to the processor with the fewest waiting tasks that
+ * it's allowed to run on.
+ *
+ * Params:
+ *   k_task* - a task that is ready to run
+ *
+ * Returns:
+ *   run_queue* - a run queue
+ */
+static run_queue* home_queue(k_task* t)
+{
+  uint32_t count = k_smp_count();
+
+  if (t->cpu >= 0 && (uint32_t)t->cpu < count && allowed(t, t->cpu))
+  {
+    return &s_queues[t->cpu];
+  }
+
+  run_queue* best = NULL;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (allowed(t, i) && (best == NULL || s_queues[i].count < best->count))
+    {
+      best = &s_queues[i];
+    }
+  }
+
+  return best != NULL ? best : &s_queues[0];
+}
+
+
+/**
+ * Puts a task that is ready to run in a run queue.
+ * If the run queue belongs to another processor that is idle, then that
+ * processor is woken up. Otherwise, an idle processor that the task may
+ * run on is woken up so that it can steal the task.
+ * This must be called with interrupts disabled.
+ *
+ * Params:
+ *   run_queue* - a run queue
+ *   k_task* - a task that is ready to run
+ *   int - 1 to put the task at the front of its queue or 0 for the end
+ */
+static void enqueue(run_queue* q, k_task* t, int front)
+{
+  k_ticket_acquire(&q->lock);
+
+  if (front)
+  {
+    run_push_front(q, t);
+  }
+  else
+  {
+    run_push(q, t);
+  }
+
+  k_ticket_release(&q->lock);
+
+  // A processor that is halted in its idle task has stopped its tick,
+  // so it wouldn't notice the task at all.
+  k_cpu* cpu = k_smp_get(q - s_queues);
+  if (cpu != NULL && cpu->current == cpu->idle)
+  {
+    k_smp_wake(cpu->index);
+    return;
+  }
+
+  uint32_t self = SMP_CPU_FIELD(index);
+  uint32_t count = k_smp_count();
+  for (uint32_t i = 0; i < count; i++)
+  {
+    k_cpu* other = k_smp_get(i);
+    if (i != self && other != NULL && other->current == other->idle
+      && allowed(t, i))
+    {
+      k_smp_wake(i);
       return;
     }
   }
+}
+
+
+/**
+ * Takes a task from the busiest run queue so that it can run on
+ * another processor.
+ * Tasks are only taken if that makes the queues more even. Among the
+ * tasks with the highest priority, the first one that last ran on the
+ * thief is preferred, since some of its data may still be in the thief's
+ * cache. Otherwise, a task that hasn't run recently is preferred over
+ * one that may still have data in the cache of the busy processor.
+ * This must be called with interrupts disabled.
+ *
+ * Params:
+ *   uint32_t - the index of the processor that is stealing a task
+ *
+ * Returns:
+ *   k_task* - a task that is ready to run or NULL
+ */
+static k_task* steal(uint32_t thief)
+{
+  run_queue* own = &s_queues[thief];
+  run_queue* victim = NULL;
+  uint32_t most = 0;
+
+  // The counts are read without the locks, so they're only a hint.
+  uint32_t count = k_smp_count();
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (i != thief && s_queues[i].count > most)
+    {
+      most = s_queues[i].count;
+      victim = &s_queues[i];
+    }
+  }
+
+  if (victim == NULL || (own->count != 0 && most <= own->count + 1))
+  {
+    return NULL;
+  }
+
+  uint64_t now = k_timer_now();
+  k_task* pick = NULL;
+  int rank = 0;
+  int scanned = 0;
+
+  k_ticket_acquire(&victim->lock);
+
+  for (uint32_t map = victim->map; map != 0 && pick == NULL; map &= map - 1)
+  {
+    int p = __builtin_ctz(map);
+
+    for (k_task* t = victim->head[p];
+      t != NULL && scanned < TASK_STEAL_SCAN && rank < 3;
+      t = t->next)
+    {
+      scanned++;
+
+      if (t->switching || !allowed(t, thief))
+      {
+        continue;
+      }
+
+      int r = 1;
+      if (t->cpu == (int)thief)
+      {
+        r = 3;
+      }
+      else if (now - t->last_ran >= TASK_CACHE_HOT)
+      {
+        r = 2;
+      }
+
+      if (r > rank)
+      {
+        pick = t;
+        rank = r;
+      }
+    }
+  }
+
+  if (pick != NULL)
+  {
+    run_remove(victim, pick);
+  }
 
-  // Remove the task from the list.
-  prev->next = node->next;
+  k_ticket_release(&victim->lock);
 
-  // If we only have one task left, set its next pointer to NULL,
-  // so it doesn't point to itself.
-  if (prev == prev->next)
+  return pick;
+}
+
+
+/**
+ * Checks if any processor other than the specified one has tasks
+ * waiting in its run queue.
+ *
+ * Params:
+ *   uint32_t - the index of a processor
+ *
+ * Returns:
+ *   int - 1 if there are tasks to steal or 0 if there aren't
+ */
+static int work_elsewhere(uint32_t cpu)
+{
+  uint32_t count = k_smp_count();
+  for (uint32_t i = 0; i < count; i++)
   {
-    prev->next = NULL;
+    if (i != cpu && s_queues[i].count != 0)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * Wakes a task whose sleep has ended.
+ * This is the callback of each task's timer.
+ *
+ * Params:
+ *   void* - a pointer to a sleeping task
+ */
+static void wake_task(void* data)
+{
+  k_task* t = (k_task*)data;
+
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  t->status = TASK_RUNNING;
+  enqueue(home_queue(t), t, 0);
+
+  k_set_rflags(flags);
+}
+
+
+/**
+ * Removes a task from a wait queue.
+ * The wait queue's lock must be held.
+ *
+ * Params:
+ *   k_wait_queue* - a wait queue
+ *   k_task* - a task in the wait queue
+ */
+static void queue_remove(k_wait_queue* q, k_task* target)
+{
+  k_task* prev = NULL;
+  k_task* node = q->head;
+
+  while (node != NULL && node != target)
+  {
+    prev = node;
+    node = node->next;
+  }
+
+  if (node == NULL)
+  {
+    return;
+  }
+
+  if (prev == NULL)
+  {
+    q->head = node->next;
+  }
+  else
+  {
+    prev->next = node->next;
+  }
+
+  if (q->tail == node)
+  {
+    q->tail = prev;
+  }
+
+  node->next = NULL;
+}
+
+
+/**
+ * Chooses the next task to run on a processor and returns its register
+ * stack.
+ * This must be called with interrupts disabled. If the current task
+ * is going to sleep or stop, then its switching flag must already be set,
+ * since it may have been made visible to other processors.
+ *
+ * Params:
+ *   k_cpu* - the current processor
+ *   k_regn* - a pointer to the current task's register stack
+ *   int - 1 if the current task should go back in a run queue
+ *
+ * Returns:
+ *   k_regn* - a pointer to the register stack of the task to run
+ */
+static k_regn* switch_task(k_cpu* cpu, k_regn* reg_stack, int requeue)
+{
+  k_task* prev = cpu->current;
+
+  // If no task has been scheduled yet, then proceed with the
+  // current thread of execution.
+  if (prev == NULL)
+  {
+    return reg_stack;
+  }
+
+  // Save the register stack of the current task.
+  prev->regs = reg_stack;
+
+  // Until this processor has moved to the next task's register stack,
+  // it's still using the previous task's stack, so no other processor
+  // may run the previous task yet.
+  prev->switching = 1;
+  prev->last_ran = k_timer_now();
+
+  // A task that was preempted or yielded goes to the end of a run queue,
+  // so tasks of the same priority take turns.
+  // A task with a status of SLEEPING is waiting for its timer or
+  // is in a wait queue, and it may already have been woken.
+  // A task with a status of STOPPED is simply dropped, and its status
+  // becomes REMOVED once this processor is no longer using its stack.
+  if (requeue && prev != cpu->idle)
+  {
+    enqueue(home_queue(prev), prev, 0);
+  }
+
+  // Take a task from the busiest processor if this one has nothing
+  // else to do, or every few ticks to keep the run queues even.
+  run_queue* own = cpu->queue;
+  uint64_t now = k_timer_now();
+
+  if (own->count == 0 || now >= own->balance_at)
+  {
+    own->balance_at = now + TASK_BALANCE_TICKS;
+
+    k_task* stolen = steal(cpu->index);
+    if (stolen != NULL)
+    {
+      enqueue(own, stolen, 0);
+    }
+  }
+
+  // Select the next task.
+  k_ticket_acquire(&own->lock);
+  k_task* next = run_pop(own, cpu->index, prev);
+  k_ticket_release(&own->lock);
+
+  if (next == NULL)
+  {
+    next = cpu->idle;
+  }
+
+  next->cpu = cpu->index;
+
+  if (next == prev)
+  {
+    prev->switching = 0;
+  }
+  else
+  {
+    cpu->prev = prev;
+  }
+
+  cpu->current = next;
+
+  // The next task gets a full time slice.
+  cpu->slice_left = s_time_slice;
+
+  // Load the address space of the next task.
+  // CR3 is only written if it's different from the current one.
+  k_paging_switch_space(next->space);
+
+  // Return the register stack of the next task.
+  return next->regs;
+}
+
+
+/**
+ * The starting point of execution for the idle tasks.
+ */
+static void idle_action()
+{
+  for (;;)
+  {
+    k_disable_interrupts();
+
+    run_queue* own = SMP_CPU_FIELD(queue);
+
+    // An interrupt may have woken a task since the idle task was chosen.
+    // Otherwise, the processor is halted with its tick stopped until some
+    // interrupt arrives. The BSP advances the timer wheel, so it only
+    // stops ticking until the wheel has work to do, and a timer started
+    // by another processor that expires sooner wakes it up.
+    // A task put in this processor's run queue, or left waiting in the
+    // queue of a busy processor, comes with an IPI that ends the halt.
+    if (own->map == 0)
+    {
+      if (SMP_CPU_FIELD(index) == 0)
+      {
+        k_lapic_idle(k_timer_idle());
+      }
+      else
+      {
+        k_lapic_halt();
+      }
+    }
+
+    k_enable_interrupts();
+
+    // Switching tasks steals a task from a busy processor
+    // when this one has none of its own.
+    if (own->map != 0 || work_elsewhere(SMP_CPU_FIELD(index)))
+    {
+      k_syscall_yield();
+    }
   }
 }
 
@@ -169,136 +743,205 @@ void k_task_init()
     fprintf(stddbg, "[ERROR] failed to create stderr internal structure\n");
     HANG();
   }
+
+  k_task* idle = k_task_create(idle_action);
+  if (idle == NULL)
+  {
+    fprintf(stddbg, "[ERROR] failed to create idle task\n");
+    HANG();
+  }
+  idle->priority = TASK_PRIORITY_LOW;
+  idle->status = TASK_RUNNING;
+
+  k_cpu* cpu = SMP_THIS_CPU();
+  cpu->idle = idle;
+  cpu->queue = &s_queues[cpu->index];
+}
+
+
+static k_task* create(void (action)(), k_regn commit);
+
+void k_task_start_cpu()
+{
+  k_cpu* cpu = SMP_THIS_CPU();
+
+  // The processor is already running on its own stack, so the idle task
+  // represents the current thread of execution. The register stack and
+  // stack that it's created with are never used, so none of the stack is
+  // committed.
+  k_task* idle = create(idle_action, 0);
+  if (idle == NULL)
+  {
+    fprintf(stddbg, "[ERROR] failed to create idle task for CPU %u\n",
+      cpu->index
+    );
+    HANG();
+  }
+  idle->priority = TASK_PRIORITY_LOW;
+  idle->status = TASK_RUNNING;
+
+  cpu->idle = idle;
+  cpu->queue = &s_queues[cpu->index];
+  cpu->slice_left = s_time_slice;
+  cpu->current = idle;
+
+  k_enable_interrupts();
+
+  idle_action();
 }
 
-static void print_tasks()
+k_regn* k_task_switch(k_regn* reg_stack)
 {
-  k_task* first = g_task_list;
-  k_task* t = g_task_list;
+  // This is called with interrupts disabled.
+  return switch_task(SMP_THIS_CPU(), reg_stack, 1);
+}
 
-  fprintf(stddbg, "(%llu,%d)", first->id, first->status);
 
-  if (first->next == NULL)
+void k_task_switch_done()
+{
+  k_cpu* cpu = SMP_THIS_CPU();
+  k_task* prev = cpu->prev;
+
+  if (prev == NULL)
   {
     return;
   }
 
-  t = first->next;
-  while (t != first)
+  cpu->prev = NULL;
+
+  // The owner of a stopped task may destroy it as soon as its status
+  // is REMOVED, so that has to wait until its stack is no longer used.
+  if (prev->status == TASK_STOPPED)
   {
-    fprintf(stddbg, " (%llu,%d)", t->id, t->status);
-    t = t->next;
+    prev->status = TASK_REMOVED;
   }
-  fprintf(stddbg, "\n");
+
+  // Make sure every write to the previous task is visible before
+  // another processor is allowed to run it.
+  __sync_synchronize();
+  prev->switching = 0;
 }
 
-k_regn* k_task_switch(k_regn* reg_stack)
+
+k_regn* k_task_tick(k_regn* reg_stack)
 {
-  // If there are no tasks, then proceed with the current task.
-  if (g_task_list == NULL)
+  k_cpu* cpu = SMP_THIS_CPU();
+
+  // The idle task gives up the processor as soon as another task is
+  // ready, either on this processor or one it can steal from.
+  // Any other task keeps it until its time slice runs out.
+  if (cpu->current == NULL)
   {
     return reg_stack;
   }
 
-  // Save the register stack of the current task.
-  g_current_task->regs = reg_stack;
-
-  // Select the next task.
-  // Currently, we just do round robin, which is really inefficient.
-  if (g_current_task->next != NULL)
+  if (cpu->current == cpu->idle)
+  {
+    if (cpu->queue->map == 0 && !work_elsewhere(cpu->index))
+    {
+      return reg_stack;
+    }
+  }
+  else if (cpu->slice_left > 1)
   {
-    g_current_task = g_current_task->next;
+    cpu->slice_left--;
+    return reg_stack;
+  }
 
-    // print_tasks();
+  return k_task_switch(reg_stack);
+}
 
-    // Attempt to find the next task wit a status of RUNNING.
-    while (g_current_task->next != NULL
-      && g_current_task->status != TASK_RUNNING)
-    {
-      // For tasks with a status of SLEEPING, check the
-      // wake condition to see if they can changed to RUNNING.
-      if (g_current_task->status == TASK_SLEEPING)
-      {
-        // Locks
-        // wake condition: sync_val == 0
-        if (g_current_task->sync_type == TASK_SYNC_LOCK
-          && *g_current_task->sync_val == 0)
-        {
-          g_current_task->status = TASK_RUNNING;
-        }
-
-        // Semaphores
-        // wake condition: sync_val > 0
-        else if (g_current_task->sync_type == TASK_SYNC_SEMAPHORE
-          && (int64_t)*g_current_task->sync_val > 0)
-        {
-          g_current_task->status = TASK_RUNNING;
-        }
-
-        // Ticks
-        // wake condition: g_pit_ticks - ticks >= limit
-        else if (g_current_task->sync_type == TASK_SYNC_TICK
-          && g_pit_ticks - g_current_task->ticks >= g_current_task->limit)
-        {
-          g_current_task->status = TASK_RUNNING;
-        }
-
-        else
-        {
-          g_current_task = g_current_task->next;
-        }
-      }
 
-      // For tasks with a status of STOPPED, remove
-      // them from the list.
-      else if (g_current_task->status == TASK_STOPPED)
-      {
-        k_task* target = g_current_task;
-        g_current_task = g_current_task->next;
-        remove_task(target);
-        target->status = TASK_REMOVED;
-      }
-      else
-      {
-        g_current_task = g_current_task->next;
-      }
-    }
+void k_task_set_time_slice(uint64_t ticks)
+{
+  if (ticks == 0)
+  {
+    return;
   }
 
-  // Return the register stack of the next task.
-  return g_current_task->regs;
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  // The other processors pick up the new time slice the next time
+  // they switch tasks.
+  s_time_slice = ticks;
+  if (SMP_CPU_FIELD(slice_left) > ticks)
+  {
+    SMP_CPU_FIELD(slice_left) = ticks;
+  }
+
+  k_set_rflags(flags);
 }
 
 
-k_task* k_task_create(void (action)())
+/**
+ * Creates a new task with a status of NEW.
+ * This is k_task_create with a choice of how much of the stack to map
+ * right away.
+ *
+ * Params:
+ *   void (action)() - the function that the task starts executing
+ *   k_regn - the number of bytes at the top of the stack to commit
+ *
+ * Returns:
+ *   k_task* - a pointer to the new task or NULL on failure
+ */
+static k_task* create(void (action)(), k_regn commit)
 {
   void* task_mem; // task memory
-  k_regn rsp;   // stack pointer
-  k_regn rbp;   // base pointer
+  k_regn stack;   // base address of the stack
+  k_regn rsp;     // stack pointer
+  k_regn rbp;     // base pointer
 
-  // Allocate 16 Kib of stack space, and 4 Kib for the task state.
+  // Allocate 4 Kib for the task state, and reserve 256 Kib of
+  // virtual addresses for the stack.
   // The task memory will have the following layout:
   // +--------------------+
-  // |      4 Kib         |
-  // |   task state and   | <- initial register stack
-  // |  register values   | <- task state
-  // |--------------------| <- RBP
+  // |      4 Kib         | <- initial register stack
+  // |   task state and   |
+  // |  register values   |
+  // |                    | <- task state
+  // +--------------------+
+  // The space between the task state and the initial register stack is
+  // used as a stack by the ISR that first switches to the task.
+  //
+  // The stack will have the following layout:
+  // +--------------------+ <- RBP
   // |                    | <- padding
-  // |       16 Kib       | <- RSP
+  // |      256 Kib       | <- RSP
   // |     stack space    |
-  // |                    |
+  // |  (top 16 KiB are   |
+  // |  mapped now, and   |
+  // |  the rest on first |
+  // |       touch)       |
+  // |--------------------|
+  // |  4 Kib guard page  |
   // +--------------------+
-  task_mem = k_memory_alloc_pages(5);
+  task_mem = k_memory_alloc_pages(1);
   if (task_mem == NULL)
   {
     return NULL;
   }
 
+  stack = k_paging_reserve(TASK_STACK_SIZE, PAGING_GUARD);
+  if (stack == 0)
+  {
+    k_memory_free_pages(task_mem);
+    return NULL;
+  }
+
+  if (!k_paging_commit(stack + TASK_STACK_SIZE - commit, commit))
+  {
+    k_paging_release(stack);
+    k_memory_free_pages(task_mem);
+    return NULL;
+  }
+
   // Calculate the initial stack and base pointer.
   // The stack pointer should be 16 byte aligned, and we should
   // reserve space on the initial stack for the ISR stack, the
   // register values, and the k_task_end function.
-  rbp = PTR_TO_N(task_mem) + 0x4000;
+  rbp = stack + TASK_STACK_SIZE;
   rsp = rbp - TASK_STACK_SPACE;
 
 
@@ -306,15 +949,17 @@ k_task* k_task_create(void (action)())
   *(k_regn*)(rsp) = PTR_TO_N(k_syscall_stop);
 
   // The memory that will hold the task state will start
-  // at at an offset of 16 bytes from the start of the fifth page.
-  k_task* task = (k_task*)(rbp + 0x10);
+  // at at an offset of 16 bytes from the start of the task memory.
+  k_task* task = (k_task*)(PTR_TO_N(task_mem) + 0x10);
 
-  // The register stack memory will start at at an offset of 240 bytes
-  // from the start of the fifth page.
+  // The register stack memory will start at at an offset of 3920 bytes
+  // from the start of the task memory, so it ends just before the end
+  // of the page.
   // This leaves sufficient space between the task state memory and
-  // the initial register stack.
+  // the initial register stack for the ISR to call k_task_switch_done
+  // after it has switched to the register stack.
   // This address must be a multiple of 16.
-  task->regs = (k_regn*)(rbp + 0xF0);
+  task->regs = (k_regn*)(PTR_TO_N(task_mem) + 0xF50);
 
 
   // Build an ISR stack whose values will be popped
@@ -331,79 +976,422 @@ k_task* k_task_create(void (action)())
 
   // All tasks are created with a status of NEW.
   task->status = TASK_NEW;
+  task->priority = TASK_PRIORITY_NORMAL;
 
   // For now, the ID will just be the global task count incremented by 1.
-  task->id = ++g_task_count;
+  task->id = __sync_add_and_fetch(&g_task_count, 1);
 
-  // Save the base address of task memory so it can be freed later.
+  // Save the base address of task memory and the stack
+  // so they can be freed later.
   task->mem_base = task_mem;
+  task->stack = stack;
 
   task->next = NULL;
+  task->switching = 0;
+
+  // New tasks may run on any processor, and they haven't run yet.
+  task->affinity = TASK_AFFINITY_ALL;
+  task->cpu = -1;
+  task->last_ran = 0;
+  task->queue = -1;
+  task->level = 0;
+  task->wait_key = NULL;
+  task->wait_space = NULL;
+
+  k_timer_setup(&task->timer, wake_task, task);
+
+  // Tasks use the kernel's address space unless they're isolated.
+  task->space = NULL;
 
   return task;
 }
 
-void k_task_destroy(k_task* t)
+
+k_task* k_task_create(void (action)())
+{
+  return create(action, TASK_STACK_COMMIT);
+}
+
+
+int k_task_isolate(k_task* t)
 {
+  if (t->status != TASK_NEW || t->space != NULL)
+  {
+    return 0;
+  }
+
+  t->space = k_paging_create_space();
+
+  return t->space != NULL;
+}
+
+int k_task_share_space(k_task* t, k_task* owner)
+{
+  if (t->status != TASK_NEW || t->space != NULL || owner->space == NULL)
+  {
+    return 0;
+  }
+
+  t->space = k_paging_share_space(owner->space);
+
+  return 1;
+}
+
+int k_task_destroy(k_task* t)
+{
+  if (t->space != NULL && !k_paging_destroy_space(t->space))
+  {
+    return 0;
+  }
+
+  k_timer_cancel(&t->timer);
+
+  k_paging_release(t->stack);
+
   // The memory pointed to by a task's mem_base field includes the
   // task itself, so we can just free that pointer and be done with it.
   k_memory_free_pages(t->mem_base);
+
+  return 1;
 }
 
 void k_task_schedule(k_task* t)
 {
-  // If there are no tasks in the global list yet,
-  // then this task is the first.
-  if (g_task_list == NULL)
+  // The run queues are also used by the timer interrupt.
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  // Mark the task as RUNNING.
+  t->status = TASK_RUNNING;
+
+  // If no task has been scheduled yet, then this task is the first,
+  // and it represents the current thread of execution.
+  k_cpu* cpu = SMP_THIS_CPU();
+  if (cpu->current == NULL)
   {
-    t->status = TASK_RUNNING;
-    g_task_list = t;
-    g_current_task = t;
-    return;
+    t->cpu = cpu->index;
+    cpu->current = t;
+    cpu->slice_left = s_time_slice;
   }
+  else
+  {
+    enqueue(home_queue(t), t, 0);
+  }
+
+  k_set_rflags(flags);
+}
 
-  k_task* node = g_task_list;
 
-  // If there is only one task in the list,
-  // create a circular linked list where the
-  // two entries point to each other.
-  if (node->next == NULL)
+/**
+ * Locks the run queue that a task is waiting in.
+ * The task may be moved to another run queue by another processor
+ * until the lock is held, so the queue is checked again afterward.
+ * This must be called with interrupts disabled.
+ *
+ * Params:
+ *   k_task* - a task
+ *
+ * Returns:
+ *   run_queue* - the locked run queue or NULL if the task isn't in one
+ */
+static run_queue* lock_queue_of(k_task* t)
+{
+  for (;;)
+  {
+    int index = t->queue;
+    if (index < 0)
+    {
+      return NULL;
+    }
+
+    run_queue* q = &s_queues[index];
+    k_ticket_acquire(&q->lock);
+
+    if (t->queue == index)
+    {
+      return q;
+    }
+
+    k_ticket_release(&q->lock);
+  }
+}
+
+
+void k_task_set_priority(k_task* t, int priority)
+{
+  if (priority < 0 || priority >= TASK_PRIORITY_COUNT)
   {
-    t->status = TASK_RUNNING;
-    node->next = t;
-    t->next = node;
     return;
   }
 
-  // Insert the new task in between the first and second tasks.
-  t->next = node->next;
-  node->next = t;
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
 
-  // Mark the task as RUNNING.
-  t->status = TASK_RUNNING;
+  // A task that is waiting in a run queue has to be moved to the
+  // queue for its new priority. Tasks that are running on a processor
+  // aren't in any run queue.
+  run_queue* q = lock_queue_of(t);
+
+  t->priority = priority;
+
+  if (q != NULL)
+  {
+    run_remove(q, t);
+    run_push(q, t);
+    k_ticket_release(&q->lock);
+  }
+
+  k_set_rflags(flags);
 }
 
+
+int k_task_set_affinity(k_task* t, uint64_t mask)
+{
+  uint32_t count = k_smp_count();
+  if (count < 64)
+  {
+    mask &= ((uint64_t)1 << count) - 1;
+  }
+
+  if (mask == 0)
+  {
+    return 0;
+  }
+
+  k_regn flags = k_get_rflags();
+  k_disable_interrupts();
+
+  t->affinity = mask;
+
+  // A task that is waiting on a processor it may no longer run on is
+  // moved right away. A task that is running on such a processor keeps
+  // running until its next switch, and then goes to an allowed one.
+  run_queue* q = lock_queue_of(t);
+  if (q != NULL)
+  {
+    int moved = 0;
+    if (!allowed(t, q - s_queues))
+    {
+      run_remove(q, t);
+      moved = 1;
+    }
+
+    k_ticket_release(&q->lock);
+
+    if (moved)
+    {
+      enqueue(home_queue(t), t, 0);
+    }
+  }
+
+  k_set_rflags(flags);
+
+  return 1;
+}
+
+
 k_regn* k_task_stop(k_regn* regs)
 {
-  g_current_task->status = TASK_STOPPED;
+  k_cpu* cpu = SMP_THIS_CPU();
+
+  if (cpu->current == NULL)
+  {
+    return regs;
+  }
+
+  cpu->current->status = TASK_STOPPED;
+
+  return switch_task(cpu, regs, 0);
+}
+
+k_regn* k_task_sleep(k_regn* regs, k_regn ticks)
+{
+  k_cpu* cpu = SMP_THIS_CPU();
+  k_task* t = cpu->current;
+
+  // Idle tasks can't sleep, and neither can the current thread of
+  // execution before any task has been scheduled.
+  if (t == NULL || t == cpu->idle)
+  {
+    return regs;
+  }
+
+  // Set the current task's status to SLEEPING and start its timer.
+  // The task is woken by the timer interrupt once the timer expires,
+  // which may happen on another processor before this one has switched
+  // away from it, so it's marked as switching first.
+  t->switching = 1;
+  t->status = TASK_SLEEPING;
+  k_timer_start(&t->timer, ticks, 0);
+
+  return switch_task(cpu, regs, 0);
+}
+
+
+k_regn* k_task_wait(
+  k_regn* regs,
+  k_wait_queue* q,
+  int (ready)(void*),
+  void* data
+)
+{
+  k_cpu* cpu = SMP_THIS_CPU();
+  k_task* t = cpu->current;
+
+  // Idle tasks can't sleep, so they just return and try again.
+  if (t == NULL || t == cpu->idle)
+  {
+    return regs;
+  }
+
+  k_ticket_acquire(&q->lock);
+
+  // The task may be woken as soon as it's in the wait queue, so it's
+  // marked as switching first.
+  t->switching = 1;
+  t->status = TASK_SLEEPING;
+  t->next = NULL;
+
+  if (q->tail == NULL)
+  {
+    q->head = t;
+  }
+  else
+  {
+    q->tail->next = t;
+  }
+  q->tail = t;
+
+  // Whatever the task is waiting for may have happened on another
+  // processor before the task was in the queue. The waker changes the
+  // condition before it checks the queue, and the task is put in the
+  // queue before the condition is checked again, so at least one of
+  // them sees the other.
+  __sync_synchronize();
+
+  if (ready != NULL && ready(data))
+  {
+    queue_remove(q, t);
+    t->status = TASK_RUNNING;
+    t->switching = 0;
+    k_ticket_release(&q->lock);
+
+    return regs;
+  }
+
+  k_ticket_release(&q->lock);
 
-  return k_task_switch(regs);
+  return switch_task(cpu, regs, 0);
 }
 
-k_regn* k_task_sleep(k_regn* regs, k_regn* val, k_regn typ, k_regn ticks)
+
+int k_task_wake(k_wait_queue* q, int flags)
 {
-  // Set the synchronization value and type in the current task,
-  // then set the current task's status to SLEEPING.
-  g_current_task->sync_val = val;
-  g_current_task->sync_type = typ;
-  g_current_task->ticks = g_pit_ticks;
-  g_current_task->limit = ticks;
+  int count = 0;
+
+  // The run queues are also used by the timer interrupt.
+  k_regn rflags = k_get_rflags();
+  k_disable_interrupts();
+  k_ticket_acquire(&q->lock);
+
+  k_cpu* cpu = SMP_THIS_CPU();
+
+  while (q->head != NULL)
+  {
+    k_task* t = q->head;
+
+    q->head = t->next;
+    if (q->head == NULL)
+    {
+      q->tail = NULL;
+    }
+
+    t->status = TASK_RUNNING;
 
-  g_current_task->status = TASK_SLEEPING;
+    // A task that should run first is put on the waker's processor
+    // if it's allowed to run there, so that it runs as soon as the
+    // waker yields.
+    if ((flags & TASK_WAKE_FIRST) && allowed(t, cpu->index))
+    {
+      enqueue(cpu->queue, t, 1);
+    }
+    else
+    {
+      enqueue(home_queue(t), t, flags & TASK_WAKE_FIRST);
+    }
+    count++;
 
-  return k_task_switch(regs);
+    if (!(flags & TASK_WAKE_ALL))
+    {
+      break;
+    }
+  }
+
+  k_ticket_release(&q->lock);
+  k_set_rflags(rflags);
+
+  return count;
 }
 
+
+int k_task_wake_key(
+  k_wait_queue* q,
+  const void* key,
+  const void* space,
+  int max
+)
+{
+  int count = 0;
+
+  k_regn rflags = k_get_rflags();
+  k_disable_interrupts();
+  k_ticket_acquire(&q->lock);
+
+  k_task* prev = NULL;
+  k_task* t = q->head;
+
+  while (t != NULL && count < max)
+  {
+    k_task* next = t->next;
+
+    if (t->wait_key != key || t->wait_space != space)
+    {
+      prev = t;
+      t = next;
+      continue;
+    }
+
+    if (prev == NULL)
+    {
+      q->head = next;
+    }
+    else
+    {
+      prev->next = next;
+    }
+
+    if (q->tail == t)
+    {
+      q->tail = prev;
+    }
+
+    t->next = NULL;
+    t->wait_key = NULL;
+    t->wait_space = NULL;
+    t->status = TASK_RUNNING;
+    enqueue(home_queue(t), t, 0);
+    count++;
+
+    t = next;
+  }
+
+  k_ticket_release(&q->lock);
+  k_set_rflags(rflags);
+
+  return count;
+}
+
+
 void* k_task_get_io_buffer(int type)
 {
   switch (type)
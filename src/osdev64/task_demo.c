@@ -6,12 +6,15 @@
 #include "osdev64/syscall.h"
 #include "osdev64/instructor.h"
 #include "osdev64/ps2.h"
+#include "osdev64/paging.h"
+#include "osdev64/smp.h"
 
 #include "klibc/stdio.h"
 
 k_lock* demo_lock;
 k_semaphore* demo_sem_producer;
 k_semaphore* demo_sem_consumer;
+k_futex demo_futex;
 
 k_regn g_mutex_data[3];
 k_regn g_sem_data[3];
@@ -22,6 +25,19 @@ static int mutex_data;
 
 static int64_t semaphore_data;
 
+// Only the holder of the futex lock should modify this value.
+static int futex_data;
+
+// futex word and counter of futex demo 2
+// They're in the private half of the address space that the demo's
+// tasks share.
+static k_regn* private_futex;
+
+// the address of the first private range reserved in the address
+// space demo and the number of tasks that saw the wrong thing
+static k_regn space_addr;
+static int64_t space_errors;
+
 // Three contenders for a mutex lock.
 // One does busy waiting, the other two sleep.
 void mutex_demo_1()
@@ -45,21 +61,18 @@ void mutex_demo_1()
 
   while (a != NULL || b != NULL || c != NULL)
   {
-    if (a != NULL && a->status == TASK_REMOVED)
+    if (a != NULL && a->status == TASK_REMOVED && k_task_destroy(a))
     {
-      k_task_destroy(a);
       a = NULL;
     }
 
-    if (b != NULL && b->status == TASK_REMOVED)
+    if (b != NULL && b->status == TASK_REMOVED && k_task_destroy(b))
     {
-      k_task_destroy(b);
       b = NULL;
     }
 
-    if (c != NULL && c->status == TASK_REMOVED)
+    if (c != NULL && c->status == TASK_REMOVED && k_task_destroy(c))
     {
-      k_task_destroy(c);
       c = NULL;
     }
   }
@@ -118,24 +131,21 @@ void semaphore_demo_1()
     {
       k_semaphore_wait(demo_sem_producer, SYNC_SLEEP);
       msg_count++;
-      k_semaphore_signal(demo_sem_consumer);
+      k_semaphore_signal(demo_sem_consumer, SYNC_NO_YIELD);
     }
 
-    if (a != NULL && a->status == TASK_REMOVED)
+    if (a != NULL && a->status == TASK_REMOVED && k_task_destroy(a))
     {
-      k_task_destroy(a);
       a = NULL;
     }
 
-    if (b != NULL && b->status == TASK_REMOVED)
+    if (b != NULL && b->status == TASK_REMOVED && k_task_destroy(b))
     {
-      k_task_destroy(b);
       b = NULL;
     }
 
-    if (c != NULL && c->status == TASK_REMOVED)
+    if (c != NULL && c->status == TASK_REMOVED && k_task_destroy(c))
     {
-      k_task_destroy(c);
       c = NULL;
     }
   }
@@ -159,12 +169,183 @@ void semaphore_demo_1()
   );
 }
 
+// Three tasks take turns with a futex lock.
+// Each one sleeps while holding the lock, so the others have to wait
+// for it in the kernel.
+void futex_demo_1()
+{
+  futex_data = 0;
+  demo_futex = 0;
+
+  k_task* a = k_task_create(demo_futex_task_action);
+  k_task* b = k_task_create(demo_futex_task_action);
+  k_task* c = k_task_create(demo_futex_task_action);
+
+  k_task_schedule(a);
+  k_task_schedule(b);
+  k_task_schedule(c);
+
+  while (a != NULL || b != NULL || c != NULL)
+  {
+    if (a != NULL && a->status == TASK_REMOVED && k_task_destroy(a))
+    {
+      a = NULL;
+    }
+
+    if (b != NULL && b->status == TASK_REMOVED && k_task_destroy(b))
+    {
+      b = NULL;
+    }
+
+    if (c != NULL && c->status == TASK_REMOVED && k_task_destroy(c))
+    {
+      c = NULL;
+    }
+  }
+
+  if (futex_data != 9 || demo_futex != 0)
+  {
+    fprintf(
+      stddbg,
+      "futex demo 1 failed: expected: 9, actual: %d\n",
+      futex_data
+    );
+    return;
+  }
+
+  fprintf(
+    stddbg,
+    "futex demo 1 passed\n"
+  );
+}
+
+// Three tasks that share an address space take turns with a futex lock
+// whose word is in the private half of it.
+// This has to run in a task with its own address space.
+void futex_demo_2()
+{
+  private_futex = (k_regn*)k_paging_reserve(
+    0x1000,
+    PAGING_PRIVATE | PAGING_ZERO
+  );
+  if (private_futex == NULL)
+  {
+    fprintf(stddbg, "failed to reserve private memory for futex demo 2\n");
+    return;
+  }
+
+  k_task* self = SMP_CPU_FIELD(current);
+
+  k_task* a = k_task_create(demo_private_futex_task_action);
+  k_task* b = k_task_create(demo_private_futex_task_action);
+  k_task* c = k_task_create(demo_private_futex_task_action);
+
+  if (
+    !k_task_share_space(a, self)
+    || !k_task_share_space(b, self)
+    || !k_task_share_space(c, self)
+  )
+  {
+    fprintf(stddbg, "failed to share the address space of futex demo 2\n");
+    return;
+  }
+
+  k_task_schedule(a);
+  k_task_schedule(b);
+  k_task_schedule(c);
+
+  while (a != NULL || b != NULL || c != NULL)
+  {
+    if (a != NULL && a->status == TASK_REMOVED && k_task_destroy(a))
+    {
+      a = NULL;
+    }
+
+    if (b != NULL && b->status == TASK_REMOVED && k_task_destroy(b))
+    {
+      b = NULL;
+    }
+
+    if (c != NULL && c->status == TASK_REMOVED && k_task_destroy(c))
+    {
+      c = NULL;
+    }
+  }
+
+  k_regn data = private_futex[1];
+  k_regn word = private_futex[0];
+  k_paging_release(PTR_TO_N(private_futex));
+
+  if (data != 9 || word != 0)
+  {
+    fprintf(
+      stddbg,
+      "futex demo 2 failed: expected: 9, actual: %llu\n",
+      data
+    );
+    return;
+  }
+
+  fprintf(
+    stddbg,
+    "futex demo 2 passed\n"
+  );
+}
+
+// Two tasks with their own address spaces use the same address.
+// Each one writes its ID there and sleeps, so if they didn't have
+// their own memory, one of them would see the other's ID.
+void space_demo_1()
+{
+  space_addr = 0;
+  space_errors = 0;
+
+  k_task* a = k_task_create(demo_space_task_action);
+  k_task* b = k_task_create(demo_space_task_action);
+
+  if (!k_task_isolate(a) || !k_task_isolate(b))
+  {
+    fprintf(stddbg, "failed to create demo address spaces\n");
+    return;
+  }
+
+  k_task_schedule(a);
+  k_task_schedule(b);
+
+  while (a != NULL || b != NULL)
+  {
+    if (a != NULL && a->status == TASK_REMOVED && k_task_destroy(a))
+    {
+      a = NULL;
+    }
+
+    if (b != NULL && b->status == TASK_REMOVED && k_task_destroy(b))
+    {
+      b = NULL;
+    }
+  }
+
+  if (space_errors != 0)
+  {
+    fprintf(
+      stddbg,
+      "address space demo 1 failed: errors: %lld\n",
+      space_errors
+    );
+    return;
+  }
+
+  fprintf(
+    stddbg,
+    "address space demo 1 passed\n"
+  );
+}
+
 void keyboard_demo()
 {
   k_task* kbd_demo = k_task_create(demo_keyboard_task_action);
   k_task_schedule(kbd_demo);
-  while (kbd_demo->status != TASK_REMOVED);
-  k_task_destroy(kbd_demo);
+  while (kbd_demo->status != TASK_REMOVED || !k_task_destroy(kbd_demo));
 }
 
 
@@ -182,7 +363,7 @@ void demo_mutex_task_a_action()
     mutex_data++;
     fprintf(stddbg, "Mutex task A has the lock.\n");
 
-    k_mutex_release(demo_lock);
+    k_mutex_release(demo_lock, SYNC_NO_YIELD);
     // k_syscall_sleep(150);
   }
 }
@@ -192,12 +373,12 @@ void demo_mutex_task_b_action()
   for (int i = 0; i < 1; i++)
   {
     k_mutex_acquire(demo_lock, SYNC_SPIN);
-    k_syscall_sleep(120);
+    k_syscall_sleep(TIMER_HZ);
 
     mutex_data++;
     fprintf(stddbg, "Mutex task B has the lock.\n");
 
-    k_mutex_release(demo_lock);
+    k_mutex_release(demo_lock, SYNC_NO_YIELD);
     // k_syscall_sleep(180);
   }
 }
@@ -212,7 +393,7 @@ void demo_mutex_task_c_action()
     mutex_data++;
     fprintf(stddbg, "Mutex task C has the lock.\n");
 
-    k_mutex_release(demo_lock);
+    k_mutex_release(demo_lock, SYNC_NO_YIELD);
     // k_syscall_sleep(160);
   }
 }
@@ -241,7 +422,7 @@ void demo_sem_task_a_action()
     );
     k_xadd(1, &semaphore_data);
     // k_syscall_sleep(120);
-    k_semaphore_signal(demo_sem_producer);
+    k_semaphore_signal(demo_sem_producer, SYNC_NO_YIELD);
   }
 }
 
@@ -259,7 +440,7 @@ void demo_sem_task_b_action()
     );
     k_xadd(1, &semaphore_data);
     // k_syscall_sleep(120);
-    k_semaphore_signal(demo_sem_producer);
+    k_semaphore_signal(demo_sem_producer, SYNC_NO_YIELD);
   }
 }
 
@@ -276,8 +457,8 @@ void demo_sem_task_c_action()
       *demo_sem_producer
     );
     k_xadd(1, &semaphore_data);
-    k_syscall_sleep(120);
-    k_semaphore_signal(demo_sem_producer);
+    k_syscall_sleep(TIMER_HZ);
+    k_semaphore_signal(demo_sem_producer, SYNC_NO_YIELD);
   }
 }
 //==========================================
@@ -286,6 +467,86 @@ void demo_sem_task_c_action()
 
 
 
+
+//==========================================
+// BEGIN futex demo
+//==========================================
+void demo_futex_task_action()
+{
+  for (int i = 0; i < 3; i++)
+  {
+    k_futex_lock(&demo_futex);
+
+    // Another task would overwrite the increment
+    // if it got in while this one sleeps.
+    int data = futex_data;
+    k_syscall_sleep(TIMER_HZ / 100);
+    futex_data = data + 1;
+
+    k_futex_unlock(&demo_futex);
+  }
+}
+
+// The first word of the private page is the futex word,
+// and the second one is the counter that it protects.
+void demo_private_futex_task_action()
+{
+  for (int i = 0; i < 3; i++)
+  {
+    k_futex_lock(&private_futex[0]);
+
+    k_regn data = private_futex[1];
+    k_syscall_sleep(TIMER_HZ / 100);
+    private_futex[1] = data + 1;
+
+    k_futex_unlock(&private_futex[0]);
+  }
+}
+//==========================================
+// END futex demo
+//==========================================
+
+
+
+
+//==========================================
+// BEGIN address space demo
+//==========================================
+void demo_space_task_action()
+{
+  k_regn id = SMP_CPU_FIELD(current)->id;
+
+  k_regn* data = (k_regn*)k_paging_reserve(0x1000, PAGING_PRIVATE);
+  if (data == NULL)
+  {
+    k_xadd(1, &space_errors);
+    return;
+  }
+
+  // Each private half starts out empty, so both tasks
+  // should get the same address.
+  k_regn first = __sync_val_compare_and_swap(&space_addr, 0, PTR_TO_N(data));
+  if (first != 0 && first != PTR_TO_N(data))
+  {
+    k_xadd(1, &space_errors);
+  }
+
+  data[0] = id;
+  k_syscall_sleep(TIMER_HZ / 100);
+
+  if (data[0] != id)
+  {
+    k_xadd(1, &space_errors);
+  }
+
+  k_paging_release(PTR_TO_N(data));
+}
+//==========================================
+// END address space demo
+//==========================================
+
+
+
 void demo_keyboard_task_action()
 {
   k_ps2_event e;
@@ -0,0 +1,303 @@
+#include "osdev64/timer.h"
+#include "osdev64/instructor.h"
+#include "osdev64/control.h"
+#include "osdev64/spinlock.h"
+#include "osdev64/smp.h"
+
+#include "klibc/stdio.h"
+
+
+// number of levels in the wheel
+#define TIMER_LEVELS 4
+
+// number of bits of a tick used to select a slot in each level
+#define TIMER_SLOT_BITS 6
+
+// number of slots in each level
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+// number of ticks covered by the whole wheel
+// Timers further away than this are put in the last slot they can reach
+// and are moved back up when that slot comes around.
+#define TIMER_SPAN ((uint64_t)1 << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+
+// the timing wheel
+static k_timer* s_wheel[TIMER_LEVELS][TIMER_SLOTS];
+
+// the current tick
+static uint64_t s_now = 0;
+
+// lock for the wheel
+// Only the BSP advances the wheel, but timers are started and cancelled
+// by every processor.
+static k_ticket_lock s_lock = K_TICKET_LOCK_INIT(NULL);
+
+// tick on which the BSP's idle period ends, or 0 while the BSP is ticking
+// The BSP stops its tick while it's idle, so a timer started by another
+// processor that expires before then has to wake it up.
+static uint64_t s_idle_until = 0;
+
+
+/**
+ * Puts a timer in the slot for its expiration tick.
+ * The expiration must not be before the current tick.
+ *
+ * Params:
+ *   k_timer* - a timer
+ */
+static void wheel_insert(k_timer* t)
+{
+  uint64_t delta = t->expires - s_now;
+  uint64_t when = t->expires;
+
+  // Timers that are too far away go in the last slot of the top level
+  // that can be reached from here.
+  if (delta >= TIMER_SPAN)
+  {
+    when = s_now + TIMER_SPAN - 1;
+    delta = TIMER_SPAN - 1;
+  }
+
+  // Find the lowest level that can hold the timer.
+  int level = 0;
+  while (level < TIMER_LEVELS - 1
+    && delta >= ((uint64_t)1 << ((level + 1) * TIMER_SLOT_BITS)))
+  {
+    level++;
+  }
+
+  int slot = (when >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+
+  t->slot = &s_wheel[level][slot];
+  t->prev = NULL;
+  t->next = *t->slot;
+  if (t->next != NULL)
+  {
+    t->next->prev = t;
+  }
+  *t->slot = t;
+}
+
+
+/**
+ * Removes a timer from the wheel.
+ *
+ * Params:
+ *   k_timer* - an active timer
+ */
+static void wheel_remove(k_timer* t)
+{
+  if (t->prev != NULL)
+  {
+    t->prev->next = t->next;
+  }
+  else
+  {
+    *t->slot = t->next;
+  }
+
+  if (t->next != NULL)
+  {
+    t->next->prev = t->prev;
+  }
+
+  t->next = NULL;
+  t->prev = NULL;
+  t->slot = NULL;
+}
+
+
+/**
+ * Moves all the timers in a slot of a higher level down to the
+ * levels below it.
+ *
+ * Params:
+ *   int - a level greater than 0
+ *
+ * Returns:
+ *   int - the index of the slot that was moved
+ */
+static int cascade(int level)
+{
+  int slot = (s_now >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+
+  k_timer* t = s_wheel[level][slot];
+  s_wheel[level][slot] = NULL;
+
+  while (t != NULL)
+  {
+    k_timer* next = t->next;
+    wheel_insert(t);
+    t = next;
+  }
+
+  return slot;
+}
+
+
+void k_timer_init()
+{
+  for (int level = 0; level < TIMER_LEVELS; level++)
+  {
+    for (int slot = 0; slot < TIMER_SLOTS; slot++)
+    {
+      s_wheel[level][slot] = NULL;
+    }
+  }
+
+  s_now = 0;
+}
+
+
+void k_timer_setup(k_timer* t, void (callback)(void*), void* data)
+{
+  t->expires = 0;
+  t->period = 0;
+  t->callback = callback;
+  t->data = data;
+  t->next = NULL;
+  t->prev = NULL;
+  t->slot = NULL;
+}
+
+
+void k_timer_start(k_timer* t, uint64_t ticks, uint64_t period)
+{
+  // The wheel is also used by the timer interrupt.
+  k_regn flags = k_ticket_acquire_irqsave(&s_lock);
+
+  if (t->slot != NULL)
+  {
+    wheel_remove(t);
+  }
+
+  t->expires = s_now + (ticks == 0 ? 1 : ticks);
+  t->period = period;
+
+  wheel_insert(t);
+
+  int wake = (t->expires < s_idle_until);
+
+  k_ticket_release_irqrestore(&s_lock, flags);
+
+  // The BSP then counts the ticks it skipped and stops its tick again
+  // until the new timer expires.
+  if (wake)
+  {
+    k_smp_wake(0);
+  }
+}
+
+
+int k_timer_cancel(k_timer* t)
+{
+  k_regn flags = k_ticket_acquire_irqsave(&s_lock);
+
+  int active = (t->slot != NULL);
+  if (active)
+  {
+    wheel_remove(t);
+  }
+
+  k_ticket_release_irqrestore(&s_lock, flags);
+
+  return active;
+}
+
+
+uint64_t k_timer_now()
+{
+  return s_now;
+}
+
+
+uint64_t k_timer_idle()
+{
+  uint64_t next = TIMER_NONE;
+
+  k_regn flags = k_ticket_acquire_irqsave(&s_lock);
+
+  // The slots of each level are visited in order, one every 64^level
+  // ticks, so the first slot that isn't empty in each level tells us
+  // when that level next needs attention.
+  for (int level = 0; level < TIMER_LEVELS; level++)
+  {
+    int shift = level * TIMER_SLOT_BITS;
+
+    for (uint64_t i = 1; i <= TIMER_SLOTS; i++)
+    {
+      uint64_t when = ((s_now >> shift) + i) << shift;
+
+      if (s_wheel[level][(when >> shift) & (TIMER_SLOTS - 1)] != NULL)
+      {
+        if (when - s_now < next)
+        {
+          next = when - s_now;
+        }
+        break;
+      }
+    }
+  }
+
+  s_idle_until = (next == TIMER_NONE) ? TIMER_NONE : s_now + next;
+
+  k_ticket_release_irqrestore(&s_lock, flags);
+
+  return next;
+}
+
+
+void k_timer_tick()
+{
+  // This is called with interrupts disabled.
+  k_ticket_acquire(&s_lock);
+
+  s_now++;
+  s_idle_until = 0;
+
+  // Every time a level wraps around, the next slot of the level above it
+  // is moved down.
+  for (int level = 1; level < TIMER_LEVELS; level++)
+  {
+    if ((s_now >> ((level - 1) * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1))
+    {
+      break;
+    }
+
+    if (cascade(level) != 0)
+    {
+      break;
+    }
+  }
+
+  // Every timer in the current slot of the first level expires now.
+  k_timer** head = &s_wheel[0][s_now & (TIMER_SLOTS - 1)];
+
+  while (*head != NULL)
+  {
+    k_timer* t = *head;
+    wheel_remove(t);
+
+    // Restart periodic timers before calling the callback,
+    // so the callback can cancel them.
+    if (t->period)
+    {
+      t->expires += t->period;
+      if (t->expires <= s_now)
+      {
+        t->expires = s_now + 1;
+      }
+      wheel_insert(t);
+    }
+
+    // The lock is released while the callback runs, since callbacks
+    // may start or cancel timers. The head of the slot is read again
+    // afterward, since the callback may have changed the slot.
+    k_ticket_release(&s_lock);
+    t->callback(t->data);
+    k_ticket_acquire(&s_lock);
+  }
+
+  k_ticket_release(&s_lock);
+}
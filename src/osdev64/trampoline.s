@@ -0,0 +1,161 @@
+# The trampoline is the first code that an application processor (AP)
+# executes after it receives a startup IPI.
+# It's copied to a page below 1 MiB, and the startup IPI tells the AP to
+# start executing in real mode at the beginning of that page.
+# From there, it enters protected mode, enables paging and long mode, and
+# calls the entry point in the trampoline data with the argument in the
+# trampoline data.
+#
+# The trampoline doesn't run at the address it was linked at, so
+# everything in it is addressed relative to k_smp_trampoline, and the
+# physical address of the page is kept in EBX.
+.section .text
+
+.global k_smp_trampoline
+.global k_smp_trampoline_data
+.global k_smp_trampoline_end
+
+# offsets of the values in the trampoline data
+.set TRAMP_CR3_LOW, k_smp_trampoline_data - k_smp_trampoline + 0x00
+.set TRAMP_CR4, k_smp_trampoline_data - k_smp_trampoline + 0x04
+.set TRAMP_CR0, k_smp_trampoline_data - k_smp_trampoline + 0x08
+.set TRAMP_EFER, k_smp_trampoline_data - k_smp_trampoline + 0x0C
+.set TRAMP_CR3, k_smp_trampoline_data - k_smp_trampoline + 0x10
+.set TRAMP_STACK, k_smp_trampoline_data - k_smp_trampoline + 0x18
+.set TRAMP_ENTRY, k_smp_trampoline_data - k_smp_trampoline + 0x20
+.set TRAMP_ARG, k_smp_trampoline_data - k_smp_trampoline + 0x28
+
+# offsets of the temporary GDT and the far pointers
+.set TRAMP_GDT, tramp_gdt - k_smp_trampoline
+.set TRAMP_GDTR, tramp_gdtr - k_smp_trampoline
+.set TRAMP_PM, tramp_pm - k_smp_trampoline
+.set TRAMP_PM_PTR, tramp_pm_ptr - k_smp_trampoline
+.set TRAMP_LM, tramp_lm - k_smp_trampoline
+.set TRAMP_LM_PTR, tramp_lm_ptr - k_smp_trampoline
+
+# IA32_EFER MSR
+.set TRAMP_EFER_MSR, 0xC0000080
+
+
+.code16
+k_smp_trampoline:
+  cli
+  cld
+
+  # CS is the page number of the trampoline shifted left by 8,
+  # so the physical address of the trampoline is CS * 16.
+  mov %cs, %ax
+  mov %ax, %ds
+  xor %ebx, %ebx
+  mov %ax, %bx
+  shl $4, %ebx
+
+  # Fill in the linear addresses of the temporary GDT and the
+  # protected mode and long mode entry points.
+  lea TRAMP_GDT(%ebx), %eax
+  mov %eax, TRAMP_GDTR + 2
+  lea TRAMP_PM(%ebx), %eax
+  mov %eax, TRAMP_PM_PTR
+  lea TRAMP_LM(%ebx), %eax
+  mov %eax, TRAMP_LM_PTR
+
+  # Load the temporary GDT and enter protected mode.
+  lgdtl TRAMP_GDTR
+  mov %cr0, %eax
+  or $0x1, %eax
+  mov %eax, %cr0
+
+  ljmpl *TRAMP_PM_PTR
+
+
+.code32
+tramp_pm:
+  mov $0x10, %ax
+  mov %ax, %ds
+  mov %ax, %es
+  mov %ax, %ss
+
+  # Enable PAE and the other features in CR4 that the BSP uses, except
+  # for PCIDs, which can't be enabled until the processor is in long mode.
+  mov TRAMP_CR4(%ebx), %eax
+  mov %eax, %cr4
+
+  # Load a copy of the PML4 that is below 4 GiB.
+  mov TRAMP_CR3_LOW(%ebx), %eax
+  mov %eax, %cr3
+
+  # Enable long mode (and NX if the BSP uses it).
+  mov $TRAMP_EFER_MSR, %ecx
+  mov TRAMP_EFER(%ebx), %eax
+  xor %edx, %edx
+  wrmsr
+
+  # Enable paging, which activates long mode.
+  mov TRAMP_CR0(%ebx), %eax
+  mov %eax, %cr0
+
+  ljmpl *TRAMP_LM_PTR(%ebx)
+
+
+.code64
+tramp_lm:
+  # The upper half of RBX is undefined after leaving protected mode.
+  mov %ebx, %ebx
+
+  # Switch to the kernel's PML4, which may be above 4 GiB.
+  mov TRAMP_CR3(%rbx), %rax
+  mov %rax, %cr3
+
+  mov TRAMP_STACK(%rbx), %rsp
+  xor %rbp, %rbp
+
+  # Call the entry point, which should never return.
+  mov TRAMP_ARG(%rbx), %rdi
+  mov TRAMP_ENTRY(%rbx), %rax
+  call *%rax
+
+.tramp_hang:
+  cli
+  hlt
+  jmp .tramp_hang
+
+
+# The temporary GDT
+# 0x08: 32-bit code segment
+# 0x10: data segment
+# 0x18: 64-bit code segment
+.align 16
+tramp_gdt:
+  .quad 0x0000000000000000
+  .quad 0x00CF9A000000FFFF
+  .quad 0x00CF92000000FFFF
+  .quad 0x00AF9A000000FFFF
+
+tramp_gdtr:
+  .word 31 # limit
+  .long 0  # base (filled in by the trampoline)
+
+# far pointers to the protected mode and long mode entry points
+# (the offsets are filled in by the trampoline)
+tramp_pm_ptr:
+  .long 0
+  .word 0x08
+
+tramp_lm_ptr:
+  .long 0
+  .word 0x18
+
+
+# The trampoline data is filled in by k_smp_init before each AP is started.
+.align 8
+k_smp_trampoline_data:
+  .long 0 # CR3 for enabling paging (must be below 4 GiB)
+  .long 0 # CR4 without PCIDE
+  .long 0 # CR0
+  .long 0 # low 32 bits of IA32_EFER
+  .quad 0 # CR3
+  .quad 0 # top of the stack
+  .quad 0 # entry point
+  .quad 0 # argument for the entry point
+
+k_smp_trampoline_end:
@@ -7,6 +7,7 @@
 #include "osdev64/core.h"
 #include "osdev64/file.h"
 #include "osdev64/syscall.h"
+#include "osdev64/sync.h"
 
 #include "klibc/stdio.h"
 
@@ -121,6 +122,12 @@ static char read_buffer[IO_BUF_SIZE];
  */
 static FILE* shell_stdout = NULL;
 
+/**
+ * Signaled whenever there might be something for the TTY to do,
+ * so the TTY task can sleep instead of polling.
+ */
+static k_semaphore tty_events = K_SEMAPHORE_INIT(0);
+
 // Used for decoding PS2 scancodes.
 static const char decoder_table[102] = {
   27,  49,  50,  51,  52,  53,  54,  55,  56,  57,  // escape 1 - 9
@@ -429,6 +436,12 @@ static inline char tty_shift_other(char c)
   }
 }
 
+void k_tty_notify()
+{
+  k_semaphore_signal(&tty_events, SYNC_NO_YIELD);
+}
+
+
 static void tty_action()
 {
   const k_byte* key_states = k_ps2_get_key_states();
@@ -439,8 +452,10 @@ static void tty_action()
   for (;;)
   {
     int redraw = 0;
+    int busy = 0;
     if (k_ps2_consume_event(&ke))
     {
+      busy = 1;
       char c = tty_decode(ke.i);
 
       if (ke.type == PS2_PRESSED && is_printable(c))
@@ -500,6 +515,7 @@ static void tty_action()
       {
         redraw = 1;
       }
+      busy = 1;
     }
 
     // redraw the terminal if there was an update.
@@ -507,6 +523,14 @@ static void tty_action()
     {
       tty_draw();
     }
+
+    // If there was nothing to do, then sleep until there's a key event
+    // or some output. Anything that arrived since we last checked will
+    // have already signaled the semaphore, so it won't be missed.
+    if (!busy)
+    {
+      k_semaphore_wait(&tty_events, SYNC_SLEEP);
+    }
   }
 }
 
@@ -0,0 +1,557 @@
+#include "osdev64/vmem.h"
+#include "osdev64/heap.h"
+
+#include "klibc/stdio.h"
+
+
+// tree indices
+// A free span is in the address tree and the size tree.
+// A reserved span is only in the address tree of reserved spans.
+#define BY_ADDR 0
+#define BY_SIZE 1
+
+
+/**
+ * Compares two spans in one of the trees.
+ * Spans are ordered by address in the address trees, and by size and
+ * then address in the size tree, so no two spans in a tree are equal.
+ *
+ * Returns:
+ *   int - less than 0, 0, or greater than 0 if a is before, the same as,
+ *         or after b
+ */
+static inline int compare(k_vmem_span* a, k_vmem_span* b, int t)
+{
+  if (t == BY_SIZE && a->size != b->size)
+  {
+    return a->size < b->size ? -1 : 1;
+  }
+
+  if (a->start != b->start)
+  {
+    return a->start < b->start ? -1 : 1;
+  }
+
+  return 0;
+}
+
+
+static inline int height(k_vmem_span* n, int t)
+{
+  return n == NULL ? 0 : n->height[t];
+}
+
+
+static inline void update(k_vmem_span* n, int t)
+{
+  int l = height(n->left[t], t);
+  int r = height(n->right[t], t);
+  n->height[t] = (l > r ? l : r) + 1;
+}
+
+
+static k_vmem_span* rotate_right(k_vmem_span* n, int t)
+{
+  k_vmem_span* l = n->left[t];
+  n->left[t] = l->right[t];
+  l->right[t] = n;
+  update(n, t);
+  update(l, t);
+  return l;
+}
+
+
+static k_vmem_span* rotate_left(k_vmem_span* n, int t)
+{
+  k_vmem_span* r = n->right[t];
+  n->right[t] = r->left[t];
+  r->left[t] = n;
+  update(n, t);
+  update(r, t);
+  return r;
+}
+
+
+/**
+ * Restores the AVL property of a subtree whose children are balanced
+ * but may differ in height by 2.
+ *
+ * Returns:
+ *   k_vmem_span* - the new root of the subtree
+ */
+static k_vmem_span* balance(k_vmem_span* n, int t)
+{
+  update(n, t);
+
+  int bf = height(n->left[t], t) - height(n->right[t], t);
+
+  if (bf > 1)
+  {
+    if (height(n->left[t]->left[t], t) < height(n->left[t]->right[t], t))
+    {
+      n->left[t] = rotate_left(n->left[t], t);
+    }
+    return rotate_right(n, t);
+  }
+
+  if (bf < -1)
+  {
+    if (height(n->right[t]->right[t], t) < height(n->right[t]->left[t], t))
+    {
+      n->right[t] = rotate_right(n->right[t], t);
+    }
+    return rotate_left(n, t);
+  }
+
+  return n;
+}
+
+
+/**
+ * Inserts a span into a tree.
+ *
+ * Returns:
+ *   k_vmem_span* - the new root of the tree
+ */
+static k_vmem_span* tree_insert(k_vmem_span* root, k_vmem_span* n, int t)
+{
+  if (root == NULL)
+  {
+    n->left[t] = NULL;
+    n->right[t] = NULL;
+    n->height[t] = 1;
+    return n;
+  }
+
+  if (compare(n, root, t) < 0)
+  {
+    root->left[t] = tree_insert(root->left[t], n, t);
+  }
+  else
+  {
+    root->right[t] = tree_insert(root->right[t], n, t);
+  }
+
+  return balance(root, t);
+}
+
+
+/**
+ * Removes the first span from a tree.
+ *
+ * Params:
+ *   k_vmem_span* - the root of a tree
+ *   int - the tree index
+ *   k_vmem_span** - where to put the removed span
+ *
+ * Returns:
+ *   k_vmem_span* - the new root of the tree
+ */
+static k_vmem_span* tree_remove_min(k_vmem_span* root, int t, k_vmem_span** min)
+{
+  if (root->left[t] == NULL)
+  {
+    *min = root;
+    return root->right[t];
+  }
+
+  root->left[t] = tree_remove_min(root->left[t], t, min);
+
+  return balance(root, t);
+}
+
+
+/**
+ * Removes a span from a tree.
+ * The span must be in the tree.
+ *
+ * Returns:
+ *   k_vmem_span* - the new root of the tree
+ */
+static k_vmem_span* tree_remove(k_vmem_span* root, k_vmem_span* n, int t)
+{
+  if (root == NULL)
+  {
+    return NULL;
+  }
+
+  int c = compare(n, root, t);
+
+  if (c < 0)
+  {
+    root->left[t] = tree_remove(root->left[t], n, t);
+  }
+  else if (c > 0)
+  {
+    root->right[t] = tree_remove(root->right[t], n, t);
+  }
+  else
+  {
+    // Replace the span with the first span in its right subtree.
+    if (root->left[t] == NULL)
+    {
+      return root->right[t];
+    }
+
+    if (root->right[t] == NULL)
+    {
+      return root->left[t];
+    }
+
+    k_vmem_span* min;
+    k_vmem_span* right = tree_remove_min(root->right[t], t, &min);
+    min->left[t] = root->left[t];
+    min->right[t] = right;
+    root = min;
+  }
+
+  return balance(root, t);
+}
+
+
+/**
+ * Finds the span in an address tree that starts at an address.
+ */
+static k_vmem_span* find(k_vmem_span* root, k_regn addr)
+{
+  while (root != NULL && root->start != addr)
+  {
+    root = addr < root->start ? root->left[BY_ADDR] : root->right[BY_ADDR];
+  }
+
+  return root;
+}
+
+
+/**
+ * Finds the last span in an address tree that starts before an address.
+ */
+static k_vmem_span* find_before(k_vmem_span* root, k_regn addr)
+{
+  k_vmem_span* res = NULL;
+
+  while (root != NULL)
+  {
+    if (root->start < addr)
+    {
+      res = root;
+      root = root->right[BY_ADDR];
+    }
+    else
+    {
+      root = root->left[BY_ADDR];
+    }
+  }
+
+  return res;
+}
+
+
+/**
+ * Finds the first span in the size tree that comes after a given
+ * size and address.
+ */
+static k_vmem_span* find_after(k_vmem_span* root, k_regn size, k_regn addr)
+{
+  k_vmem_span* res = NULL;
+
+  while (root != NULL)
+  {
+    if (root->size > size || (root->size == size && root->start > addr))
+    {
+      res = root;
+      root = root->left[BY_SIZE];
+    }
+    else
+    {
+      root = root->right[BY_SIZE];
+    }
+  }
+
+  return res;
+}
+
+
+// Puts a span in both free trees.
+static inline void free_insert(k_vmem* vm, k_vmem_span* n)
+{
+  vm->free_addr = tree_insert(vm->free_addr, n, BY_ADDR);
+  vm->free_size = tree_insert(vm->free_size, n, BY_SIZE);
+  vm->free_bytes += n->size;
+  vm->free_count++;
+}
+
+
+// Removes a span from both free trees.
+static inline void free_remove(k_vmem* vm, k_vmem_span* n)
+{
+  vm->free_addr = tree_remove(vm->free_addr, n, BY_ADDR);
+  vm->free_size = tree_remove(vm->free_size, n, BY_SIZE);
+  vm->free_bytes -= n->size;
+  vm->free_count--;
+}
+
+
+int k_vmem_init(k_vmem* vm, k_regn base, k_regn size)
+{
+  vm->base = base;
+  vm->size = size;
+  vm->free_addr = NULL;
+  vm->free_size = NULL;
+  vm->used = NULL;
+  vm->free_bytes = 0;
+  vm->free_count = 0;
+  vm->used_count = 0;
+
+  k_vmem_span* n = (k_vmem_span*)k_heap_alloc(sizeof(k_vmem_span));
+  if (n == NULL)
+  {
+    return 0;
+  }
+
+  n->start = base;
+  n->size = size;
+  free_insert(vm, n);
+
+  return 1;
+}
+
+
+k_regn k_vmem_alloc(k_vmem* vm, k_regn size, k_regn align, k_regn phase)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+
+  size = (size + 0xFFF) & ~((k_regn)0xFFF);
+
+  if (align < 0x1000)
+  {
+    align = 0x1000;
+  }
+
+  // The alignment must be a power of two, and the phase must be
+  // a multiple of 4096 that is less than the alignment.
+  if ((align & (align - 1)) || phase >= align || (phase & 0xFFF))
+  {
+    return 0;
+  }
+
+  // Look at the free spans from smallest to largest, starting with the
+  // smallest one that is at least as big as the request. The first one
+  // that can hold the request at the requested alignment is used.
+  // Any span that is at least (size + align - 4096) bytes can always
+  // hold it, so the search never goes past spans of that size.
+  k_vmem_span* n = find_after(vm->free_size, size - 1, ~((k_regn)0));
+  k_regn start = 0;
+
+  while (n != NULL)
+  {
+    // Find the first address in the span that is the phase
+    // plus a multiple of the alignment.
+    start = ((n->start - phase + align - 1) & ~(align - 1)) + phase;
+    if (start < n->start)
+    {
+      start += align;
+    }
+
+    if (start + size <= n->start + n->size)
+    {
+      break;
+    }
+    n = find_after(vm->free_size, n->size, n->start);
+  }
+
+  if (n == NULL)
+  {
+    return 0;
+  }
+
+  // Get the spans for the free space before and after the reserved
+  // range ahead of time, so that failure leaves everything unchanged.
+  k_vmem_span* before = NULL;
+  k_vmem_span* after = NULL;
+
+  if (start > n->start)
+  {
+    before = (k_vmem_span*)k_heap_alloc(sizeof(k_vmem_span));
+    if (before == NULL)
+    {
+      return 0;
+    }
+  }
+
+  if (start + size < n->start + n->size)
+  {
+    after = (k_vmem_span*)k_heap_alloc(sizeof(k_vmem_span));
+    if (after == NULL)
+    {
+      k_heap_free(before);
+      return 0;
+    }
+  }
+
+  free_remove(vm, n);
+
+  if (before != NULL)
+  {
+    before->start = n->start;
+    before->size = start - n->start;
+    free_insert(vm, before);
+  }
+
+  if (after != NULL)
+  {
+    after->start = start + size;
+    after->size = n->start + n->size - after->start;
+    free_insert(vm, after);
+  }
+
+  n->start = start;
+  n->size = size;
+  n->tag = 0;
+  vm->used = tree_insert(vm->used, n, BY_ADDR);
+  vm->used_count++;
+
+  return start;
+}
+
+
+k_regn k_vmem_lookup(k_vmem* vm, k_regn addr)
+{
+  k_vmem_span* n = find(vm->used, addr);
+
+  return n == NULL ? 0 : n->size;
+}
+
+
+k_vmem_span* k_vmem_find(k_vmem* vm, k_regn addr)
+{
+  // The only span that can contain the address is the last one
+  // that starts at or before it.
+  k_vmem_span* n = find_before(vm->used, addr + 1);
+  if (n == NULL || addr - n->start >= n->size)
+  {
+    return NULL;
+  }
+
+  return n;
+}
+
+
+k_regn k_vmem_free(k_vmem* vm, k_regn addr)
+{
+  k_vmem_span* n = find(vm->used, addr);
+  if (n == NULL)
+  {
+    return 0;
+  }
+
+  k_regn size = n->size;
+
+  vm->used = tree_remove(vm->used, n, BY_ADDR);
+  vm->used_count--;
+
+  // Merge with the free span before this one if they touch.
+  k_vmem_span* prev = find_before(vm->free_addr, n->start);
+  if (prev != NULL && prev->start + prev->size == n->start)
+  {
+    free_remove(vm, prev);
+    n->start = prev->start;
+    n->size += prev->size;
+    k_heap_free(prev);
+  }
+
+  // Merge with the free span after this one if they touch.
+  k_vmem_span* next = find(vm->free_addr, n->start + n->size);
+  if (next != NULL)
+  {
+    free_remove(vm, next);
+    n->size += next->size;
+    k_heap_free(next);
+  }
+
+  free_insert(vm, n);
+
+  return size;
+}
+
+
+// Frees the spans in an address tree.
+static void free_spans(k_vmem_span* n)
+{
+  if (n == NULL)
+  {
+    return;
+  }
+
+  free_spans(n->left[BY_ADDR]);
+  free_spans(n->right[BY_ADDR]);
+
+  k_heap_free(n);
+}
+
+
+void k_vmem_destroy(k_vmem* vm)
+{
+  // Free spans are in both free trees, so only the address tree
+  // is walked.
+  free_spans(vm->used);
+  free_spans(vm->free_addr);
+
+  vm->free_addr = NULL;
+  vm->free_size = NULL;
+  vm->used = NULL;
+  vm->free_bytes = 0;
+  vm->free_count = 0;
+  vm->used_count = 0;
+}
+
+
+// Prints the spans in an address tree in order.
+static void print_spans(k_vmem_span* n, char* status)
+{
+  if (n == NULL)
+  {
+    return;
+  }
+
+  print_spans(n->left[BY_ADDR], status);
+
+  fprintf(
+    stddbg,
+    "| %.16llX %.16llX %-8s |\n",
+    n->start,
+    n->start + n->size - 1,
+    status
+  );
+
+  print_spans(n->right[BY_ADDR], status);
+}
+
+
+void k_vmem_print(k_vmem* vm)
+{
+  // The largest free span is the last one in the size tree.
+  k_vmem_span* largest = vm->free_size;
+  while (largest != NULL && largest->right[BY_SIZE] != NULL)
+  {
+    largest = largest->right[BY_SIZE];
+  }
+
+  fprintf(stddbg, "+--------------------------------------------+\n");
+  fprintf(stddbg, "| base:          %.16llX            |\n", vm->base);
+  fprintf(stddbg, "| size:          %-16llu            |\n", vm->size);
+  fprintf(stddbg, "| free bytes:    %-16llu            |\n", vm->free_bytes);
+  fprintf(stddbg, "| used bytes:    %-16llu            |\n", vm->size - vm->free_bytes);
+  fprintf(stddbg, "| free spans:    %-16llu            |\n", vm->free_count);
+  fprintf(stddbg, "| used spans:    %-16llu            |\n", vm->used_count);
+  fprintf(stddbg, "| largest free:  %-16llu            |\n", largest == NULL ? 0 : largest->size);
+  fprintf(stddbg, "+--------------------------------------------+\n");
+  fprintf(stddbg, "| start            end              status   |\n");
+  fprintf(stddbg, "+--------------------------------------------+\n");
+  print_spans(vm->used, "used");
+  print_spans(vm->free_addr, "free");
+  fprintf(stddbg, "+--------------------------------------------+\n");
+}